@@ -43,6 +43,8 @@
 #ifdef TODIS
 #include "pmem.h"
 #include "pmem_latency.h"
+#include "pmem_trace.h"
+#include "pmem_spill.h"
 #endif
 
 void aofUpdateCurrentSize(void);
@@ -212,33 +214,31 @@ void aof_background_fsync(int fd) {
 }
 
 #ifdef TODIS
+/* The victims of all the shards are sealed at a new epoch, that the
+ * background job publishes once the AOF and the spill log are fsynced. */
 void aof_background_fsync_TODIS(int fd) {
-    PMEMoid *victim_first_ptr = zmalloc(sizeof(PMEMoid));
-    TX_BEGIN(server.pm_pool) {
-        struct redis_pmem_root *root;
-        root = pmemobj_direct_latency(server.pm_rootoid.oid); 
-        *victim_first_ptr = root->victim_first.oid;
-    } TX_ONABORT {
-        serverLog(LL_TODIS, "TODIS_ERROR, getting root failed");
-    } TX_END
+    /* The victims evicted so far are freed once this fsync is done. */
+    uint64_t epoch = pmemReclaimSeal();
 
     bioCreateBackgroundJob(
             BIO_AOF_FSYNC,
             (void*)(long)fd,
-            (void*)victim_first_ptr,
-            NULL);
+            (void*)(uintptr_t)epoch,
+            (void*)(long)server.pmem_spill_fd);
 }
 #endif
 
 #ifdef TODIS
 void aofFsyncWithFlushVictim(int fd) {
+    uint64_t epoch;
+
+    /* The victims are freed only once their records are on disk. */
+    pmemSpillFlush();
+    epoch = pmemReclaimSeal();
     aof_fsync(fd);
-    TX_BEGIN(server.pm_pool) {
-        struct redis_pmem_root *root = getPmemRootObject();
-        freeVictimList(root->victim_first.oid);
-    } TX_ONABORT {
-        serverLog(LL_TODIS, "TODIS_ERROR, free victim list failed: (%s)", __func__);
-    } TX_END
+    if (server.pmem_spill_fd != -1) aof_fsync(server.pmem_spill_fd);
+    pmemReclaimDurable(epoch);
+    pmemReclaimCron();
 }
 #endif
 
@@ -253,6 +253,9 @@ void stopAppendOnly(void) {
     aof_fsync(server.aof_fd);
 #endif
     close(server.aof_fd);
+#ifdef TODIS
+    pmemSpillClose();
+#endif
 
     server.aof_fd = -1;
     server.aof_selected_db = -1;
@@ -295,11 +298,21 @@ int startAppendOnly(void) {
             strerror(errno));
         return C_ERR;
     }
+#ifdef TODIS
+    if (server.pmem_spill_log && pmemSpillOpen() == C_ERR) {
+        close(server.aof_fd);
+        server.aof_fd = -1;
+        return C_ERR;
+    }
+#endif
     if (server.rdb_child_pid != -1) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already a child process saving an RDB file on disk. An AOF background was scheduled to start when possible.");
     } else if (rewriteAppendOnlyFileBackground() == C_ERR) {
         close(server.aof_fd);
+#ifdef TODIS
+        pmemSpillClose();
+#endif
         serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
         return C_ERR;
     }
@@ -333,7 +346,23 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+#ifdef TODIS
+    if (sdslen(server.aof_buf) == 0 && !pmemSpillPending()) {
+        /* The victims of the last writes are freed after an fsync: with
+         * everysec, it is scheduled even if nothing else is written. */
+        if (server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+            server.unixtime > server.aof_last_fsync &&
+            bioPendingJobsOfType(BIO_AOF_FSYNC) == 0 &&
+            pmemReclaimUnsealed())
+        {
+            aof_background_fsync_TODIS(server.aof_fd);
+            server.aof_last_fsync = server.unixtime;
+        }
+        return;
+    }
+#else
     if (sdslen(server.aof_buf) == 0) return;
+#endif
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
         sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
@@ -365,6 +394,15 @@ void flushAppendOnlyFile(int force) {
      * there is much to do about the whole server stopping for power problems
      * or alike */
 
+#ifdef TODIS
+    /* The spill log records go first, usually alone. */
+    if (pmemSpillFlush() == C_ERR) return;
+    if (sdslen(server.aof_buf) == 0) {
+        server.aof_flush_postponed_start = 0;
+        goto try_fsync;
+    }
+#endif
+
     latencyStartMonitor(latency);
     nwritten = write(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
     latencyEndMonitor(latency);
@@ -468,6 +506,9 @@ void flushAppendOnlyFile(int force) {
         server.aof_buf = sdsempty();
     }
 
+#ifdef TODIS
+try_fsync:
+#endif
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
     if (server.aof_no_fsync_on_rewrite &&
@@ -499,12 +540,14 @@ void flushAppendOnlyFile(int force) {
         server.aof_last_fsync = server.unixtime;
     }
 #ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, flushAppendOnlyFile FIRED");
+    pmemTrace(PMEM_TRACE_AOF_FLUSH, server.aof_current_size, 0);
 #endif
 }
 
 #ifdef TODIS
 void forceFlushAppendOnlyFileTODIS(void) {
+    /* The records of the victims are written before they are sealed. */
+    flushAppendOnlyFile(1);
     if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
         /* Let's try to get this data on the disk */
         aofFsyncWithFlushVictim(server.aof_fd);
@@ -635,28 +678,52 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
  * DB: target DB.
  * key: Evicted DRAM key
  * val: Evicted DRAM val
+ * expire: Absolute expire time of the key in ms, -1 for none
  */
-void feedAppendOnlyFileTODIS(redisDb *db, robj *key, robj *val) {
+void feedAppendOnlyFileTODIS(redisDb *db, robj *key, robj *val, long long expire) {
     robj *argv[3];
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, feedAppendOnlyFile START");
+
+    pmemTrace(PMEM_TRACE_AOF_FEED, key->ptr, expire);
+
+    if (server.pmem_spill_fd != -1) {
+        pmemSpillFeedSet(db->id, key, val, expire);
+        return;
+    }
 
     argv[0] = createStringObject("AOFSET", 6);
     argv[1] = key;
     argv[2] = val;
     incrRefCount(argv[1]);
     incrRefCount(argv[2]);
+    feedAppendOnlyFile(server.aofSetCommand, db->id, argv, 3);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[2]);
 
-    serverLog(LL_TODIS, "TODIS, command: %s", (char *) argv[0]->ptr);
-    serverLog(LL_TODIS, "TODIS, key: %s", (sds) argv[1]->ptr);
-    serverLog(LL_TODIS, "TODIS, value: %s", (sds) argv[2]->ptr);
+    /* The expire follows the key to the DRAM tier. */
+    if (expire != -1) {
+        argv[0] = createStringObject("PEXPIREAT", 9);
+        argv[2] = createStringObjectFromLongLong(expire);
+        feedAppendOnlyFile(server.pexpireatCommand, db->id, argv, 3);
+        decrRefCount(argv[0]);
+        decrRefCount(argv[2]);
+    }
+    decrRefCount(argv[1]);
+}
 
-    feedAppendOnlyFile(server.aofSetCommand, db->id, argv, 3);
+/* Logs the deletion of the DRAM key 'key', that the AOF may hold, to the
+ * spill log or the AOF. */
+void feedAppendOnlyFileDelTODIS(redisDb *db, sds key) {
+    robj *argv[2];
 
-    decrRefCount(argv[0]);
+    if (server.aof_state == AOF_OFF) return;
+    if (server.pmem_spill_fd != -1) {
+        pmemSpillFeedDel(db->id, key);
+        return;
+    }
+    argv[0] = shared.del;
+    argv[1] = createStringObject(key, sdslen(key));
+    feedAppendOnlyFile(server.delCommand, db->id, argv, 2);
     decrRefCount(argv[1]);
-    decrRefCount(argv[2]);
-    serverLog(LL_TODIS, "TODIS, feedAppendOnlyFile END");
 }
 #endif
 
@@ -754,6 +821,10 @@ int loadAppendOnlyFile(char *filename) {
             loadingProgress(ftello(fp));
             processEventsWhileBlocked();
         }
+#ifdef TODIS
+        /* The spill records fed before this command go first. */
+        if (pmemSpillLoading()) pmemSpillLoadUpTo(ftello(fp));
+#endif
 
         if (fgets(buf,sizeof(buf),fp) == NULL) {
             if (feof(fp))
@@ -801,6 +872,9 @@ int loadAppendOnlyFile(char *filename) {
         }
 
         /* Run the command in the context of a fake client */
+#ifdef TODIS
+        selectCommandShardPM(fakeClient->db,cmd,argv,argc);
+#endif
         cmd->proc(fakeClient);
 
         /* The fake client should not have a reply */
@@ -1130,6 +1204,9 @@ int rewriteAppendOnlyFile(char *filename) {
     long long now = mstime();
     char byte;
     size_t processed = 0;
+#ifdef TODIS
+    unsigned long pmem_keys = 0;
+#endif
 
     /* Note that we have to use a different temp name here compared to the
      * one used by rewriteAppendOnlyFileBackground() function. */
@@ -1148,7 +1225,14 @@ int rewriteAppendOnlyFile(char *filename) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
         dict *d = db->dict;
+#ifdef TODIS
+        /* PMEM keys are durable in the pool already: only the DRAM tier,
+         * the demoted keys included, goes to the AOF. */
+        pmem_keys += dictSizePM(d);
+        if (dictSize(d) == dictSizePM(d)) continue;
+#else
         if (dictSize(d) == 0) continue;
+#endif
         di = dictGetSafeIterator(d);
         if (!di) {
             fclose(fp);
@@ -1165,6 +1249,9 @@ int rewriteAppendOnlyFile(char *filename) {
             robj key, *o;
             long long expiretime;
 
+#ifdef TODIS
+            if (de->location == LOCATION_PMEM) continue;
+#endif
             keystr = dictGetKey(de);
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
@@ -1176,8 +1263,13 @@ int rewriteAppendOnlyFile(char *filename) {
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
+#ifdef TODIS
+                /* Emit an AOFSET command, that keeps the key in DRAM */
+                char cmd[]="*3\r\n$6\r\nAOFSET\r\n";
+#else
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
+#endif
                 if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
                 /* Key and value */
                 if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
@@ -1268,6 +1360,9 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
     serverLog(LL_NOTICE,"SYNC append only file rewrite performed");
+#ifdef TODIS
+    serverLog(LL_NOTICE,"%lu PMEM keys left out of the AOF", pmem_keys);
+#endif
     return C_OK;
 
 werr:
@@ -1410,6 +1505,9 @@ int rewriteAppendOnlyFileBackground(void) {
         server.aof_rewrite_scheduled = 0;
         server.aof_rewrite_time_start = time(NULL);
         server.aof_child_pid = childpid;
+#ifdef TODIS
+        pmemSpillRewriteStart();
+#endif
         updateDictResizePolicy();
         /* We set appendseldb to -1 in order to force the next call to the
          * feedAppendOnlyFile() to issue a SELECT command, so the differences
@@ -1469,6 +1567,9 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         char tmpfile[256];
         long long now = ustime();
         mstime_t latency;
+#ifdef TODIS
+        long long aof_shift = 0;
+#endif
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
@@ -1574,7 +1675,15 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
 #endif
             }
             server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+#ifdef TODIS
+            /* The old AOF ended with the same bytes as the rewritten one,
+             * those written since the fork. */
+            aof_shift = -(server.aof_current_size+sdslen(server.aof_buf));
+#endif
             aofUpdateCurrentSize();
+#ifdef TODIS
+            aof_shift += server.aof_current_size;
+#endif
             server.aof_rewrite_base_size = server.aof_current_size;
 
             /* Clear regular AOF buffer since its contents was just written to
@@ -1583,6 +1692,9 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             server.aof_buf = sdsempty();
         }
 
+#ifdef TODIS
+        pmemSpillRewriteDone(aof_shift);
+#endif
         server.aof_lastbgrewrite_status = C_OK;
 
         serverLog(LL_NOTICE, "Background AOF rewrite finished successfully");
@@ -62,6 +62,8 @@
 #include "bio.h"
 #ifdef TODIS
 #include "pmem.h"
+#include "pmem_trace.h"
+#include "pmem_spill.h"
 #endif
 
 static pthread_t bio_threads[BIO_NUM_OPS];
@@ -186,17 +188,16 @@ void *bioProcessBackgroundJobs(void *arg) {
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
 #ifdef TODIS
-            serverLog(LL_TODIS, "TODIS, aof_fsync process...");
+            pmemTrace(PMEM_TRACE_AOF_FSYNC, (long)job->arg1, 0);
 #endif
             aof_fsync((long)job->arg1);
 #ifdef TODIS
-            TX_BEGIN(server.pm_pool) {
-                PMEMoid *victim_first_ptr = (PMEMoid *)job->arg2;
-                freeVictimList(*victim_first_ptr);
-                zfree(victim_first_ptr);
-            } TX_ONABORT {
-                serverLog(LL_TODIS, "TODIS, Flush victim list failed (%s)", __func__);
-            } TX_END
+            /* The spill log, if open, is a descriptor > 0 in arg3. */
+            if ((long)job->arg3 > 0) aof_fsync((long)job->arg3);
+            /* The victims sealed before this fsync can be freed: the main
+             * thread frees them, see pmemReclaimCron(). */
+            if (job->arg2)
+                pmemReclaimDurable((uint64_t)(uintptr_t)job->arg2);
 #endif
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
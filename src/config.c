@@ -30,6 +30,8 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "pmem_latency.h"
+#include "pmem_cache.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -60,9 +62,23 @@ configEnum max_pmem_memory_policy_enum[] = {
     {"volatile-ttl",MAXMEMORY_VOLATILE_TTL},
     {"allkeys-lru",MAXMEMORY_ALLKEYS_LRU},
     {"allkeys-random",MAXMEMORY_ALLKEYS_RANDOM},
+    {"allkeys-clock",MAXMEMORY_ALLKEYS_CLOCK},
+    {"allkeys-sampled-lru",MAXMEMORY_ALLKEYS_SAMPLED_LRU},
     {"noeviction",MAXMEMORY_NO_EVICTION},
     {NULL, 0}
 };
+
+configEnum pmem_write_path_enum[] = {
+    {"transaction",PMEM_WRITE_PATH_TX},
+    {"publish",PMEM_WRITE_PATH_PUBLISH},
+    {NULL, 0}
+};
+
+configEnum pmem_tiering_enum[] = {
+    {"none",PMEM_TIERING_NONE},
+    {"lfu",PMEM_TIERING_LFU},
+    {NULL, 0}
+};
 #endif
 
 configEnum syslog_facility_enum[] = {
@@ -417,6 +433,26 @@ void loadServerConfigFromString(char *config) {
             } else if (size < CONFIG_MIN_PM_FILE_SIZE) {
                 err = "Invalid pmfile size"; goto loaderr;
             }
+#ifdef TODIS
+            /* Every pmfile line adds a shard, the first one being kept in
+             * pm_file_path and the total size in pm_file_size. */
+            if (server.pm_num_shards == PMEM_MAX_SHARDS) {
+                err = "Too many pmfile shards"; goto loaderr;
+            }
+            for (int k = 0; k < server.pm_num_shards; k++) {
+                if (!strcmp(server.pm_shards[k].path, argv[1])) {
+                    err = "Duplicated pmfile"; goto loaderr;
+                }
+            }
+            server.pm_shards[server.pm_num_shards].path = zstrdup(argv[1]);
+            server.pm_shards[server.pm_num_shards].size = size;
+            if (server.pm_num_shards++) {
+                zfree(server.pm_file_path);
+                server.pm_file_path =
+                    zstrdup(server.pm_shards[0].path);
+                size += server.pm_file_size;
+            }
+#endif
             server.pm_file_size = size;
 #endif
 #ifdef TODIS
@@ -439,6 +475,18 @@ void loadServerConfigFromString(char *config) {
             }
             server.pmem_fire_evict_percent = pmem_fire_evict_percent;
 #endif
+#ifdef TODIS
+        } else if (!strcasecmp(argv[0], "pmem-stop-evict-percent") && argc == 2) {
+            long long pmem_stop_evict_percent = atoi(argv[1]);
+            if (
+                pmem_stop_evict_percent < CONFIG_MIN_PMEM_FIRE_EVICT_PERCENT ||
+                pmem_stop_evict_percent > 100
+            ) {
+                err = "Invalid pmem stop evict percent";
+                goto loaderr;
+            }
+            server.pmem_stop_evict_percent = pmem_stop_evict_percent;
+#endif
 #ifdef TODIS
         } else if (!strcasecmp(argv[0], "max-pmem-memory-policy") && argc == 2) {
             server.max_pmem_memory_policy =
@@ -457,15 +505,103 @@ void loadServerConfigFromString(char *config) {
             }
             server.pmem_victim_count = pmem_victim_count;
 #endif
+#ifdef TODIS
+        } else if (!strcasecmp(argv[0], "pmem-lazy-reconstruct") && argc == 2) {
+            if ((server.pmem_lazy_reconstruct = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-read-cache-size") && argc == 2) {
+            server.pmem_read_cache_size = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0], "pmem-spill-log") && argc == 2) {
+            if ((server.pmem_spill_log = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-index-buckets") && argc == 2) {
+            long long pmem_index_buckets = memtoll(argv[1],NULL);
+            if (pmem_index_buckets < 1) {
+                err = "Invalid number of pmem index buckets"; goto loaderr;
+            }
+            server.pmem_index_buckets = pmem_index_buckets;
+        } else if (!strcasecmp(argv[0], "pmem-write-path") && argc == 2) {
+            server.pmem_write_path =
+                configEnumGetValue(pmem_write_path_enum, argv[1]);
+            if (server.pmem_write_path == INT_MIN) {
+                err = "Invalid pmem write path";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-group-commit") && argc == 2) {
+            if ((server.pmem_group_commit = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-tiering") && argc == 2) {
+            server.pmem_tiering =
+                configEnumGetValue(pmem_tiering_enum, argv[1]);
+            if (server.pmem_tiering == INT_MIN) {
+                err = "Invalid pmem tiering, must be 'none' or 'lfu'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-lfu-log-factor") && argc == 2) {
+            server.pmem_lfu_log_factor = atoi(argv[1]);
+            if (server.pmem_lfu_log_factor < 0) {
+                err = "pmem-lfu-log-factor must be 0 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-lfu-decay-time") && argc == 2) {
+            server.pmem_lfu_decay_time = atoi(argv[1]);
+            if (server.pmem_lfu_decay_time < 0) {
+                err = "pmem-lfu-decay-time must be 0 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-promote-per-sec") && argc == 2) {
+            server.pmem_promote_per_sec = strtoll(argv[1],NULL,10);
+            if (server.pmem_promote_per_sec < 0) {
+                err = "pmem-promote-per-sec must be 0 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "pmem-demote-per-sec") && argc == 2) {
+            server.pmem_demote_per_sec = strtoll(argv[1],NULL,10);
+            if (server.pmem_demote_per_sec < 0) {
+                err = "pmem-demote-per-sec must be 0 or greater";
+                goto loaderr;
+            }
+#endif
+#ifdef TODIS
+        } else if (!strcasecmp(argv[0], "pmem-reconstruct-threads") && argc == 2) {
+            server.pmem_reconstruct_threads = atoi(argv[1]);
+            if (server.pmem_reconstruct_threads < 1 ||
+                server.pmem_reconstruct_threads > CONFIG_MAX_PMEM_RECONSTRUCT_THREADS)
+            {
+                err = "Invalid number of pmem reconstruct threads";
+                goto loaderr;
+            }
+#endif
+#ifdef TODIS
+        } else if (!strcasecmp(argv[0], "pmem-volatile-lru") && argc == 2) {
+            if ((server.pmem_volatile_lru = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#endif
 #ifdef TODIS
         } else if (!strcasecmp(argv[0], "pm-read-latency") && (argc == 2)) {
             long long pm_read_latency = atoi(argv[1]);
+            if (pm_read_latency < 0) {
+                err = "Invalid pm-read-latency"; goto loaderr;
+            }
             server.pm_read_latency = pm_read_latency;
 #endif
 #ifdef TODIS
         } else if (!strcasecmp(argv[0], "pm-write-latency") && (argc == 2)) {
             long long pm_write_latency = atoi(argv[1]);
+            if (pm_write_latency < 0) {
+                err = "Invalid pm-write-latency"; goto loaderr;
+            }
             server.pm_write_latency = pm_write_latency;
+        } else if (!strcasecmp(argv[0], "pm-write-bandwidth") && argc == 2) {
+            long long pm_write_bandwidth = atoi(argv[1]);
+            if (pm_write_bandwidth < 0) {
+                err = "Invalid pm-write-bandwidth"; goto loaderr;
+            }
+            server.pm_write_bandwidth = pm_write_bandwidth;
 #endif
         } else if (!strcasecmp(argv[0],"appendonly") && argc == 2) {
             int yes;
@@ -962,6 +1098,8 @@ void configSetCommand(client *c) {
 #ifdef TODIS
     } config_set_bool_field(
       "todis-log-only", server.todis_log_only) {
+    } config_set_bool_field(
+      "pmem-group-commit", server.pmem_group_commit) {
 #endif
     } config_set_bool_field(
       "rdbcompression", server.rdb_compression) {
@@ -1056,6 +1194,29 @@ void configSetCommand(client *c) {
          * but cap them to reasonable values. */
         if (server.hz < CONFIG_MIN_HZ) server.hz = CONFIG_MIN_HZ;
         if (server.hz > CONFIG_MAX_HZ) server.hz = CONFIG_MAX_HZ;
+#ifdef TODIS
+    } config_set_numerical_field(
+      "pmem-fire-evict-percent",server.pmem_fire_evict_percent,0,100) {
+    } config_set_numerical_field(
+      "pmem-stop-evict-percent",server.pmem_stop_evict_percent,0,100) {
+    } config_set_numerical_field(
+      "pmem-lfu-log-factor",server.pmem_lfu_log_factor,0,INT_MAX) {
+    } config_set_numerical_field(
+      "pmem-lfu-decay-time",server.pmem_lfu_decay_time,0,INT_MAX) {
+    } config_set_numerical_field(
+      "pmem-promote-per-sec",server.pmem_promote_per_sec,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "pmem-demote-per-sec",server.pmem_demote_per_sec,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "pm-read-latency",server.pm_read_latency,0,LLONG_MAX) {
+        pmemLatencyUpdate();
+    } config_set_numerical_field(
+      "pm-write-latency",server.pm_write_latency,0,LLONG_MAX) {
+        pmemLatencyUpdate();
+    } config_set_numerical_field(
+      "pm-write-bandwidth",server.pm_write_bandwidth,0,LLONG_MAX) {
+        pmemLatencyUpdate();
+#endif
     } config_set_numerical_field(
       "watchdog-period",ll,0,LLONG_MAX) {
         if (ll)
@@ -1074,6 +1235,11 @@ void configSetCommand(client *c) {
         }
     } config_set_memory_field("repl-backlog-size",ll) {
         resizeReplicationBacklog(ll);
+#ifdef TODIS
+    } config_set_memory_field(
+      "pmem-read-cache-size",server.pmem_read_cache_size) {
+        pmemCacheResize();
+#endif
 
     /* Enumeration fields.
      * config_set_enum_field(name,var,enum_var) */
@@ -1086,6 +1252,8 @@ void configSetCommand(client *c) {
       "max-pmem-memory-policy",
       server.max_pmem_memory_policy,
       max_pmem_memory_policy_enum) {
+    } config_set_enum_field(
+      "pmem-write-path",server.pmem_write_path,pmem_write_path_enum) {
 #endif
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
@@ -1206,6 +1374,30 @@ void configGetCommand(client *c) {
     config_get_numerical_field("min-slaves-to-write",server.repl_min_slaves_to_write);
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.hz);
+#ifdef TODIS
+    config_get_numerical_field("pmem-fire-evict-percent",
+            server.pmem_fire_evict_percent);
+    config_get_numerical_field("pmem-stop-evict-percent",
+            server.pmem_stop_evict_percent);
+    config_get_numerical_field("pmem-reconstruct-threads",
+            server.pmem_reconstruct_threads);
+    config_get_numerical_field("pmem-index-buckets",
+            server.pmem_index_buckets);
+    config_get_numerical_field("pmem-read-cache-size",
+            server.pmem_read_cache_size);
+    config_get_numerical_field("pmem-lfu-log-factor",
+            server.pmem_lfu_log_factor);
+    config_get_numerical_field("pmem-lfu-decay-time",
+            server.pmem_lfu_decay_time);
+    config_get_numerical_field("pmem-promote-per-sec",
+            server.pmem_promote_per_sec);
+    config_get_numerical_field("pmem-demote-per-sec",
+            server.pmem_demote_per_sec);
+    config_get_numerical_field("pm-read-latency",server.pm_read_latency);
+    config_get_numerical_field("pm-write-latency",server.pm_write_latency);
+    config_get_numerical_field("pm-write-bandwidth",
+            server.pm_write_bandwidth);
+#endif
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
@@ -1216,6 +1408,14 @@ void configGetCommand(client *c) {
 #ifdef TODIS
     config_get_bool_field("todis-log-only",
             server.todis_log_only);
+    config_get_bool_field("pmem-volatile-lru",
+            server.pmem_volatile_lru);
+    config_get_bool_field("pmem-lazy-reconstruct",
+            server.pmem_lazy_reconstruct);
+    config_get_bool_field("pmem-group-commit",
+            server.pmem_group_commit);
+    config_get_bool_field("pmem-spill-log",
+            server.pmem_spill_log);
 #endif
     config_get_bool_field("cluster-require-full-coverage",
             server.cluster_require_full_coverage);
@@ -1247,6 +1447,10 @@ void configGetCommand(client *c) {
 #ifdef TODIS
     config_get_enum_field("max-pmem-memory-policy",
             server.max_pmem_memory_policy, max_pmem_memory_policy_enum);
+    config_get_enum_field("pmem-write-path",
+            server.pmem_write_path, pmem_write_path_enum);
+    config_get_enum_field("pmem-tiering",
+            server.pmem_tiering, pmem_tiering_enum);
 #endif
     config_get_enum_field("loglevel",
             server.verbosity,loglevel_enum);
@@ -1679,6 +1883,21 @@ void rewriteConfigSlaveofOption(struct rewriteConfigState *state) {
     rewriteConfigRewriteLine(state,option,line,1);
 }
 
+#ifdef TODIS
+/* Rewrite the pmfile lines, one per shard, those added by PMEMADDPART
+ * included: they tell the restart which pools to recover. */
+void rewriteConfigPmfileOption(struct rewriteConfigState *state) {
+    sds line;
+
+    for (int j = 0; j < server.pm_num_shards; j++) {
+        line = sdscatprintf(sdsempty(),"pmfile %s %zu",
+            server.pm_shards[j].path, server.pm_shards[j].size);
+        rewriteConfigRewriteLine(state,"pmfile",line,1);
+    }
+    rewriteConfigMarkAsProcessed(state,"pmfile");
+}
+#endif
+
 /* Rewrite the notify-keyspace-events option. */
 void rewriteConfigNotifykeyspaceeventsOption(struct rewriteConfigState *state) {
     int force = server.notify_keyspace_events != 0;
@@ -1904,6 +2123,9 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,CONFIG_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
     rewriteConfigSlaveofOption(state);
+#ifdef TODIS
+    rewriteConfigPmfileOption(state);
+#endif
     rewriteConfigStringOption(state,"slave-announce-ip",server.slave_announce_ip,CONFIG_DEFAULT_SLAVE_ANNOUNCE_IP);
     rewriteConfigStringOption(state,"masterauth",server.masterauth,NULL);
     rewriteConfigYesNoOption(state,"slave-serve-stale-data",server.repl_serve_stale_data,CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA);
@@ -1915,6 +2137,7 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay,CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY);
 #ifdef TODIS
     rewriteConfigYesNoOption(state,"todis-log-only",server.todis_log_only,CONFIG_DEFAULT_TODIS_LOG_ONLY);
+    rewriteConfigYesNoOption(state,"pmem-volatile-lru",server.pmem_volatile_lru,CONFIG_DEFAULT_PMEM_VOLATILE_LRU);
 #endif
     rewriteConfigYesNoOption(state,"repl-diskless-sync",server.repl_diskless_sync,CONFIG_DEFAULT_REPL_DISKLESS_SYNC);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
@@ -1926,7 +2149,25 @@ int rewriteConfig(char *path) {
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
 #ifdef TODIS
+    rewriteConfigBytesOption(state,"max-pmem-memory",server.max_pmem_memory,CONFIG_DEFAULT_MAX_PMEM_MEMORY_SIZE);
     rewriteConfigEnumOption(state, "max-pmem-memory-policy", server.max_pmem_memory_policy, max_pmem_memory_policy_enum, CONFIG_DEFAULT_MAXMEMORY_POLICY);
+    rewriteConfigNumericalOption(state,"pmem-fire-evict-percent",server.pmem_fire_evict_percent,CONFIG_DEFAULT_PMEM_FIRE_EVICT_PERCENT);
+    rewriteConfigNumericalOption(state,"pmem-stop-evict-percent",server.pmem_stop_evict_percent,CONFIG_DEFAULT_PMEM_STOP_EVICT_PERCENT);
+    rewriteConfigNumericalOption(state,"pmem-reconstruct-threads",server.pmem_reconstruct_threads,CONFIG_DEFAULT_PMEM_RECONSTRUCT_THREADS);
+    rewriteConfigYesNoOption(state,"pmem-lazy-reconstruct",server.pmem_lazy_reconstruct,CONFIG_DEFAULT_PMEM_LAZY_RECONSTRUCT);
+    rewriteConfigNumericalOption(state,"pmem-index-buckets",server.pmem_index_buckets,CONFIG_DEFAULT_PMEM_INDEX_BUCKETS);
+    rewriteConfigEnumOption(state,"pmem-write-path",server.pmem_write_path,pmem_write_path_enum,CONFIG_DEFAULT_PMEM_WRITE_PATH);
+    rewriteConfigEnumOption(state,"pmem-tiering",server.pmem_tiering,pmem_tiering_enum,CONFIG_DEFAULT_PMEM_TIERING);
+    rewriteConfigNumericalOption(state,"pmem-lfu-log-factor",server.pmem_lfu_log_factor,CONFIG_DEFAULT_PMEM_LFU_LOG_FACTOR);
+    rewriteConfigNumericalOption(state,"pmem-lfu-decay-time",server.pmem_lfu_decay_time,CONFIG_DEFAULT_PMEM_LFU_DECAY_TIME);
+    rewriteConfigNumericalOption(state,"pmem-promote-per-sec",server.pmem_promote_per_sec,CONFIG_DEFAULT_PMEM_PROMOTE_PER_SEC);
+    rewriteConfigNumericalOption(state,"pmem-demote-per-sec",server.pmem_demote_per_sec,CONFIG_DEFAULT_PMEM_DEMOTE_PER_SEC);
+    rewriteConfigYesNoOption(state,"pmem-group-commit",server.pmem_group_commit,CONFIG_DEFAULT_PMEM_GROUP_COMMIT);
+    rewriteConfigYesNoOption(state,"pmem-spill-log",server.pmem_spill_log,CONFIG_DEFAULT_PMEM_SPILL_LOG);
+    rewriteConfigBytesOption(state,"pmem-read-cache-size",server.pmem_read_cache_size,CONFIG_DEFAULT_PMEM_READ_CACHE_SIZE);
+    rewriteConfigNumericalOption(state,"pm-read-latency",server.pm_read_latency,CONFIG_DEFAULT_PM_READ_LATENCY);
+    rewriteConfigNumericalOption(state,"pm-write-latency",server.pm_write_latency,CONFIG_DEFAULT_PM_WRITE_LATENCY);
+    rewriteConfigNumericalOption(state,"pm-write-bandwidth",server.pm_write_bandwidth,CONFIG_DEFAULT_PM_WRITE_BANDWIDTH);
 #endif
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
     rewriteConfigYesNoOption(state,"appendonly",server.aof_state != AOF_OFF,0);
@@ -37,6 +37,12 @@
 #include "obj.h"
 #include "libpmemobj.h"
 #endif
+#ifdef TODIS
+#include "pmem_latency.h"
+#include "pmem_trace.h"
+#include "pmem_spill.h"
+#include "pmem_cache.h"
+#endif
 
 extern struct redisServer server; /* server global state */
 
@@ -50,9 +56,13 @@ void slotToKeyFlush(void);
 
 /* Low level key lookup API, not actually called directly from commands
  * implementations that should instead rely on lookupKeyRead(),
- * lookupKeyWrite() and lookupKeyReadWithFlags(). */
-robj *lookupKey(redisDb *db, robj *key, int flags) {
+ * lookupKeyWrite() and lookupKeyReadWithFlags(). Returns the dict entry of
+ * the key, that tells the tier of the key too. */
+static dictEntry *lookupKeyDictEntry(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
+#ifdef TODIS
+    if (de == NULL) de = pmemWarmupLookup(db,key->ptr);
+#endif
     if (de) {
         robj *val = dictGetVal(de);
 
@@ -63,12 +73,24 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
             server.aof_child_pid == -1 &&
             !(flags & LOOKUP_NOTOUCH))
         {
+#ifdef TODIS
+            if (server.pmem_tiering == PMEM_TIERING_LFU)
+                updateLFU(val);
+            else
+#endif
             val->lru = LRU_CLOCK();
+#ifdef TODIS
+            if (de->location == LOCATION_PMEM) pmemLruTouch(de);
+#endif
         }
-        return val;
-    } else {
-        return NULL;
     }
+    return de;
+}
+
+robj *lookupKey(redisDb *db, robj *key, int flags) {
+    dictEntry *de = lookupKeyDictEntry(db,key,flags);
+
+    return de ? dictGetVal(de) : NULL;
 }
 
 /* Lookup a key for read operations, or return NULL if the key is not found
@@ -93,7 +115,7 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * correctly report a key is expired on slaves even if the master is lagging
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
-    robj *val;
+    dictEntry *de;
 
     if (expireIfNeeded(db,key) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
@@ -121,12 +143,20 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
             return NULL;
         }
     }
-    val = lookupKey(db,key,flags);
-    if (val == NULL)
+    de = lookupKeyDictEntry(db,key,flags);
+    if (de == NULL) {
         server.stat_keyspace_misses++;
-    else
-        server.stat_keyspace_hits++;
-    return val;
+        return NULL;
+    }
+    server.stat_keyspace_hits++;
+#ifdef TODIS
+    if (de->location == LOCATION_PMEM) {
+        server.stat_pmem_hits++;
+        return pmemCacheRead(de,flags);
+    }
+    server.stat_dram_hits++;
+#endif
+    return dictGetVal(de);
 }
 
 /* Like lookupKeyReadWithFlags(), but does not use any flag, which is the
@@ -166,22 +196,24 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
 
 #ifdef TODIS
 dictEntry *lookupKeyEntry(redisDb *db, robj *key) {
-    return dictFind(db->dict, key->ptr);
+    dictEntry *de = dictFind(db->dict, key->ptr);
+
+    if (de == NULL) de = pmemWarmupLookup(db,key->ptr);
+    return de;
 }
 #endif
 
 #ifdef TODIS
-int dbReconstructVictim(redisDb *db, robj *key, robj *val) {
-    serverLog(LL_TODIS, "TODIS, dbReconstructVictim START");
+int dbReconstructVictim(redisDb *db, robj *key, robj *val, long long expire) {
+    pmemTrace(PMEM_TRACE_RECONSTRUCT_VICTIM, key->ptr, 0);
     dictEntry *de = lookupKeyEntry(db, key);
     if (de == NULL) {
-        feedAppendOnlyFileTODIS(db, key, val);
+        feedAppendOnlyFileTODIS(db, key, val, expire);
     } else if (de->location == LOCATION_DRAM) {
         decrRefCount(key);
         decrRefCount(val);
         return C_ERR;
     }
-    serverLog(LL_TODIS, "TODIS, dictAddReconstructedVictim END");
     return C_OK;
 }
 #endif
@@ -203,9 +235,23 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 #ifdef USE_PMDK
 /*
  * Add the key to the DB using libpmemobj transactions.
+ *
+ * With TODIS 'val' is a DRAM string object: the key, the value and the
+ * PMEM node are copied in a single record allocation.
  */
 void dbAddPM(redisDb *db, robj *key, robj *val) {
     PMEMoid kv_PM;
+#ifdef TODIS
+    kv_PM = pmemAddRecordToPmemList(key->ptr, val);
+    dictEntry *de = dictAddRawPM(db->dict, getKeyFromOid(kv_PM));
+    int retval = de != NULL ? DICT_OK : DICT_ERR;
+
+    if (de != NULL) {
+        dictSetVal(db->dict, de,
+                pmemCreateValObject(getPMObjectFromOid(kv_PM)));
+        pmemBindEntry(db->dict, de);
+    }
+#else
     PMEMoid *kv_pm_reference;
 
     sds copy = sdsdupPM(key->ptr, (void **) &kv_pm_reference);
@@ -213,6 +259,7 @@ void dbAddPM(redisDb *db, robj *key, robj *val) {
 
     kv_PM = pmemAddToPmemList((void *)copy, (void *)(val->ptr));
     *kv_pm_reference = kv_PM;
+#endif
 
     serverAssertWithInfo(NULL,key,retval == C_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
@@ -232,18 +279,55 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictReplace(db->dict, key->ptr, val);
 }
 
+#if defined(USE_PMDK) && defined(TODIS)
+/* Moves the DRAM entry 'de' of 'key' to the PMEM record 'kv_PM'. */
+static void dbPromoteEntryPM(redisDb *db, dictEntry *de, robj *key,
+        PMEMoid kv_PM) {
+    sds copy = getKeyFromOid(kv_PM);
+    dictEntry *expire_de = NULL;
+
+    /* Expires share the key sds with the main dict. */
+    if (dictSize(db->expires) > 0)
+        expire_de = dictFind(db->expires, key->ptr);
+    dictPromoteEntryPM(db->dict, de, copy,
+            pmemCreateValObject(getPMObjectFromOid(kv_PM)));
+    if (expire_de != NULL) {
+        dictSetKey(db->expires, expire_de, copy);
+        pmemSetExpire(de, dictGetSignedIntegerVal(expire_de));
+    }
+    server.stat_pmem_promoted_keys++;
+}
+#endif
+
 #ifdef USE_PMDK
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
  *
+ * With TODIS 'val' is a DRAM string object like for dbAddPM(). A DRAM key
+ * moves to PMEM as a new record, a PMEM key gets its value overwritten in
+ * place when it fits, or a new PMEM value.
+ *
  * The program is aborted if the key was not already present. */
 void dbOverwritePM(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
 #ifdef TODIS
-    dictReplaceTODIS(db->dict, key->ptr, val);
+    if (de->location == LOCATION_DRAM) {
+        dbPromoteEntryPM(db, de, key, pmemAddRecordToPmemList(key->ptr, val));
+        pmemBindEntry(db->dict, de);
+        pmemLruAdd(de);
+    } else if (val->encoding == OBJ_ENCODING_INT) {
+        if (pmemSetIntValue(de, (long)val->ptr) == C_ERR) {
+            robj *decoded = getDecodedObject(val);
+
+            dictReplaceTODIS(db->dict, key->ptr, dupStringObjectPM(decoded));
+            decrRefCount(decoded);
+        }
+    } else if (pmemOverwriteValue(de, val->ptr) == C_ERR) {
+        dictReplaceTODIS(db->dict, key->ptr, dupStringObjectPM(val));
+    }
 #else
     dictReplacePM(db->dict, key->ptr, val);
 #endif
@@ -268,7 +352,8 @@ void setKey(redisDb *db, robj *key, robj *val) {
 }
 
 #ifdef USE_PMDK
-/* High level Set operation. Used for PM */
+/* High level Set operation. Used for PM. With TODIS 'val' is a DRAM string
+ * object, copied to PMEM by dbAddPM() or dbOverwritePM(). */
 void setKeyPM(redisDb *db, robj *key, robj *val) {
     dictEntry *de = lookupKeyWriteEntry(db, key);
     if (de == NULL) {
@@ -290,8 +375,269 @@ void setKeyPM(redisDb *db, robj *key, robj *val) {
 }
 #endif
 
+#if defined(USE_PMDK) && defined(TODIS)
+/* Selects the shard of the first key of the write command 'cmd' before it
+ * runs, from call() and the AOF loading. The writes of the command then
+ * find the shard of their key selected: a shard switch commits an open
+ * group, so that it must not happen while the command runs. Only the
+ * multi key commands switch for the keys of the other shards: MSET out of
+ * its transactions and dbDelete() out of any.
+ *
+ * In a group commit the command then joins the group only if the pool has
+ * room for its arguments and the string values of its keys, that APPEND or
+ * SETRANGE rewrite whole (see pmemGroupPrepare()). */
+void selectCommandShardPM(redisDb *db, struct redisCommand *cmd,
+        robj **argv, int argc) {
+    int *keys, numkeys, j;
+    size_t need = 0;
+
+    if (!server.persistent || !(cmd->flags & CMD_WRITE)) return;
+    if (server.pm_num_shards == 1 && !server.pmem_group_open) return;
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    if (numkeys > 0 && server.pm_num_shards > 1) {
+        robj *key = argv[keys[0]];
+
+        pmemShardSelect(pmemShardForEntry(lookupKeyEntry(db,key),key->ptr));
+    }
+    if (server.pmem_group_open) {
+        for (j = 1; j < argc; j++)
+            if (sdsEncodedObject(argv[j])) need += sdslen(argv[j]->ptr);
+        for (j = 0; j < numkeys; j++) {
+            dictEntry *de = lookupKeyEntry(db,argv[keys[j]]);
+
+            if (de != NULL && ((robj*)dictGetVal(de))->type == OBJ_STRING)
+                need += stringObjectLen(dictGetVal(de));
+        }
+        pmemGroupPrepare(need);
+    }
+    getKeysFreeResult(keys);
+}
+
+/* Same as setKeyPM(), but without a transaction (pmem-write-path publish):
+ * the record or the value is published with the action API of libpmemobj,
+ * along with the absolute expire time 'expire' in ms (-1 for none).
+ * Returns C_ERR, nothing being changed, when the write needs the
+ * transactional path of setKeyPM(). */
+int setKeyPublishPM(redisDb *db, robj *key, robj *val, long long expire) {
+    dictEntry *de = lookupKeyWriteEntry(db, key);
+    PMEMoid kv_PM;
+
+    if (de != NULL && de->location == LOCATION_PMEM) {
+        /* The in place writes can't change the expire in the same store. */
+        int inplace = pmemExpireEquals(de, expire);
+
+        if (val->encoding == OBJ_ENCODING_INT) {
+            if (!inplace || pmemSetIntValue(de, (long)val->ptr) == C_ERR)
+                return C_ERR;
+        } else if ((!inplace || pmemOverwriteValue(de, val->ptr) == C_ERR) &&
+                   pmemPublishValue(de, val->ptr, expire) == C_ERR) {
+            return C_ERR;
+        }
+    } else {
+        kv_PM = pmemPublishRecord(db->id, key->ptr, val, expire);
+        if (OID_IS_NULL(kv_PM)) return C_ERR;
+        if (de == NULL) {
+            de = dictAddRawPM(db->dict, getKeyFromOid(kv_PM));
+            serverAssertWithInfo(NULL,key,de != NULL);
+            dictSetVal(db->dict, de,
+                    pmemCreateValObject(getPMObjectFromOid(kv_PM)));
+            if (server.cluster_enabled) slotToKeyAdd(key);
+        } else {
+            propagateExpireTODIS(db, de);
+            /* The record holds the new expire already. */
+            removeExpire(db,key);
+            dbPromoteEntryPM(db, de, key, kv_PM);
+            pmemLruAdd(de);
+        }
+        pmemAttachEntry(de);
+    }
+    /* Only the DRAM expires are left to update. */
+    if (expire == -1)
+        removeExpire(db,key);
+    else
+        setExpire(db,key,expire);
+    signalModifiedKey(db,key);
+    if (server.max_used_pmem_memory < server.used_pmem_memory) {
+        server.max_used_pmem_memory = server.used_pmem_memory;
+    }
+    return C_OK;
+}
+
+/* Sets the key with setKeyPM() in a transaction, or publishes it with
+ * setKeyPublishPM() if pmem-write-path is publish and the write allows it.
+ * The absolute expire time 'expire' in ms (-1 for none) is stored in the
+ * same write, so that a crash can't leave the value without its expire.
+ * Returns C_ERR if the transaction aborted. */
+int setKeyCommitPM(redisDb *db, robj *key, robj *val, long long expire) {
+    uint64_t start = pmemTxLatencyStart();
+    int retval = C_OK;
+
+    /* pmemobj_publish() can't run in a group transaction. */
+    if (server.pmem_write_path == PMEM_WRITE_PATH_PUBLISH &&
+        !server.pmem_group_open &&
+        setKeyPublishPM(db,key,val,expire) == C_OK)
+    {
+        pmemTxLatencyRecord(start);
+        return C_OK;
+    }
+
+    TX_BEGIN(server.pm_pool) {
+        setKeyPM(db,key,val);
+        if (expire != -1) setExpire(db,key,expire);
+    } TX_ONABORT {
+        retval = C_ERR;
+    } TX_END
+    pmemTxLatencyRecord(start);
+    return retval;
+}
+
+/* Writes the string value of a key in PMEM, keeping its expire: the tier
+ * aware counterpart of dbAdd()/dbOverwrite() for commands modifying a string
+ * (INCR, APPEND, SETRANGE, ...). A new key is added to PMEM, a DRAM key is
+ * promoted, and a PMEM value is overwritten, in place when it fits. An
+ * integer replacing an integer is stored without a transaction, out of a
+ * group commit. Returns C_ERR if the transaction aborted. */
+int dbWriteCommitPM(redisDb *db, robj *key, robj *val) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    uint64_t start = pmemTxLatencyStart();
+    int retval = C_OK;
+
+    if (de != NULL && de->location == LOCATION_PMEM &&
+        !server.pmem_group_open && val->encoding == OBJ_ENCODING_INT &&
+        pmemSetIntValue(de, (long)val->ptr) == C_OK)
+    {
+        pmemTxLatencyRecord(start);
+        return C_OK;
+    }
+
+    TX_BEGIN(server.pm_pool) {
+        if (de == NULL) {
+            dbAddPM(db,key,val);
+        } else {
+            /* The command modifies the DRAM value, so the replicas must not
+             * get a DEL before it: only the AOF record of the demotion is
+             * cancelled, like dbPromoteKeyPM() does. */
+            if (de->location == LOCATION_DRAM)
+                feedAppendOnlyFileDelTODIS(db, dictGetKey(de));
+            dbOverwritePM(db,key,val);
+        }
+    } TX_ONABORT {
+        retval = C_ERR;
+    } TX_END
+    pmemTxLatencyRecord(start);
+    if (server.max_used_pmem_memory < server.used_pmem_memory) {
+        server.max_used_pmem_memory = server.used_pmem_memory;
+    }
+    return retval;
+}
+
+/* Stores the values of several keys with setKeyPM() in a single
+ * transaction per shard, so that MSET and MSETNX commit once per shard.
+ * 'argv' holds 'argc' key/value pairs. A transaction aborted half way
+ * through would leave the keys already set pointing to rolled back records,
+ * so the keys of a shard share a transaction only when its pool has the
+ * room of all their records. Otherwise each key is set in its own
+ * transaction, with setKeyCommitPM(), and running out of pool fails the
+ * command: C_ERR is returned, the keys of the shards before and the keys
+ * before the failing one being set. 'set' gets a 1 for every pair set. */
+int setKeysCommitPM(redisDb *db, robj **argv, int argc, char *set) {
+    uint64_t start = pmemTxLatencyStart();
+    pmemShard **shards = zmalloc(sizeof(pmemShard*) * (argc/2));
+    int j, k, s, retval = C_OK;
+
+    for (j = 0; j < argc; j += 2)
+        shards[j/2] = pmemShardForEntry(lookupKeyEntry(db,argv[j]),
+                                        argv[j]->ptr);
+    for (s = 0; s < server.pm_num_shards && retval == C_OK; s++) {
+        /* Read in the transaction: volatile across its setjmp(). */
+        pmemShard *volatile shard = server.pm_shards + s;
+        size_t need = PMEM_GROUP_HEADROOM;
+
+        for (j = 0; j < argc && shards[j/2] != shard; j += 2);
+        if (j == argc) continue;
+        for (k = j; k < argc; k += 2)
+            if (shards[k/2] == shard)
+                need += pmemRecordSize(argv[k]->ptr,argv[k+1]);
+        pmemShardSelect(shard);
+        if (!pmemPoolHasRoom(need)) {
+            /* An abort must not roll back the group either. */
+            pmemGroupCommit();
+            for (; j < argc; j += 2) {
+                if (shards[j/2] != shard) continue;
+                if (setKeyCommitPM(db,argv[j],argv[j+1],-1) == C_ERR) {
+                    retval = C_ERR;
+                    break;
+                }
+                set[j/2] = 1;
+            }
+            continue;
+        }
+        TX_BEGIN(server.pm_pool) {
+            for (k = j; k < argc; k += 2)
+                if (shards[k/2] == shard) setKeyPM(db,argv[k],argv[k+1]);
+        } TX_ONABORT {
+            serverPanic("PMEM multi key transaction aborted, the pool was "
+                        "rolled back");
+        } TX_END
+        for (; j < argc; j += 2)
+            if (shards[j/2] == shard) set[j/2] = 1;
+    }
+    zfree(shards);
+    pmemTxLatencyRecord(start);
+    return retval;
+}
+
+/* Returns a DRAM copy, RAW encoded, of the string value 'o' of a key, for
+ * the commands modifying a string destructively in TODIS: PMEM strings
+ * can't be grown by the sds functions, so the new value is built in DRAM
+ * and written back with dbWriteCommitPM(), like dbUnshareStringValue(). */
+robj *dbCopyStringValuePM(robj *o) {
+    robj *decoded;
+
+    serverAssert(o->type == OBJ_STRING);
+    decoded = getDecodedObject(o);
+    o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
+    decrRefCount(decoded);
+    return o;
+}
+
+/* Moves the DRAM string key of 'de' to PMEM for the tiering pass. Unlike a
+ * write promoting the key, the value, the expire and the access frequency
+ * are kept and nothing is replicated: only the DRAM copy logged to the AOF
+ * is cancelled. Returns C_ERR if the transaction aborted. */
+int dbPromoteKeyPM(redisDb *db, dictEntry *de) {
+    robj *val = dictGetVal(de);
+    unsigned lru = val->lru;
+    volatile int retval = C_OK;
+    robj key;
+
+    serverAssert(de->location == LOCATION_DRAM && val->type == OBJ_STRING);
+    initStaticStringObject(key, dictGetKey(de));
+    pmemShardSelect(pmemShardForEntry(de,key.ptr));
+    TX_BEGIN(server.pm_pool) {
+        dbPromoteEntryPM(db, de, &key, pmemAddRecordToPmemList(key.ptr, val));
+        pmemBindEntry(db->dict, de);
+    } TX_ONABORT {
+        retval = C_ERR;
+    } TX_END
+    if (retval == C_ERR) return C_ERR;
+
+    pmemLruAdd(de);
+    ((robj *)dictGetVal(de))->lru = lru;
+    feedAppendOnlyFileDelTODIS(db, dictGetKey(de));
+    if (server.max_used_pmem_memory < server.used_pmem_memory)
+        server.max_used_pmem_memory = server.used_pmem_memory;
+    return C_OK;
+}
+#endif
+
 int dbExists(redisDb *db, robj *key) {
+#ifdef TODIS
+    return dictFind(db->dict,key->ptr) != NULL ||
+        pmemWarmupLookup(db,key->ptr) != NULL;
+#else
     return dictFind(db->dict,key->ptr) != NULL;
+#endif
 }
 
 /* Return a random key, in form of a Redis object.
@@ -322,6 +668,16 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbDelete(redisDb *db, robj *key) {
+#ifdef TODIS
+    if (server.pm_num_shards > 1 || server.pmem_warming) {
+        /* A key not warmed up yet is materialized to leave PMEM, and the
+         * destructors free a PMEM key in the selected shard. */
+        dictEntry *de = lookupKeyEntry(db,key);
+
+        if (de != NULL && de->location == LOCATION_PMEM)
+            pmemShardSelect(pmemShardForEntry(de,key->ptr));
+    }
+#endif
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -381,12 +737,39 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     return o;
 }
 
+#ifdef TODIS
+/* Frees the PMEM keys of 'd' shard by shard, the destructors freeing a key
+ * in the selected shard, before the dict is emptied. */
+static void dictEmptyShardsPM(dict *d) {
+    if (!server.persistent || server.pm_num_shards == 1) return;
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShard *shard = server.pm_shards + i;
+        dictIterator *di = dictGetSafeIterator(d);
+        dictEntry *de;
+
+        pmemShardSelect(shard);
+        while ((de = dictNext(di)) != NULL) {
+            if (de->location == LOCATION_PMEM &&
+                pmemShardForEntry(de,dictGetKey(de)) == shard)
+                dictDelete(d,dictGetKey(de));
+        }
+        dictReleaseIterator(di);
+    }
+}
+#endif
+
 long long emptyDb(void(callback)(void*)) {
     int j;
     long long removed = 0;
 
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
     for (j = 0; j < server.dbnum; j++) {
         removed += dictSize(server.db[j].dict);
+#ifdef TODIS
+        dictEmptyShardsPM(server.db[j].dict);
+#endif
         dictEmpty(server.db[j].dict,callback);
         dictEmpty(server.db[j].expires,callback);
     }
@@ -423,8 +806,14 @@ void signalFlushedDb(int dbid) {
  *----------------------------------------------------------------------------*/
 
 void flushdbCommand(client *c) {
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
     server.dirty += dictSize(c->db->dict);
     signalFlushedDb(c->db->id);
+#ifdef TODIS
+    dictEmptyShardsPM(c->db->dict);
+#endif
     dictEmpty(c->db->dict,NULL);
     dictEmpty(c->db->expires,NULL);
     if (server.cluster_enabled) slotToKeyFlush();
@@ -454,6 +843,13 @@ void delCommand(client *c) {
 
     for (j = 1; j < c->argc; j++) {
         expireIfNeeded(c->db,c->argv[j]);
+#ifdef TODIS
+        dictEntry *de = lookupKeyEntry(c->db,c->argv[j]);
+
+        /* The AOF holds the DRAM keys: their deletion is logged. */
+        if (de != NULL && de->location == LOCATION_DRAM)
+            feedAppendOnlyFileDelTODIS(c->db,c->argv[j]->ptr);
+#endif
         if (dbDelete(c->db,c->argv[j])) {
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(NOTIFY_GENERIC,
@@ -499,6 +895,9 @@ void selectCommand(client *c) {
 void randomkeyCommand(client *c) {
     robj *key;
 
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
     if ((key = dbRandomKey(c->db)) == NULL) {
         addReply(c,shared.nullbulk);
         return;
@@ -514,7 +913,12 @@ void keysCommand(client *c) {
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
-    void *replylen = addDeferredMultiBulkLength(c);
+    void *replylen;
+
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
+    replylen = addDeferredMultiBulkLength(c);
 
     di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
@@ -777,11 +1181,19 @@ cleanup:
 void scanCommand(client *c) {
     unsigned long cursor;
     if (parseScanCursorOrReply(c,c->argv[1],&cursor) == C_ERR) return;
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
     scanGenericCommand(c,NULL,cursor);
 }
 
 void dbsizeCommand(client *c) {
+#ifdef TODIS
+    /* Keys not warmed up yet are counted by the PMEM hash index. */
+    addReplyLongLong(c,dictSize(c->db->dict)+c->db->pmem_cold_keys);
+#else
     addReplyLongLong(c,dictSize(c->db->dict));
+#endif
 }
 
 void lastsaveCommand(client *c) {
@@ -931,9 +1343,30 @@ void moveCommand(client *c) {
         addReply(c,shared.czero);
         return;
     }
+#ifdef TODIS
+    /* A string key gets a PMEM record of the target DB, like a write: the
+     * AOF only logs the DRAM keys demoted or deleted, not the commands. */
+    if (o->type == OBJ_STRING) {
+        robj *val = dupStringObject(o);
+        int retval = setKeyCommitPM(dst,c->argv[1],val,expire);
+
+        decrRefCount(val);
+        if (retval == C_ERR) {
+            addReplyError(c, "setting key in PM failed!");
+            return;
+        }
+        if (lookupKeyEntry(src,c->argv[1])->location == LOCATION_DRAM)
+            feedAppendOnlyFileDelTODIS(src,c->argv[1]->ptr);
+    } else {
+        dbAdd(dst,c->argv[1],o);
+        if (expire != -1) setExpire(dst,c->argv[1],expire);
+        incrRefCount(o);
+    }
+#else
     dbAdd(dst,c->argv[1],o);
     if (expire != -1) setExpire(dst,c->argv[1],expire);
     incrRefCount(o);
+#endif
 
     /* OK! key moved, free the entry in the source DB */
     dbDelete(src,c->argv[1]);
@@ -946,10 +1379,21 @@ void moveCommand(client *c) {
  *----------------------------------------------------------------------------*/
 
 int removeExpire(redisDb *db, robj *key) {
+#ifdef TODIS
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    /* An expire may only be removed if there is a corresponding entry in the
+     * main dict. Otherwise, the key will never be freed. */
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (dictDelete(db->expires,key->ptr) != DICT_OK) return 0;
+    if (de->location == LOCATION_PMEM) pmemSetExpire(de,-1);
+    return 1;
+#else
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
     return dictDelete(db->expires,key->ptr) == DICT_OK;
+#endif
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
@@ -960,6 +1404,10 @@ void setExpire(redisDb *db, robj *key, long long when) {
     serverAssertWithInfo(NULL,key,kde != NULL);
     de = dictReplaceRaw(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
+#ifdef TODIS
+    /* The expire of a PMEM key is persisted in its node. */
+    if (kde->location == LOCATION_PMEM) pmemSetExpire(kde,when);
+#endif
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -1012,8 +1460,8 @@ void propagateExpire(redisDb *db, robj *key) {
  * keys. */
 void propagateExpireTODIS(redisDb *db, dictEntry *entry) {
     robj *argv[2];
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, propagateExpireTODIS START");
+
+    pmemTrace(PMEM_TRACE_PROPAGATE_EXPIRE, entry, 0);
 
     sds key = dictGetKey(entry);
     robj *keyobj = createStringObject(key, sdslen(key));
@@ -1023,20 +1471,24 @@ void propagateExpireTODIS(redisDb *db, dictEntry *entry) {
     incrRefCount(argv[0]);
     incrRefCount(argv[1]);
 
-    if (entry->location == LOCATION_DRAM && server.aof_state != AOF_OFF)
-        feedAppendOnlyFile(server.delCommand,db->id,argv,2);
+    if (entry->location == LOCATION_DRAM) feedAppendOnlyFileDelTODIS(db,key);
     replicationFeedSlaves(server.slaves,db->id,argv,2);
 
     decrRefCount(argv[0]);
     decrRefCount(argv[1]);
-    serverLog(LL_TODIS, "TODIS, propagateExpireTODIS END");
 }
 #endif
 
 int expireIfNeeded(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+    mstime_t when;
     mstime_t now;
 
+#ifdef TODIS
+    /* A PMEM key not warmed up yet gets its expire with its entry. */
+    if (server.pmem_warming) lookupKeyEntry(db,key);
+#endif
+    when = getExpire(db,key);
+
     if (when < 0) return 0; /* No expire for this key */
 
     /* Don't expire anything while loading. It will be done later. */
@@ -1181,6 +1633,9 @@ void persistCommand(client *c) {
     dictEntry *de;
 
     de = dictFind(c->db->dict,c->argv[1]->ptr);
+#ifdef TODIS
+    if (de == NULL) de = pmemWarmupLookup(c->db,c->argv[1]->ptr);
+#endif
     if (de == NULL) {
         addReply(c,shared.czero);
     } else {
@@ -30,6 +30,9 @@
 #include "server.h"
 #include "sha1.h"   /* SHA1 is used for DEBUG DIGEST */
 #include "crc64.h"
+#ifdef TODIS
+#include "pmem_trace.h"
+#endif
 
 #include <arpa/inet.h>
 #include <signal.h>
@@ -121,6 +124,9 @@ void computeDatasetDigest(unsigned char *final) {
     uint32_t aux;
 
     memset(final,0,20); /* Start with a clean result */
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -309,6 +315,10 @@ void debugCommand(client *c) {
         "jemalloc info  -- Show internal jemalloc statistics.");
         blen++; addReplyStatus(c,
         "jemalloc purge -- Force jemalloc to release unused memory.");
+#ifdef TODIS
+        blen++; addReplyStatus(c,
+        "pmem-redo-crash <key> <value> -- Commit the redo record of an in-place overwrite of a PMEM value and exit before applying it.");
+#endif
         setDeferredMultiBulkLength(c,blenp,blen);
     } else if (!strcasecmp(c->argv[1]->ptr,"segfault")) {
         *((char*)-1) = 'x';
@@ -360,7 +370,11 @@ void debugCommand(client *c) {
         robj *val;
         char *strenc;
 
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        de = dictFind(c->db->dict,c->argv[2]->ptr);
+#ifdef TODIS
+        if (de == NULL) de = pmemWarmupLookup(c->db,c->argv[2]->ptr);
+#endif
+        if (de == NULL) {
             addReply(c,shared.nokeyerr);
             return;
         }
@@ -412,7 +426,11 @@ void debugCommand(client *c) {
         robj *val;
         sds key;
 
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        de = dictFind(c->db->dict,c->argv[2]->ptr);
+#ifdef TODIS
+        if (de == NULL) de = pmemWarmupLookup(c->db,c->argv[2]->ptr);
+#endif
+        if (de == NULL) {
             addReply(c,shared.nokeyerr);
             return;
         }
@@ -522,6 +540,21 @@ void debugCommand(client *c) {
         stats = sdscat(stats,buf);
 
         addReplyBulkSds(c,stats);
+#ifdef TODIS
+    } else if (!strcasecmp(c->argv[1]->ptr,"pmem-redo-crash") && c->argc == 4) {
+        dictEntry *de = dictFind(c->db->dict,c->argv[2]->ptr);
+
+        if (de == NULL) {
+            addReply(c,shared.nokeyerr);
+            return;
+        }
+        if (pmemDebugValueRedo(de,c->argv[3]->ptr) == C_ERR) {
+            addReplyError(c,"The value can't be overwritten in place");
+            return;
+        }
+        serverLog(LL_WARNING,"PMEM redo record committed by DEBUG PMEM-REDO-CRASH, exiting");
+        exit(1);
+#endif
     } else if (!strcasecmp(c->argv[1]->ptr,"jemalloc") && c->argc == 3) {
 #if defined(USE_JEMALLOC)
         if (!strcasecmp(c->argv[2]->ptr, "info")) {
@@ -1046,6 +1079,11 @@ void sigsegvHandler(int sig, siginfo_t *info, void *secret) {
     /* Log dump of processor registers */
     logRegisters(uc);
 
+#ifdef TODIS
+    /* Log the last trace records of every thread */
+    pmemTraceLogCrash();
+#endif
+
 #if defined(HAVE_PROC_MAPS)
     /* Test memory */
     serverLogRaw(LL_WARNING|LL_RAW, "\n------ FAST MEMORY TEST ------\n");
@@ -49,6 +49,9 @@
 #include "server.h"
 #include "pmem.h"
 #endif
+#ifdef TODIS
+#include "pmem_trace.h"
+#endif
 
 #include "dict.h"
 #include "zmalloc.h"
@@ -169,9 +172,6 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
-#ifdef TODIS
-    ht->pmem_used = 0;
-#endif
 }
 
 /* Create a new hash table */
@@ -194,6 +194,9 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+#ifdef TODIS
+    d->pmem_used = 0;
+#endif
     return DICT_OK;
 }
 
@@ -230,9 +233,6 @@ int dictExpand(dict *d, unsigned long size)
     n.sizemask = realsize-1;
     n.table = zcalloc(realsize*sizeof(dictEntry*));
     n.used = 0;
-#ifdef TODIS
-    n.pmem_used = 0;
-#endif
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -282,12 +282,6 @@ int dictRehash(dict *d, int n) {
             d->ht[1].table[h] = de;
             d->ht[0].used--;
             d->ht[1].used++;
-#ifdef TODIS
-            if (de->location == LOCATION_PMEM) {
-                d->ht[0].pmem_used--;
-                d->ht[1].pmem_used++;
-            }
-#endif
             de = nextde;
         }
         d->ht[0].table[d->rehashidx] = NULL;
@@ -346,7 +340,7 @@ int dictAdd(dict *d, void *key, void *val)
     if (!entry) return DICT_ERR;
     dictSetVal(d, entry, val);
 #ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, dictAdd key: %s, val: %s", key, ((robj *)val)->ptr);
+    pmemTrace(PMEM_TRACE_DICT_ADD, key, 0);
 #endif
     return DICT_OK;
 }
@@ -361,7 +355,7 @@ int dictAddPM(dict *d, void *key, void *val)
     dictSetVal(d, entry, val);
 
 #ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, dictAddPM key: %s, val: %s", key, ((robj *)val)->ptr);
+    pmemTrace(PMEM_TRACE_DICT_ADD_PM, key, val);
 #endif
 
     return DICT_OK;
@@ -408,6 +402,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
     ht->used++;
 #ifdef TODIS
     entry->location = LOCATION_DRAM;
+    entry->pmem_slot = 0;
 #endif
 
     /* Set the hash entry fields. */
@@ -456,9 +451,11 @@ dictEntry *dictAddRawPM(dict *d, void *key)
     ht->table[index] = entry;
     ht->used++;
 #ifdef TODIS
-    ht->pmem_used++;
+    d->pmem_used++;
     entry->location = LOCATION_PMEM;
-    serverLog(LL_TODIS, "TODIS, dictAddRawPM pmem used: %ld", ht->pmem_used);
+    entry->pmem_slot = 0;
+    pmemTrace(PMEM_TRACE_DICT_ADD_RAW_PM, entry, d->pmem_used);
+    pmemLruAdd(entry);
 #endif
 
     /* Set the hash entry fields. */
@@ -466,14 +463,13 @@ dictEntry *dictAddRawPM(dict *d, void *key)
     return entry;
 }
 
-void dictAddReconstructedPM(dict *d, void *key, void *val)
+/* Adds an entry for a key read from PMEM, 'val' being its value object.
+ * Returns NULL if the key already exists, the caller decides which copy
+ * to keep. */
+dictEntry *dictAddReconstructedPM(dict *d, void *key, void *val)
 {
-#ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, dictAddReconstructedPM START");
-#endif
     int index;
     dictEntry *entry;
-    robj *val_robj;
     dictht *ht;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
@@ -482,14 +478,9 @@ void dictAddReconstructedPM(dict *d, void *key, void *val)
      * the element already exists. */
     if ((index = _dictKeyIndex(d, (const void *)key)) == -1) {
 #ifdef TODIS
-        serverLog(
-                LL_TODIS,
-                "TODIS, dictAddReconstructedPM key duplicated: %s",
-                key);
-        dictReplaceTODIS(d, key, val);
-        serverLog(LL_TODIS, "TODIS, dictAddReconstructedPM duplicated replaced");
+        pmemTrace(PMEM_TRACE_DICT_RECONSTRUCT_DUP, key, 0);
 #endif
-        return;
+        return NULL;
     }
 
     /* Allocate the memory and store the new entry.
@@ -498,20 +489,20 @@ void dictAddReconstructedPM(dict *d, void *key, void *val)
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
     entry = zmalloc(sizeof(*entry));
-    val_robj = createObjectPM(OBJ_STRING, val);
 
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
 #ifdef TODIS
-    ht->pmem_used++;
+    d->pmem_used++;
     entry->location = LOCATION_PMEM;
-    serverLog(LL_TODIS, "TODIS, dictAddReconstructedPM pmem used: %ld", ht->pmem_used);
-    serverLog(LL_TODIS, "TODIS, dictAddReconstructedPM key: %s, val: %s", key, val);
+    entry->pmem_slot = 0;
+    pmemTrace(PMEM_TRACE_DICT_RECONSTRUCT, key, d->pmem_used);
 #endif
 
     dictSetKey(d, entry, key);
-    dictSetVal(d, entry, val_robj);
+    dictSetVal(d, entry, val);
+    return entry;
 }
 #endif
 
@@ -581,42 +572,82 @@ int dictReplaceTODIS(dict *d, void *key, void *val)
      * does not exists dictAdd will suceed. */
     if (dictAddPM(d, key, val) == DICT_OK)
         return 1;
-    /* It already exists, get the entry */
+    /* It already exists, get the entry. DRAM entries are moved to PMEM
+     * with a new record by dbOverwritePM(). */
     entry = dictFind(d, key);
+    serverAssert(entry->location == LOCATION_PMEM);
     /* Set the new value and free the old one. Note that it is important
      * to do that in this order, as the value may just be exactly the same
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    if (entry->location == LOCATION_DRAM) {
-        serverLog(LL_TODIS, "TODIS, dictReplaceTODIS location dram");
-        PMEMoid kv_PM;
-        PMEMoid *kv_pm_reference;
-
-        sds copy = sdsdupPM(key, (void **) &kv_pm_reference);
-        dictFreeKey(d, entry);
-        dictFreeVal(d, entry);
-        dictSetKey(d, entry, copy);
-        entry->location = LOCATION_PMEM;
-        dictht *ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-        ht->pmem_used++;
-        dictSetVal(d, entry, val);
-        serverLog(LL_TODIS, "TODIS, dictReplaceTODIS set pmem location completed");
-
-        kv_PM = pmemAddToPmemList((void *)copy, (void *)(((robj *)val)->ptr));
-        *kv_pm_reference = kv_PM;
-        return 0;
-    } else {
-        auxentry = *entry;
-        dictSetVal(d, entry, val);
-        long long start_queue_update_time = ustime();
+    auxentry = *entry;
+    dictSetVal(d, entry, val);
+    long long start_queue_update_time = ustime();
+    pmemKVpairSet(entry->key, ((robj *)val)->ptr);
+    pmemLruTouch(entry);
+    if (!pmemVolatileOrder()) {
         // pmemKVpairSetRearrangeList_legacy(entry->key, ((robj *)val)->ptr);
         pmemKVpairSetRearrangeList(entry->key, ((robj *)val)->ptr);
-        long long end_queue_update_time = ustime();
-        server.queue_update_time += end_queue_update_time - start_queue_update_time;
-        dictFreeVal(d, &auxentry);
-        return 0;
     }
+    long long end_queue_update_time = ustime();
+    server.queue_update_time += end_queue_update_time - start_queue_update_time;
+    dictFreeVal(d, &auxentry);
+    return 0;
+}
+
+/* Parallel reconstruction of PMEM entries. The caller sizes the table with
+ * dictExpand() and completes the rehashing first, then every thread links
+ * entries only into the buckets it owns, by hash 'h', and the counters are
+ * updated once with dictAccountReconstructedPM(). Returns NULL if the key
+ * already exists. */
+dictEntry *dictLinkReconstructedPM(dict *d, unsigned int h, void *key, void *val)
+{
+    unsigned long idx = h & d->ht[0].sizemask;
+    dictEntry *entry;
+
+    for (entry = d->ht[0].table[idx]; entry != NULL; entry = entry->next) {
+        if (key == entry->key || dictCompareKeys(d, key, entry->key))
+            return NULL;
+    }
+
+    entry = zmalloc(sizeof(*entry));
+    entry->next = d->ht[0].table[idx];
+    d->ht[0].table[idx] = entry;
+    entry->location = LOCATION_PMEM;
+    entry->pmem_slot = 0;
+    dictSetKey(d, entry, key);
+    dictSetVal(d, entry, val);
+    return entry;
+}
+
+void dictAccountReconstructedPM(dict *d, unsigned long count)
+{
+    d->ht[0].used += count;
+    d->pmem_used += count;
+}
+
+/* Moves a DRAM entry to PMEM in place, the reverse of dictDemoteEntryPM():
+ * the DRAM key and value are freed and replaced by the PMEM ones. */
+void dictPromoteEntryPM(dict *d, dictEntry *de, void *key, void *val)
+{
+    dictFreeKey(d, de);
+    dictFreeVal(d, de);
+    dictSetKey(d, de, key);
+    dictSetVal(d, de, val);
+    de->location = LOCATION_PMEM;
+    d->pmem_used++;
+}
+
+/* Moves a PMEM entry to DRAM in place: the entry keeps its bucket and only
+ * the key, the value and the location change, so no hashing is needed. The
+ * previous key and value are not freed, the caller owns them. */
+void dictDemoteEntryPM(dict *d, dictEntry *de, void *key, void *val)
+{
+    dictSetKey(d, de, key);
+    dictSetVal(d, de, val);
+    de->location = LOCATION_DRAM;
+    d->pmem_used--;
 }
 #endif
 /* dictReplaceRaw() is simply a version of dictAddRaw() that always
@@ -653,16 +684,16 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree)
                     prevHe->next = he->next;
                 else
                     d->ht[table].table[idx] = he->next;
+#ifdef TODIS
+                if (he->location == LOCATION_PMEM) {
+                    d->pmem_used--;
+                }
+#endif
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
                     zfree(he);
                 }
-#ifdef TODIS
-                if (he->location == LOCATION_PMEM) {
-                    d->ht[table].pmem_used--;
-                }
-#endif
                 d->ht[table].used--;
                 return he;
             }
@@ -706,7 +737,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
             dictFreeVal(d, he);
 #ifdef TODIS
             if (he->location == LOCATION_PMEM) {
-                ht->pmem_used--;
+                d->pmem_used--;
             }
 #endif
             zfree(he);
@@ -59,6 +59,12 @@ typedef struct dictEntry {
      * TODO Need to change as an atomic variable
      * */
     unsigned location:1;
+    /*
+     * TODIS - Slot plus one of the DRAM side metadata of PMEM entries in
+     * server.pmem_entries, 0 if not tracked. Fits in the padding after
+     * location, so the entry keeps its size.
+     * */
+    unsigned int pmem_slot;
 #endif
     struct dictEntry *next;
 } dictEntry;
@@ -79,9 +85,6 @@ typedef struct dictht {
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
-#ifdef TODIS
-    unsigned long pmem_used;
-#endif
 } dictht;
 
 typedef struct dict {
@@ -90,6 +93,11 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+#ifdef TODIS
+    /* Entries located in PMEM, in both tables: entries may change tier in
+     * place without knowing which table holds them. */
+    unsigned long pmem_used;
+#endif
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -156,7 +164,7 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #ifdef TODIS
-#define dictSizePM(d) ((d)->ht[0].pmem_used + (d)->ht[1].pmem_used)
+#define dictSizePM(d) ((d)->pmem_used)
 #endif
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
@@ -202,12 +210,16 @@ unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *pri
 /* PMEM-specific API */
 int dictAddPM(dict *d, void *key, void *val);
 dictEntry *dictAddRawPM(dict *d, void *key);
-void dictAddReconstructedPM(dict *d, void *key, void *val);
+dictEntry *dictAddReconstructedPM(dict *d, void *key, void *val);
 int dictReplacePM(dict *d, void *key, void *val);
 #endif
 #ifdef TODIS
 int dictAddReconstructedVictim(dict *d, void *key, void *val);
 int dictReplaceTODIS(dict *d, void *key, void *val);
+void dictPromoteEntryPM(dict *d, dictEntry *de, void *key, void *val);
+void dictDemoteEntryPM(dict *d, dictEntry *de, void *key, void *val);
+dictEntry *dictLinkReconstructedPM(dict *d, unsigned int h, void *key, void *val);
+void dictAccountReconstructedPM(dict *d, unsigned long count);
 #endif
 
 /* Hash table types */
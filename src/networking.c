@@ -1259,6 +1259,9 @@ int processMultibulkBuffer(client *c) {
 
 void processInputBuffer(client *c) {
     server.current_client = c;
+#ifdef TODIS
+    pmemGroupBegin();
+#endif
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
         /* Return if clients are paused. */
@@ -1298,11 +1301,17 @@ void processInputBuffer(client *c) {
             /* Only reset the client when the command was executed. */
             if (processCommand(c) == C_OK)
                 resetClient(c);
+#ifdef TODIS
+            pmemGroupCheck();
+#endif
             /* freeMemoryIfNeeded may flush slave output buffers. This may result
              * into a slave, that may be the active client, to be freed. */
             if (server.current_client == NULL) break;
         }
     }
+#ifdef TODIS
+    pmemGroupCommit();
+#endif
     server.current_client = NULL;
 }
 
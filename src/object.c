@@ -42,6 +42,16 @@
 #define strtold(a,b) ((long double)strtod((a),(b)))
 #endif
 
+/* Initial value of the lru field of a new object: the LRU clock, or with
+ * pmem-tiering lfu the current time and the initial access counter. */
+static unsigned objectInitialLRU(void) {
+#ifdef TODIS
+    if (server.pmem_tiering == PMEM_TIERING_LFU)
+        return (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+#endif
+    return LRU_CLOCK();
+}
+
 robj *createObject(int type, void *ptr) {
     robj *o = zmalloc(sizeof(*o));
     o->type = type;
@@ -50,7 +60,7 @@ robj *createObject(int type, void *ptr) {
     o->refcount = 1;
 
     /* Set the LRU to the current lruclock (minutes resolution). */
-    o->lru = LRU_CLOCK();
+    o->lru = objectInitialLRU();
     return o;
 }
 
@@ -64,7 +74,7 @@ robj *createObjectPM(int type, void *ptr) {
     o->refcount = 1;
 
     /* Set the LRU to the current lruclock (minutes resolution). */
-    o->lru = LRU_CLOCK();
+    o->lru = objectInitialLRU();
     return (robj *)o;
 }
 #endif
@@ -95,7 +105,7 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
-    o->lru = LRU_CLOCK();
+    o->lru = objectInitialLRU();
 
     sh->len = len;
     sh->alloc = len;
@@ -122,7 +132,7 @@ robj *createEmbeddedStringObjectPM(const char *ptr, size_t len) {
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
-    o->lru = LRU_CLOCK();
+    o->lru = objectInitialLRU();
 
     sh->len = len;
     sh->alloc = len;
@@ -228,6 +238,10 @@ robj *dupStringObject(robj *o) {
         return createRawStringObject(o->ptr,sdslen(o->ptr));
     case OBJ_ENCODING_EMBSTR:
         return createEmbeddedStringObject(o->ptr,sdslen(o->ptr));
+#ifdef TODIS
+    case OBJ_ENCODING_EMBPM:
+        return createStringObject(o->ptr,sdslen(o->ptr));
+#endif
     case OBJ_ENCODING_INT:
         d = createObject(OBJ_STRING, NULL);
         d->encoding = OBJ_ENCODING_INT;
@@ -251,6 +265,9 @@ robj *dupStringObjectPM(robj *o) {
     switch(o->encoding) {
     case OBJ_ENCODING_RAW:
     case OBJ_ENCODING_EMBSTR:
+#ifdef TODIS
+    case OBJ_ENCODING_EMBPM:
+#endif
         return createRawStringObjectPM(o->ptr,sdslen(o->ptr));
         /* return createEmbeddedStringObjectPM(o->ptr,sdslen(o->ptr)); */
     case OBJ_ENCODING_INT:
@@ -782,14 +799,76 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+#ifdef TODIS
+    case OBJ_ENCODING_EMBPM: return "embpm";
+#endif
     default: return "unknown";
     }
 }
 
+#ifdef TODIS
+/* Access frequency for pmem-tiering lfu, kept in the lru field of the
+ * objects: the 16 most significant bits are the time of the last access in
+ * minutes, the 8 least significant bits a logarithmic access counter. */
+
+/* Current time in minutes, on 16 bits. */
+unsigned long LFUGetTimeInMinutes(void) {
+    return (server.unixtime/60) & 65535;
+}
+
+/* Minutes elapsed since 'ldt', a time of LFUGetTimeInMinutes(). The time
+ * wraps after 45 days, so older times look more recent than they are. */
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Increments the counter with a probability that falls as the counter
+ * grows, so that 255 takes about a million reads with the default
+ * pmem-lfu-log-factor. */
+static uint8_t LFULogIncr(uint8_t counter) {
+    double r, baseval, p;
+
+    if (counter == 255) return 255;
+    r = (double)rand()/RAND_MAX;
+    baseval = counter - LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0/(baseval*server.pmem_lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* Returns the counter of 'o', decremented once per pmem-lfu-decay-time
+ * minutes elapsed since its last access. The object is not modified. */
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long periods = server.pmem_lfu_decay_time ?
+        LFUTimeElapsed(ldt) / server.pmem_lfu_decay_time : 0;
+
+    if (periods) counter = (periods > counter) ? 0 : counter - periods;
+    return counter;
+}
+
+/* Records an access to 'o': decays its counter, then increments it. */
+void updateLFU(robj *o) {
+    unsigned long counter = LFULogIncr(LFUDecrAndReturn(o));
+
+    o->lru = (LFUGetTimeInMinutes()<<8) | counter;
+}
+#endif
+
 /* Given an object returns the min number of milliseconds the object was never
  * requested, using an approximated LRU algorithm. */
 unsigned long long estimateObjectIdleTime(robj *o) {
     unsigned long long lruclock = LRU_CLOCK();
+#ifdef TODIS
+    /* The access time is kept in minutes with the LFU counter. */
+    if (server.pmem_tiering == PMEM_TIERING_LFU)
+        return (unsigned long long)LFUTimeElapsed(o->lru>>8) * 60 * 1000;
+#endif
     if (lruclock >= o->lru) {
         return (lruclock - o->lru) * LRU_CLOCK_RESOLUTION;
     } else {
@@ -803,7 +882,11 @@ unsigned long long estimateObjectIdleTime(robj *o) {
 robj *objectCommandLookup(client *c, robj *key) {
     dictEntry *de;
 
-    if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
+    de = dictFind(c->db->dict,key->ptr);
+#ifdef TODIS
+    if (de == NULL) de = pmemWarmupLookup(c->db,key->ptr);
+#endif
+    if (de == NULL) return NULL;
     return (robj*) dictGetVal(de);
 }
 
@@ -831,8 +914,23 @@ void objectCommand(client *c) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
         addReplyLongLong(c,estimateObjectIdleTime(o)/1000);
+#ifdef TODIS
+    } else if (!strcasecmp(c->argv[1]->ptr,"freq") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
+                == NULL) return;
+        if (server.pmem_tiering != PMEM_TIERING_LFU) {
+            addReplyError(c,"An LFU pmem-tiering is not selected, "
+                            "access frequency not tracked.");
+            return;
+        }
+        addReplyLongLong(c,LFUDecrAndReturn(o));
+    } else {
+        addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime|freq)");
+    }
+#else
     } else {
         addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime)");
     }
+#endif
 }
 
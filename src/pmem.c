@@ -35,6 +35,8 @@
 #include "util.h"
 #include "sds.h"
 #include "pmem_latency.h"
+#include "pmem_trace.h"
+#include "pmem_cache.h"
 
 int pmemReconstruct(void) {
     TOID(struct redis_pmem_root) root;
@@ -57,72 +59,940 @@ int pmemReconstruct(void) {
 		pmem_obj = (key_val_pair_PM *)(pmem_toid.oid.off + (uint64_t)pmem_base_addr);
 		key = (void *)(pmem_obj->key_oid.off + (uint64_t)pmem_base_addr);
 		val = (void *)(pmem_obj->val_oid.off + (uint64_t)pmem_base_addr);
-        (void) dictAddReconstructedPM(d, key, val);
+        robj *val_obj = createObjectPM(OBJ_STRING, val);
+        if (dictAddReconstructedPM(d, key, val_obj) == NULL)
+            zfree(val_obj);
     }
     return C_OK;
 }
 
 #ifdef TODIS
+/* PMEM shards (one pool per pmfile). With a single pmfile the lookups below
+ * return it at once. */
+pmemShard *pmemShardOfOid(PMEMoid oid) {
+    for (int i = 1; i < server.pm_num_shards; i++) {
+        if (server.pm_shards[i].uuid_lo == oid.pool_uuid_lo)
+            return server.pm_shards + i;
+    }
+    return server.pm_shards;
+}
+
+struct redis_pmem_root *pmemShardRoot(pmemShard *shard) {
+    return pmemobj_direct_latency(shard->rootoid.oid);
+}
+
+/* Returns the shard of a key from its entry 'de', NULL if the key does not
+ * exist: the one of its record for a PMEM key, else the one of its hash
+ * slot, so that the keys of a hash tag share a shard like in Redis
+ * Cluster. */
+pmemShard *pmemShardForEntry(dictEntry *de, sds key) {
+    if (server.pm_num_shards == 1) return server.pm_shards;
+    if (de != NULL && de->location == LOCATION_PMEM)
+        return pmemShardOfOid(*sdsPMEMoidBackReference(dictGetKey(de)));
+    return server.pm_shards +
+        keyHashSlot(key, sdslen(key)) % server.pm_num_shards;
+}
+
+/* Sets up a shard once its pool is open. The root of a pool just 'created'
+ * is initialized. */
+void pmemShardAttach(pmemShard *shard, int created) {
+    int enabled = 1;
+
+    shard->rootoid = POBJ_ROOT(shard->pool, struct redis_pmem_root);
+    shard->uuid_lo = shard->rootoid.oid.pool_uuid_lo;
+    shard->warmup_cursor = OID_NULL;
+    shard->victim_sealed = OID_NULL;
+    if (created) {
+        struct redis_pmem_root *root = pmemShardRoot(shard);
+
+        root->num_dict_entries = 0;
+        root->num_victim_entries = 0;
+        root->boot_gen = server.pmem_boot_gen;
+        pmemobj_persist(shard->pool, root, sizeof(*root));
+    }
+
+    /* The allocator statistics reported by INFO tiering. */
+    if (pmemobj_ctl_set(shard->pool, "stats.enabled", &enabled) != 0)
+        serverLog(LL_NOTICE,"PMEM allocator statistics not available for %s",
+                shard->path);
+}
+
+/* Adds a shard while the server runs: its pool is created at 'path' with
+ * 'size' bytes, and max-pmem-memory grows in proportion of the pool sizes.
+ * The shard gets its share of the new keys at once. Returns C_ERR, errno
+ * being set, if the pool could not be created. */
+int pmemShardAdd(const char *path, size_t size) {
+    pmemShard *shard = server.pm_shards + server.pm_num_shards;
+    PMEMobjpool *pool = pmemobj_create(path, PM_LAYOUT_NAME, size, 0666);
+
+    if (pool == NULL) return C_ERR;
+    shard->path = zstrdup(path);
+    shard->size = size;
+    shard->pool = pool;
+    pmemShardAttach(shard, 1);
+    /* The background AOF fsync reads the count: the shard is ready. */
+    __atomic_store_n(&server.pm_num_shards, server.pm_num_shards + 1,
+            __ATOMIC_RELEASE);
+
+    if (server.pm_file_size)
+        server.max_pmem_memory +=
+            (double)server.max_pmem_memory * size / server.pm_file_size;
+    else
+        server.max_pmem_memory += size;
+    server.pm_file_size += size;
+    serverLog(LL_NOTICE, "PMEM shard %d added: %s, %zu bytes, "
+        "max-pmem-memory %zu", server.pm_num_shards - 1, path, size,
+        server.max_pmem_memory);
+    return C_OK;
+}
+
+/* Makes 'shard' the pool of the next PMEM allocations and transactions,
+ * that is server.pm_pool, pm_rootoid and pool_uuid_lo. A transaction is
+ * bound to its pool: an open group commit or batch is committed, and goes
+ * on in a transaction of the new shard. A command must select the shard of
+ * its key before its own transaction begins. */
+void pmemShardSelect(pmemShard *shard) {
+    int group = server.pmem_group_open, batch = server.pmem_batch_open;
+
+    if (shard == server.pm_shard) return;
+    if (group) pmemGroupCommit();
+    else if (batch) pmemBatchCommit(1);
+    if (pmemobj_tx_stage() != TX_STAGE_NONE)
+        serverPanic("PMEM transaction across two shards");
+    server.pm_shard = shard;
+    server.pm_pool = shard->pool;
+    server.pm_rootoid = shard->rootoid;
+    server.pool_uuid_lo = shard->uuid_lo;
+    /* The group is reopened only if the pool of the shard has the room of
+     * the running command (pmemGroupPrepare()). */
+    if (group) {
+        if (pmemPoolHasRoom(server.pmem_group_need)) pmemGroupBegin();
+    } else if (batch) {
+        pmemBatchBegin();
+    }
+}
+
+/* Size of the allocation of a node: a whole record, rounded up to its
+ * allocation class, or the bare node. */
+static size_t pmemNodeAllocSize(struct key_val_pair_PM *obj) {
+    pmemShard *shard;
+    PMEMoid oid;
+
+    if (!(obj->flags & PMEM_NODE_EMBED_KEY))
+        return sizeof(struct key_val_pair_PM);
+    shard = pmemShardOfOid(obj->key_oid);
+    oid.pool_uuid_lo = shard->uuid_lo;
+    oid.off = (uint64_t)obj - (uint64_t)shard->pool->addr;
+    return pmemobj_alloc_usable_size(oid);
+}
+
+/* PMEM memory accounted to a node, its key and its value. */
+static size_t pmemNodeSize(struct key_val_pair_PM *obj) {
+    size_t size = pmemNodeAllocSize(obj);
+
+    if (!(obj->flags & PMEM_NODE_EMBED_KEY))
+        size += sdsAllocSizePM(getKeyFromPMObject(obj));
+    if (!(obj->flags & PMEM_NODE_VAL_INLINE))
+        size += sdsAllocSizePM(getValFromPMObject(obj));
+    return size;
+}
+
+int pmemNodeEmbedsKey(PMEMoid oid) {
+    return getPMObjectFromOid(oid)->flags & PMEM_NODE_EMBED_KEY;
+}
+
+/* DRAM object of the value of a node. An embedded value is not freed with
+ * its object but with its node: the EMBPM encoding tells it, as only RAW
+ * strings are freed by freeStringObject() and freeStringObjectPM(). */
+robj *pmemCreateValObject(struct key_val_pair_PM *obj) {
+    robj *o;
+
+    if (obj->flags & PMEM_NODE_INT_VAL) {
+        o = createObjectPM(OBJ_STRING, (void *)(long)obj->val_oid.off);
+        o->encoding = OBJ_ENCODING_INT;
+        return o;
+    }
+    o = createObjectPM(OBJ_STRING, getValFromPMObject(obj));
+    if (obj->flags & PMEM_NODE_EMBED_VAL)
+        o->encoding = OBJ_ENCODING_EMBPM;
+    return o;
+}
+
+typedef struct pmemLruStamp {
+    uint64_t stamp;
+    dictEntry *de;
+} pmemLruStamp;
+
+static int pmemLruStampCompare(const void *a, const void *b) {
+    uint64_t sa = ((const pmemLruStamp *)a)->stamp;
+    uint64_t sb = ((const pmemLruStamp *)b)->stamp;
+
+    return (sa > sb) - (sa < sb);
+}
+
+/* State of the PMEM list reconstruction shared by the worker threads. The
+ * nodes are first split in contiguous slices (hashing, value objects and
+ * memory accounting), then every worker links into the dicts only the nodes
+ * whose bucket falls in its own range of every table, so no locking is
+ * needed. While preparing its slice, a worker sorts its nodes by the worker
+ * linking them, so that a linker only visits its own nodes. */
+typedef struct pmemReconstructNode {
+    struct key_val_pair_PM *obj;
+    sds key;
+    robj *val;
+    unsigned int hash;
+    int dbid;
+    dictEntry *de;              /* NULL if the key was already in the dict */
+} pmemReconstructNode;
+
+typedef struct pmemReconstructJob {
+    pmemReconstructNode *nodes;
+    unsigned long num_nodes;
+    struct pmemReconstructWorker *workers;
+    int num_workers;
+} pmemReconstructJob;
+
+typedef struct pmemReconstructWorker {
+    pmemReconstructJob *job;
+    int id;
+    size_t used_pmem_memory;
+    unsigned long *linked;      /* Entries linked per db */
+    unsigned long **parts;      /* Nodes of the slice, per linking worker */
+    unsigned long *part_len;
+    pthread_t thread;
+} pmemReconstructWorker;
+
+/* Worker linking 'node', by the bucket of its key. */
+static int pmemReconstructOwner(pmemReconstructJob *job,
+        pmemReconstructNode *node) {
+    dict *d = server.db[node->dbid].dict;
+    unsigned long idx = node->hash & d->ht[0].sizemask;
+
+    return idx * job->num_workers / d->ht[0].size;
+}
+
+static void pmemReconstructPrepare(pmemReconstructWorker *w) {
+    pmemReconstructJob *job = w->job;
+    unsigned long start = job->num_nodes * w->id / job->num_workers;
+    unsigned long end = job->num_nodes * (w->id + 1) / job->num_workers;
+
+    for (unsigned long i = start; i < end; ++i) {
+        pmemReconstructNode *node = job->nodes + i;
+
+        node->key = getKeyFromPMObject(node->obj);
+        node->val = pmemCreateValObject(node->obj);
+        node->hash = dictHashKey(server.db[node->dbid].dict, node->key);
+        w->used_pmem_memory += pmemNodeSize(node->obj);
+        w->part_len[pmemReconstructOwner(job, node)]++;
+    }
+    for (int i = 0; i < job->num_workers; ++i) {
+        w->parts[i] = zmalloc(sizeof(unsigned long) * (w->part_len[i] + 1));
+        w->part_len[i] = 0;
+    }
+    for (unsigned long i = start; i < end; ++i) {
+        int owner = pmemReconstructOwner(job, job->nodes + i);
+
+        w->parts[owner][w->part_len[owner]++] = i;
+    }
+}
+
+static void pmemReconstructLink(pmemReconstructWorker *w) {
+    pmemReconstructJob *job = w->job;
+
+    /* Walk the slices in list order, so the first node of a duplicated key
+     * wins like in a sequential reconstruction. */
+    for (int p = 0; p < job->num_workers; ++p) {
+        pmemReconstructWorker *slice = job->workers + p;
+
+        for (unsigned long k = 0; k < slice->part_len[w->id]; ++k) {
+            pmemReconstructNode *node = job->nodes + slice->parts[w->id][k];
+            dict *d = server.db[node->dbid].dict;
+
+            node->de = dictLinkReconstructedPM(d, node->hash, node->key,
+                    node->val);
+            if (node->de != NULL) {
+                node->obj->de = node->de;
+                node->obj->de_gen = server.pmem_boot_gen;
+                w->linked[node->dbid]++;
+            }
+        }
+    }
+}
+
+static void *pmemReconstructWorkerMain(void *arg) {
+    pmemReconstructWorker *w = arg;
+
+    pmemReconstructPrepare(w);
+    return NULL;
+}
+
+static void *pmemReconstructLinkerMain(void *arg) {
+    pmemReconstructLink(arg);
+    return NULL;
+}
+
+/* Runs 'fn' on every worker, the main thread taking the first one. */
+static void pmemReconstructRun(pmemReconstructWorker *workers, int num_workers,
+        void *(*fn)(void *)) {
+    int started = 1;
+
+    for (int i = 1; i < num_workers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, fn, workers + i) != 0) {
+            serverLog(LL_WARNING,
+                "Can't create PMEM reconstruction thread, running it inline");
+            break;
+        }
+        started++;
+    }
+    fn(workers);
+    for (int i = 1; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+    for (int i = started; i < num_workers; ++i)
+        fn(workers + i);
+}
+
+/* Persistent hash index (pmem-lazy-reconstruct). Buckets live in a pool
+ * array referenced by the root and chain the nodes through index_next, so
+ * that a key can be found in PMEM without the DRAM dict. The array ends
+ * with the number of nodes of every logical db (index_dbs counters), used
+ * to size the dicts and to answer DBSIZE while warming up. The index is
+ * updated in the transactions adding and removing nodes, and is rebuilt by
+ * an eager reconstruction when missing, resized or built for another
+ * number of databases. */
+static uint64_t pmemIndexBuckets(void) {
+    uint64_t buckets = 1;
+
+    while (buckets < server.pmem_index_buckets) buckets <<= 1;
+    return buckets;
+}
+
+/* The hash must be stable across restarts, unlike the seeded dict hash. */
+static uint64_t pmemIndexBucket(uint32_t dbid, sds key, uint64_t buckets) {
+    return crc64(dbid, (unsigned char *)key, sdslen(key)) & (buckets - 1);
+}
+
+static TOID(struct key_val_pair_PM) *pmemIndexTable(struct redis_pmem_root *root) {
+    if (OID_IS_NULL(root->index)) return NULL;
+    return pmemobj_direct_latency(root->index);
+}
+
+/* Allocates, in the running transaction, an empty index for the current
+ * number of buckets and databases. */
+static void pmemIndexAlloc(struct redis_pmem_root *root) {
+    root->index_buckets = pmemIndexBuckets();
+    root->index_dbs = server.dbnum;
+    root->index = pmemobj_tx_zalloc_latency(
+            sizeof(TOID(struct key_val_pair_PM)) * root->index_buckets +
+            sizeof(uint64_t) * root->index_dbs, 0);
+}
+
+/* Returns the node counter of a db, NULL if the index does not count it. */
+static uint64_t *pmemIndexDbCount(struct redis_pmem_root *root, uint32_t dbid) {
+    TOID(struct key_val_pair_PM) *table = pmemIndexTable(root);
+
+    if (table == NULL || dbid >= root->index_dbs) return NULL;
+    return (uint64_t *)(table + root->index_buckets) + dbid;
+}
+
+/* Links a node at the head of its bucket. 'fresh' tells that neither the
+ * bucket nor the node need an undo log entry, as both were allocated by the
+ * running transaction. */
+static void pmemIndexLink(struct redis_pmem_root *root, PMEMoid oid, int fresh) {
+    TOID(struct key_val_pair_PM) *table = pmemIndexTable(root);
+    struct key_val_pair_PM *obj = getPMObjectFromOid(oid);
+    uint64_t bucket = pmemIndexBucket(obj->dbid, getKeyFromPMObject(obj),
+            root->index_buckets);
+    uint64_t *count = pmemIndexDbCount(root, obj->dbid);
+
+    if (!fresh) {
+        TX_ADD_RANGE_DIRECT_LATENCY(table + bucket, sizeof(*table));
+        if (count) TX_ADD_RANGE_DIRECT_LATENCY(count, sizeof(*count));
+    }
+    obj->index_next = table[bucket];
+    table[bucket].oid = oid;
+    if (count) (*count)++;
+}
+
+static void pmemIndexInsert(PMEMoid oid) {
+    struct redis_pmem_root *root = getPmemRootObject();
+
+    if (!server.pmem_lazy_reconstruct) return;
+    if (OID_IS_NULL(root->index)) {
+        /* First node of a new pool. */
+        TX_ADD_DIRECT_LATENCY(root);
+        pmemIndexAlloc(root);
+    }
+    pmemIndexLink(root, oid, 0);
+}
+
+/* Unlinks a node leaving the pmem list: deleted or demoted to DRAM. */
+void pmemIndexRemove(PMEMoid oid) {
+    struct redis_pmem_root *root = pmemShardRoot(pmemShardOfOid(oid));
+    TOID(struct key_val_pair_PM) *table = pmemIndexTable(root), *prev;
+    struct key_val_pair_PM *obj;
+
+    if (table == NULL) return;
+    obj = getPMObjectFromOid(oid);
+    prev = table + pmemIndexBucket(obj->dbid, getKeyFromPMObject(obj),
+            root->index_buckets);
+    while (!TOID_IS_NULL(*prev)) {
+        if (prev->oid.off == oid.off) {
+            uint64_t *count = pmemIndexDbCount(root, obj->dbid);
+
+            TX_ADD_RANGE_DIRECT_LATENCY(prev, sizeof(*prev));
+            *prev = obj->index_next;
+            if (count && *count) {
+                TX_ADD_RANGE_DIRECT_LATENCY(count, sizeof(*count));
+                (*count)--;
+            }
+            return;
+        }
+        prev = &D_RW_LATENCY(*prev)->index_next;
+    }
+}
+
+static struct key_val_pair_PM *pmemIndexShardLookup(
+        struct redis_pmem_root *root, uint32_t dbid, sds key) {
+    TOID(struct key_val_pair_PM) *table = pmemIndexTable(root);
+    TOID(struct key_val_pair_PM) toid;
+
+    if (table == NULL) return NULL;
+    toid = table[pmemIndexBucket(dbid, key, root->index_buckets)];
+    while (!TOID_IS_NULL(toid)) {
+        struct key_val_pair_PM *obj = D_RW_LATENCY(toid);
+        if (obj->dbid == dbid && sdscmp(getKeyFromPMObject(obj), key) == 0)
+            return obj;
+        toid = obj->index_next;
+    }
+    return NULL;
+}
+
+/* The shard of the hash slot of the key is looked up first. The others may
+ * hold the key if the pmfile lines changed since it was written. */
+static struct key_val_pair_PM *pmemIndexLookup(uint32_t dbid, sds key) {
+    int first = server.pm_num_shards == 1 ? 0 :
+        keyHashSlot(key, sdslen(key)) % server.pm_num_shards;
+
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShard *shard =
+            server.pm_shards + (first + i) % server.pm_num_shards;
+        struct key_val_pair_PM *obj =
+            pmemIndexShardLookup(pmemShardRoot(shard), dbid, key);
+
+        if (obj != NULL) return obj;
+    }
+    return NULL;
+}
+
+/* Called after an eager reconstruction: drops the index when the lazy mode
+ * is off, otherwise (re)builds it from the pmem list. */
+static void pmemIndexRebuild(void) {
+    struct redis_pmem_root *root = getPmemRootObject();
+    TOID(struct key_val_pair_PM) pmem_toid;
+    long long start = ustime();
+    unsigned long indexed = 0;
+
+    if (!OID_IS_NULL(root->index)) {
+        TX_ADD_DIRECT_LATENCY(root);
+        pmemobj_tx_free_latency(root->index);
+        root->index = OID_NULL;
+        root->index_buckets = 0;
+        root->index_dbs = 0;
+    }
+    if (!server.pmem_lazy_reconstruct) return;
+
+    TX_ADD_DIRECT_LATENCY(root);
+    pmemIndexAlloc(root);
+    /* index_next of nodes outside an index is never read: no undo log. The
+     * links are flushed here though, as the commit only persists the new
+     * buckets, and must not publish them before the chains they head. */
+    for (pmem_toid = root->pe_first; !TOID_IS_NULL(pmem_toid);
+        pmem_toid = D_RO_LATENCY(pmem_toid)->pmem_list_next)
+    {
+        pmemIndexLink(root, pmem_toid.oid, 1);
+        pmemobj_flush(server.pm_pool, &D_RO(pmem_toid)->index_next,
+                sizeof(D_RO(pmem_toid)->index_next));
+        indexed++;
+        if (TOID_EQUALS(pmem_toid, root->pe_last)) break;
+    }
+    pmemobj_drain(server.pm_pool);
+    serverLog(LL_NOTICE,
+        "PMEM hash index built: %lu keys in %lu buckets, %.3f seconds",
+        indexed, (unsigned long)root->index_buckets,
+        (float)(ustime()-start)/1000000);
+}
+
+/* Restores the expire of a node bound to 'de' at startup. Expires share the
+ * key sds with the main dict. */
+static void pmemLoadExpire(redisDb *db, dictEntry *de,
+        struct key_val_pair_PM *obj) {
+    if (obj->expire == 0) return;
+    dictSetSignedIntegerVal(dictReplaceRaw(db->expires, dictGetKey(de)),
+            obj->expire);
+}
+
+/* Deletes the DRAM copy of a key found in PMEM at startup. The copy was
+ * loaded from the AOF and is older than the PMEM one. */
+static void pmemDropDramCopy(redisDb *db, sds key) {
+    if (dictSize(db->expires) > 0) dictDelete(db->expires, key);
+    dictDelete(db->dict, key);
+}
+
+/* Adds the DRAM entry of a node the lazy reconstruction did not reach yet.
+ * A DRAM copy of the key loaded from the AOF is older than the PMEM one
+ * and is replaced. */
+static dictEntry *pmemMaterializeNode(struct key_val_pair_PM *obj) {
+    redisDb *db = &server.db[obj->dbid < (uint32_t)server.dbnum ? obj->dbid : 0];
+    sds key = getKeyFromPMObject(obj);
+    dictEntry *de = dictFind(db->dict, key);
+
+    if (de != NULL && de->location == LOCATION_PMEM) return de;
+    if (de != NULL) pmemDropDramCopy(db, key);
+    de = dictAddReconstructedPM(db->dict, key, pmemCreateValObject(obj));
+    obj->de = de;
+    obj->de_gen = server.pmem_boot_gen;
+    pmemLoadExpire(db, de, obj);
+    server.used_pmem_memory += pmemNodeSize(obj);
+    if (obj->lru_stamp > server.pmem_lru_clock)
+        server.pmem_lru_clock = obj->lru_stamp;
+    pmemLruAdd(de);
+    if (db->pmem_cold_keys) db->pmem_cold_keys--;
+    server.pmem_warmup_keys++;
+    return de;
+}
+
+static int pmemNodeBound(struct key_val_pair_PM *obj) {
+    return obj->de != NULL && obj->de_gen == server.pmem_boot_gen;
+}
+
+/* Lazy reconstruction: the server starts without walking the pmem list.
+ * Keys are materialized on first access through the hash index, and
+ * pmemWarmupCron() materializes the rest incrementally from the list. */
+static void pmemWarmupStart(void) {
+    unsigned long left = 0;
+    dictIterator *di;
+    dictEntry *de;
+
+    server.pmem_warmup_start = ustime();
+    server.pmem_warmup_keys = 0;
+    server.pmem_warmup_shard = 0;
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShard *shard = server.pm_shards + i;
+        struct redis_pmem_root *root = pmemShardRoot(shard);
+
+        shard->warmup_cursor = root->pe_first.oid;
+        if (TOID_IS_NULL(root->pe_first)) continue;
+        left += root->num_dict_entries;
+        /* The head holds the most recent write stamp in most cases. */
+        if (D_RO_LATENCY(root->pe_first)->lru_stamp > server.pmem_lru_clock)
+            server.pmem_lru_clock = D_RO_LATENCY(root->pe_first)->lru_stamp;
+    }
+    if (left == 0) return;
+
+    server.pmem_warming = 1;
+
+    /* Size every dict for its keys once, as the eager reconstruction, and
+     * account the keys not materialized yet in DBSIZE and INFO. Keys loaded
+     * from the AOF shadow a newer PMEM copy until warmed up: resolve them
+     * now, the cost is bound by the AOF and not by the pool. */
+    for (int j = 0; j < server.dbnum; j++) {
+        unsigned long cold = 0;
+
+        for (int i = 0; i < server.pm_num_shards; i++) {
+            uint64_t *count =
+                pmemIndexDbCount(pmemShardRoot(server.pm_shards + i), j);
+
+            if (count) cold += *count;
+        }
+        if (cold) {
+            dict *d = server.db[j].dict;
+
+            dictExpand(d, dictSize(d) + cold);
+            while (dictIsRehashing(d)) dictRehash(d, 1000);
+            server.db[j].pmem_cold_keys = cold;
+        }
+        di = dictGetSafeIterator(server.db[j].dict);
+        while ((de = dictNext(di)) != NULL) {
+            struct key_val_pair_PM *obj;
+
+            if (de->location == LOCATION_PMEM) continue;
+            obj = pmemIndexLookup(j, dictGetKey(de));
+            if (obj != NULL) pmemMaterializeNode(obj);
+        }
+        dictReleaseIterator(di);
+    }
+    serverLog(LL_NOTICE,
+        "PMEM lazy reconstruction: %lu keys left to warm up", left);
+}
+
+/* Returns the entry of a key missing from the dict while warming up. */
+dictEntry *pmemWarmupLookup(redisDb *db, sds key) {
+    struct key_val_pair_PM *obj;
+
+    if (!server.pmem_warming) return NULL;
+    obj = pmemIndexLookup(db->id, key);
+    return obj != NULL ? pmemMaterializeNode(obj) : NULL;
+}
+
+/* Keeps the warm-up cursor valid when a node leaves its place in the pmem
+ * list. Nodes relinked at the head were materialized already. */
+void pmemWarmupForget(PMEMoid oid) {
+    struct redis_pmem_root *root;
+    pmemShard *shard;
+
+    if (!server.pmem_warming) return;
+    shard = pmemShardOfOid(oid);
+    if (shard->warmup_cursor.off != oid.off) return;
+    root = pmemShardRoot(shard);
+    if (root->pe_last.oid.off == oid.off)
+        shard->warmup_cursor = OID_NULL;
+    else
+        shard->warmup_cursor = getPMObjectFromOid(oid)->pmem_list_next.oid;
+}
+
+/* Materializes up to 'count' nodes, the shards one after the other.
+ * Returns 0 once the warm-up is over. */
+static int pmemWarmupStep(long count) {
+    while (server.pmem_warming && count > 0) {
+        pmemShard *shard = server.pm_shards + server.pmem_warmup_shard;
+        struct redis_pmem_root *root = pmemShardRoot(shard);
+
+        while (count > 0 && !OID_IS_NULL(shard->warmup_cursor)) {
+            PMEMoid oid = shard->warmup_cursor;
+            struct key_val_pair_PM *obj = getPMObjectFromOid(oid);
+
+            if (!pmemNodeBound(obj)) pmemMaterializeNode(obj);
+            shard->warmup_cursor = root->pe_last.oid.off == oid.off ?
+                OID_NULL : obj->pmem_list_next.oid;
+            count--;
+        }
+        if (!OID_IS_NULL(shard->warmup_cursor)) break;
+        if (++server.pmem_warmup_shard < server.pm_num_shards) continue;
+
+        server.pmem_warming = 0;
+        for (int j = 0; j < server.dbnum; j++)
+            server.db[j].pmem_cold_keys = 0;
+        serverLog(LL_NOTICE,
+            "PMEM warm-up done: %lu keys materialized in %.3f seconds",
+            server.pmem_warmup_keys,
+            (float)(ustime()-server.pmem_warmup_start)/1000000);
+    }
+    return server.pmem_warming;
+}
+
+/* Completes the warm-up before an operation needing the whole keyspace in
+ * the dict (KEYS, SCAN, FLUSH*, SAVE, AOF rewrite...). */
+void pmemWarmupFinish(void) {
+    while (pmemWarmupStep(LONG_MAX));
+}
+
+/* Called by databasesCron(): warms up for 1 millisecond, like the
+ * incremental rehashing. */
+void pmemWarmupCron(void) {
+    long long start = ustime();
+
+    while (pmemWarmupStep(100)) {
+        if (ustime() - start > 1000) break;
+    }
+}
+
+/* Returns 1 if 'size' bytes can be allocated in the pool of the selected
+ * shard: the allocation is reserved then cancelled, the persistent heap is
+ * left untouched. A single block is reserved, so the answer errs on the safe
+ * side. */
+int pmemPoolHasRoom(size_t size) {
+    struct pobj_action act;
+    PMEMoid oid;
+
+    oid = pmemobj_reserve(server.pm_pool, &act, size, PM_TYPE_SDS);
+    if (OID_IS_NULL(oid)) return 0;
+    pmemobj_cancel(server.pm_pool, &act, 1);
+    return 1;
+}
+
+/* pmem-group-commit: the PMEM writes of all the commands processed from the
+ * input buffer of a client share an outer transaction, the transactions of
+ * the commands being nested in it, so a batch pays a single commit. Replies
+ * are only written to the sockets in beforeSleep(), after the commit.
+ *
+ * The outer transaction has no jmp_buf: an abort of a nested transaction
+ * would roll back the whole batch, while the dict references its records.
+ * So a write command only joins the group when the pool has room for it
+ * (pmemGroupPrepare()): otherwise the group is committed first, and the
+ * command runs in its own transactions, an abort failing the command only.
+ * Running out of pool being the one abort a command can hit, an abort of
+ * the group is a bug, and the server exits. */
+void pmemGroupBegin(void) {
+    if (!server.pmem_group_commit || server.pmem_group_open) return;
+    if (pmemobj_tx_stage() != TX_STAGE_NONE) return;
+    if (pmemobj_tx_begin(server.pm_pool, NULL, TX_PARAM_NONE) != 0) {
+        serverLog(LL_WARNING, "PMEM group commit not started: %s",
+                strerror(errno));
+        return;
+    }
+    server.pmem_group_open = 1;
+}
+
+/* Called before a write command runs in a group, 'size' being the pool
+ * memory its writes may allocate. The group is committed, and stays closed
+ * for the rest of the batch, if the pool may lack the room. The shards the
+ * command switches to are checked the same (pmemShardSelect()). */
+void pmemGroupPrepare(size_t size) {
+    if (!server.pmem_group_open) return;
+    server.pmem_group_need = size + PMEM_GROUP_HEADROOM;
+    if (!pmemPoolHasRoom(server.pmem_group_need)) pmemGroupCommit();
+}
+
+/* Called after every command of a batch. */
+void pmemGroupCheck(void) {
+    if (server.pmem_group_open && pmemobj_tx_stage() != TX_STAGE_WORK)
+        serverPanic("PMEM group commit aborted, the pool was rolled back");
+}
+
+void pmemGroupCommit(void) {
+    uint64_t start;
+
+    if (!server.pmem_group_open) return;
+    pmemGroupCheck();
+    server.pmem_group_open = 0;
+    start = pmemTxLatencyClock();
+    pmemobj_tx_commit();
+    if (pmemobj_tx_end() != 0)
+        serverPanic("PMEM group commit failed, the pool was rolled back");
+    pmemTxLatencyRecord(start);
+}
+
+/* Batches the PMEM writes of a cron job, like the active expiry, in a
+ * single transaction: the transactions of the job are nested in it. Returns
+ * 0 when a transaction is open already (group commit), on error, or when
+ * the pool lacks the room of the undo logs of the batch, the writes being
+ * committed one by one then. Like for a group commit, the writes of a
+ * batch can't run out of pool, and an abort is a bug. */
+int pmemBatchBegin(void) {
+    if (pmemobj_tx_stage() != TX_STAGE_NONE) return 0;
+    if (!pmemPoolHasRoom(PMEM_GROUP_HEADROOM)) return 0;
+    if (pmemobj_tx_begin(server.pm_pool, NULL, TX_PARAM_NONE) != 0) {
+        serverLog(LL_WARNING, "PMEM batch not started: %s", strerror(errno));
+        return 0;
+    }
+    server.pmem_batch_open = 1;
+    return 1;
+}
+
+/* Commits the batch if pmemBatchBegin() returned 'opened'. */
+void pmemBatchCommit(int opened) {
+    uint64_t start;
+
+    if (!opened || !server.pmem_batch_open) return;
+    server.pmem_batch_open = 0;
+    if (pmemobj_tx_stage() != TX_STAGE_WORK)
+        serverPanic("PMEM batch aborted, the pool was rolled back");
+    start = pmemTxLatencyClock();
+    pmemobj_tx_commit();
+    if (pmemobj_tx_end() != 0)
+        serverPanic("PMEM batch failed, the pool was rolled back");
+    pmemTxLatencyRecord(start);
+}
+
+/* Rebuilds the DRAM dict from the whole persistent list of every shard. */
+static void pmemReconstructEager(void) {
+    TOID(struct key_val_pair_PM) pmem_toid;
+    struct key_val_pair_PM *pmem_obj;
+    pmemLruStamp *stamps = NULL;
+    size_t num_stamps = 0;
+    pmemReconstructJob job;
+    pmemReconstructWorker *workers;
+    unsigned long max_nodes, *db_nodes;
+    int num_workers = server.pmem_reconstruct_threads;
+    long long start = ustime();
+
+    /* Collect the nodes: the lists can only be walked sequentially. The
+     * nodes of all the shards are then reconstructed together. */
+    max_nodes = 1;
+    for (int i = 0; i < server.pm_num_shards; i++)
+        max_nodes += pmemShardRoot(server.pm_shards + i)->num_dict_entries;
+    job.nodes = zmalloc(sizeof(pmemReconstructNode) * max_nodes);
+    job.num_nodes = 0;
+    db_nodes = zcalloc(sizeof(unsigned long) * server.dbnum);
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        TOID(struct redis_pmem_root) root = server.pm_shards[i].rootoid;
+
+        for (pmem_toid = D_RO_LATENCY(root)->pe_first;
+            !TOID_IS_NULL(pmem_toid);
+            pmem_toid = D_RO_LATENCY(pmem_toid)->pmem_list_next)
+        {
+            pmem_obj = getPMObjectFromOid(pmem_toid.oid);
+            if (job.num_nodes == max_nodes) {
+                max_nodes *= 2;
+                job.nodes = zrealloc(job.nodes,
+                        sizeof(pmemReconstructNode) * max_nodes);
+            }
+            job.nodes[job.num_nodes].obj = pmem_obj;
+            job.nodes[job.num_nodes].dbid =
+                pmem_obj->dbid < (uint32_t)server.dbnum ? pmem_obj->dbid : 0;
+            db_nodes[job.nodes[job.num_nodes].dbid]++;
+            job.num_nodes++;
+            if (pmem_obj->lru_stamp > server.pmem_lru_clock)
+                server.pmem_lru_clock = pmem_obj->lru_stamp;
+            if (TOID_EQUALS(pmem_toid, D_RO_LATENCY(root)->pe_last)) break;
+        }
+    }
+    if (job.num_nodes == 0) {
+        zfree(job.nodes);
+        zfree(db_nodes);
+        return;
+    }
+
+    /* Size every table for its final number of keys up front: workers link
+     * into ht[0] directly, so no rehashing may happen meanwhile. */
+    for (int j = 0; j < server.dbnum; j++) {
+        dict *d = server.db[j].dict;
+
+        if (db_nodes[j] == 0) continue;
+        dictExpand(d, dictSize(d) + db_nodes[j]);
+        while (dictIsRehashing(d)) dictRehash(d, 100);
+    }
+
+    if (num_workers > (int)job.num_nodes) num_workers = job.num_nodes;
+    job.num_workers = num_workers;
+    workers = zcalloc(sizeof(pmemReconstructWorker) * num_workers);
+    job.workers = workers;
+    for (int i = 0; i < num_workers; ++i) {
+        workers[i].job = &job;
+        workers[i].id = i;
+        workers[i].linked = zcalloc(sizeof(unsigned long) * server.dbnum);
+        workers[i].parts = zmalloc(sizeof(unsigned long *) * num_workers);
+        workers[i].part_len = zcalloc(sizeof(unsigned long) * num_workers);
+    }
+    pmemReconstructRun(workers, num_workers, pmemReconstructWorkerMain);
+    pmemReconstructRun(workers, num_workers, pmemReconstructLinkerMain);
+
+    for (int i = 0; i < num_workers; ++i) {
+        server.used_pmem_memory += workers[i].used_pmem_memory;
+        for (int j = 0; j < server.dbnum; j++)
+            dictAccountReconstructedPM(server.db[j].dict, workers[i].linked[j]);
+        for (int j = 0; j < num_workers; j++)
+            zfree(workers[i].parts[j]);
+        zfree(workers[i].parts);
+        zfree(workers[i].part_len);
+        zfree(workers[i].linked);
+    }
+    zfree(workers);
+    zfree(db_nodes);
+
+    /* Keys already in the dict (loaded from the AOF or duplicated in the
+     * list) take the sequential path. The persistent list may only record
+     * membership (pmem-volatile-lru, allkeys-clock): rebuild the DRAM order
+     * from the write stamps, oldest first so the most recently written entry
+     * ends up at the head. */
+    stamps = zmalloc(sizeof(pmemLruStamp) * job.num_nodes);
+    for (unsigned long i = 0; i < job.num_nodes; ++i) {
+        pmemReconstructNode *node = job.nodes + i;
+
+        if (node->de == NULL) {
+            redisDb *db = &server.db[node->dbid];
+            dictEntry *de = dictFind(db->dict, node->key);
+
+            /* A PMEM duplicate is older than the node linked first. */
+            if (de != NULL && de->location == LOCATION_DRAM) {
+                pmemDropDramCopy(db, node->key);
+                node->de = dictAddReconstructedPM(db->dict, node->key,
+                        node->val);
+            }
+            if (node->de == NULL) {
+                zfree(node->val);
+                continue;
+            }
+            node->obj->de = node->de;
+            node->obj->de_gen = server.pmem_boot_gen;
+        }
+        pmemLoadExpire(&server.db[node->dbid], node->de, node->obj);
+        stamps[num_stamps].stamp = node->obj->lru_stamp;
+        stamps[num_stamps].de = node->de;
+        num_stamps++;
+    }
+    if (num_stamps) {
+        qsort(stamps, num_stamps, sizeof(pmemLruStamp), pmemLruStampCompare);
+        for (size_t i = 0; i < num_stamps; ++i)
+            pmemLruAdd(stamps[i].de);
+    }
+    zfree(stamps);
+
+    serverLog(LL_NOTICE,
+        "PMEM reconstruction: %lu keys with %d threads in %.3f seconds (%.0f keys/s)",
+        job.num_nodes, num_workers, (float)(ustime()-start)/1000000,
+        (double)job.num_nodes * 1000000 / (ustime() - start + 1));
+    zfree(job.nodes);
+}
+
+/* Reconstructs the shards, each of its writes in a transaction of its own
+ * pool. */
 int pmemReconstructTODIS(void) {
     serverLog(LL_TODIS, "   ");
     serverLog(LL_TODIS, "TODIS, pmemReconstructTODIS START");
-    TOID(struct redis_pmem_root) root;
     TOID(struct key_val_pair_PM) pmem_toid;
     struct key_val_pair_PM *pmem_obj;
-    dict *d;
-    void *key;
-    void *val;
-    void *pmem_base_addr;
-
-    root = server.pm_rootoid;
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    d = server.db[0].dict;
-    dictExpand(d, D_RO_LATENCY(root)->num_dict_entries + D_RO_LATENCY(root)->num_victim_entries);
-
-    /* Reconstruct victim lists */
-    for (pmem_toid = D_RO_LATENCY(root)->victim_first;
-        TOID_IS_NULL(pmem_toid) == 0;
-        pmem_toid = D_RO_LATENCY(pmem_toid)->pmem_list_next
-    ) {
-        pmem_obj = (key_val_pair_PM *)(pmem_toid.oid.off + (uint64_t)pmem_base_addr);
-        key = (void *)(pmem_obj->key_oid.off + (uint64_t)pmem_base_addr);
-        val = (void *)(pmem_obj->val_oid.off + (uint64_t)pmem_base_addr);
+    struct redis_pmem_root *root_obj;
+    uint64_t boot_gen = 0;
+    int lazy = server.pmem_lazy_reconstruct;
+    int retval = C_OK;
+    sds key, val;
+
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        root_obj = pmemShardRoot(server.pm_shards + i);
+
+        /* Reconstruct victim lists */
+        for (pmem_toid = root_obj->victim_first;
+            TOID_IS_NULL(pmem_toid) == 0;
+            pmem_toid = D_RO_LATENCY(pmem_toid)->pmem_list_next
+        ) {
+            pmem_obj = getPMObjectFromOid(pmem_toid.oid);
+            key = getKeyFromPMObject(pmem_obj);
+
+            robj *key_obj = createStringObject(sdsdup(key), sdslen(key));
+            robj *val_obj;
+            if (pmem_obj->flags & PMEM_NODE_INT_VAL) {
+                val_obj = createStringObjectFromLongLong(
+                        (long)pmem_obj->val_oid.off);
+            } else {
+                val = getValFromPMObject(pmem_obj);
+                val_obj = createStringObject(sdsdup(val), sdslen(val));
+            }
+            dbReconstructVictim(&server.db[pmem_obj->dbid < (uint32_t)server.dbnum ?
+                        pmem_obj->dbid : 0], key_obj, val_obj,
+                    pmem_obj->expire ? pmem_obj->expire : -1);
+        }
 
-        robj *key_obj = createStringObject(sdsdup(key), sdslen(key));
-        robj *val_obj = createStringObject(sdsdup(val), sdslen(val));
-        dbReconstructVictim(&server.db[0], key_obj, val_obj);
+        if (root_obj->boot_gen > boot_gen) boot_gen = root_obj->boot_gen;
+        if (OID_IS_NULL(root_obj->index) ||
+            root_obj->index_buckets != pmemIndexBuckets() ||
+            root_obj->index_dbs != (uint64_t)server.dbnum) lazy = 0;
     }
     /* Flush append only file (hard call)
      * This will remove all victim list... */
     forceFlushAppendOnlyFileTODIS();
 
-    /* Reconstruct pmem lists */
-    pmem_toid = D_RO_LATENCY(root)->pe_first;
-    if (TOID_IS_NULL(pmem_toid)) {
-        serverLog(LL_TODIS, "TODIS, pmemReconstruct END");
-        return C_OK;
+    /* A new boot generation, the same in every shard, invalidates at once
+     * every dictEntry pointer left in the nodes by the previous run. */
+    server.pmem_boot_gen = boot_gen + 1;
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShardSelect(server.pm_shards + i);
+        TX_BEGIN(server.pm_pool) {
+            root_obj = getPmemRootObject();
+            TX_ADD_FIELD_DIRECT_LATENCY(root_obj, boot_gen);
+            root_obj->boot_gen = server.pmem_boot_gen;
+            if (!lazy) pmemIndexRebuild();
+        } TX_ONABORT {
+            retval = C_ERR;
+        } TX_END
     }
-    while (1) {
-        pmem_obj = (key_val_pair_PM *)(
-                pmem_toid.oid.off + (uint64_t)pmem_base_addr
-        );
-		key = (void *)(pmem_obj->key_oid.off + (uint64_t)pmem_base_addr);
-		val = (void *)(pmem_obj->val_oid.off + (uint64_t)pmem_base_addr);
-
-        server.used_pmem_memory += sdsAllocSizePM(key);
-        server.used_pmem_memory += sdsAllocSizePM(val);
-        server.used_pmem_memory += sizeof(struct key_val_pair_PM);
-        serverLog(
-                LL_TODIS,
-                "TODIS, pmemReconstruct reconstructed used_pmem_memory: %zu",
-                server.used_pmem_memory);
+    pmemShardSelect(server.pm_shards);
+    if (retval == C_ERR) return C_ERR;
 
-        dictAddReconstructedPM(d, key, val);
-        if (TOID_EQUALS(pmem_toid, D_RO_LATENCY(root)->pe_last)) {
-            break;
-        }
-        pmem_toid = D_RO_LATENCY(pmem_toid)->pmem_list_next;
-    }
+    if (lazy)
+        pmemWarmupStart();
+    else
+        pmemReconstructEager();
 
     serverLog(LL_TODIS, "TODIS, pmemReconstruct END");
     return C_OK;
@@ -141,16 +1011,26 @@ void pmemKVpairSet(void *key, void *val)
     val_oid.pool_uuid_lo = server.pool_uuid_lo;
     val_oid.off = (uint64_t)val - (uint64_t)server.pm_pool->addr;
 
+#ifdef TODIS
+    /* val_oid, lru_stamp and flags are adjacent: snapshot them in one undo
+     * entry. The new value has its own allocation. */
+    TX_ADD_RANGE_DIRECT_LATENCY(&pmem_obj->val_oid,
+            offsetof(struct key_val_pair_PM, dbid) -
+            offsetof(struct key_val_pair_PM, val_oid));
+    pmem_obj->val_oid = val_oid;
+    pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+    pmem_obj->flags &= ~PMEM_NODE_VAL_INLINE;
+#else
     TX_ADD_FIELD_DIRECT_LATENCY(pmem_obj, val_oid);
     pmem_obj->val_oid = val_oid;
+#endif
     return;
 }
 
 #ifdef TODIS
 void pmemKVpairSetRearrangeList(void *key, void *val)
 {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, pmemKVpairSetRearrangeList START");
+    pmemTrace(PMEM_TRACE_LIST_REARRANGE, key, 0);
     PMEMoid *pmem_oid_ptr;
 
     pmem_oid_ptr = sdsPMEMoidBackReference((sds)key);
@@ -162,14 +1042,12 @@ void pmemKVpairSetRearrangeList(void *key, void *val)
     pmemLinkToPmemListByOid(*pmem_oid_ptr);
     long long end_queue_update_add_list_time = ustime();
     server.queue_update_add_list_time += end_queue_update_add_list_time - start_queue_update_add_list_time;
-    serverLog(LL_TODIS, "TODIS, pmemKVpairSetRearrangeList END");
     return;
 }
 
 void pmemKVpairSetRearrangeList_legacy(void *key, void *val)
 {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, pmemKVpairSetRearrangeList START");
+    pmemTrace(PMEM_TRACE_LIST_REARRANGE, key, 0);
     PMEMoid *pmem_oid_ptr;
 
     pmem_oid_ptr = sdsPMEMoidBackReference((sds)key);
@@ -182,7 +1060,6 @@ void pmemKVpairSetRearrangeList_legacy(void *key, void *val)
     long long end_queue_update_add_list_time = ustime();
     server.queue_update_add_list_time += end_queue_update_add_list_time - start_queue_update_add_list_time;
     *pmem_oid_ptr = new_pmem_oid;
-    serverLog(LL_TODIS, "TODIS, pmemKVpairSetRearrangeList END");
     return;
 }
 #endif
@@ -201,11 +1078,10 @@ PMEMoid pmemLinkToPmemListByOid(PMEMoid oid) {
         head->pmem_list_prev = pmem_toid;
     }
 
+    TX_ADD_DIRECT_LATENCY(root);
     if (TOID_IS_NULL(root->pe_last)) {
         root->pe_last = pmem_toid;
     }
-
-    TX_ADD_DIRECT_LATENCY(root);
     root->pe_first = pmem_toid;
     root->num_dict_entries++;
 
@@ -215,8 +1091,6 @@ PMEMoid pmemLinkToPmemListByOid(PMEMoid oid) {
 PMEMoid
 pmemAddToPmemList(void *key, void *val)
 {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, pmemAddToPmemList START");
     PMEMoid key_oid;
     PMEMoid val_oid;
     PMEMoid pmem_oid;
@@ -237,10 +1111,8 @@ pmemAddToPmemList(void *key, void *val)
     pmem_toid.oid = pmem_oid;
 
 #ifdef TODIS
-        serverLog(
-                LL_TODIS,
-                "TODIS, pmemAddToPmemList key_val_pair_PM size: %zu",
-                sizeof(struct key_val_pair_PM));
+    pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+    pmemTrace(PMEM_TRACE_LIST_ADD, pmem_oid.off, sizeof(struct key_val_pair_PM));
     server.used_pmem_memory += sizeof(struct key_val_pair_PM);
 #endif
 
@@ -261,18 +1133,423 @@ pmemAddToPmemList(void *key, void *val)
     root->pe_first = pmem_toid;
     root->num_dict_entries++;
 
+    return pmem_oid;
+}
+
 #ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, pmemAddFromPmemList END");
-#endif
+/* Same as pmemAddToPmemList(), but the node, a copy of the key and a copy
+ * of the value take a single allocation (see PMEM_NODE_EMBED_KEY). The
+ * key of the record is getKeyFromOid() of the returned node. 'val' is a
+ * string object, an INT encoded one is stored in the node. */
+size_t pmemRecordSize(sds key, robj *val) {
+    size_t size = sizeof(struct key_val_pair_PM) + sizeof(PMEMoid) +
+        sdsEmbedSize(sdslen(key));
+
+    if (val->encoding != OBJ_ENCODING_INT)
+        size += sdsEmbedSize(sdslen(val->ptr));
+    return size;
+}
+
+/* Fills the key, the value and their oids in a zeroed record of 'size'
+ * bytes (see pmemRecordSize()), the spare bytes of the allocation going to
+ * the value. Returns the usable size of the allocation. */
+static size_t pmemFillRecord(struct key_val_pair_PM *pmem_obj, PMEMoid pmem_oid,
+        size_t size, sds key, robj *val) {
+    size_t keylen = sdslen(key);
+    size_t usable = pmemobj_alloc_usable_size(pmem_oid);
+    char *key_buf = (char *)(pmem_obj + 1) + sizeof(PMEMoid);
+    sds key_PM, val_PM;
+
+    *(PMEMoid *)(pmem_obj + 1) = pmem_oid;
+    key_PM = sdsnewlenAt(key_buf, key, keylen, keylen);
+    pmem_obj->key_oid.pool_uuid_lo = server.pool_uuid_lo;
+    pmem_obj->key_oid.off = pmem_oid.off + ((char *)key_PM - (char *)pmem_obj);
+    if (val->encoding == OBJ_ENCODING_INT) {
+        pmem_obj->val_oid.pool_uuid_lo = 0;
+        pmem_obj->val_oid.off = (uint64_t)(long)val->ptr;
+        pmem_obj->flags = PMEM_NODE_EMBED_KEY | PMEM_NODE_INT_VAL;
+    } else {
+        size_t vallen = sdslen(val->ptr);
+
+        val_PM = sdsnewlenAt(key_buf + sdsEmbedSize(keylen), val->ptr, vallen,
+                vallen + usable - size);
+        pmem_obj->val_oid.pool_uuid_lo = server.pool_uuid_lo;
+        pmem_obj->val_oid.off =
+            pmem_oid.off + ((char *)val_PM - (char *)pmem_obj);
+        pmem_obj->flags = PMEM_NODE_EMBED_KEY | PMEM_NODE_EMBED_VAL;
+    }
+    pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+    return usable;
+}
+
+PMEMoid pmemAddRecordToPmemList(sds key, robj *val) {
+    size_t size = pmemRecordSize(key, val);
+    PMEMoid pmem_oid;
+
+    pmem_oid = pmemobj_tx_zalloc_latency(size, pm_type_key_val_pair_PM);
+    server.used_pmem_memory += pmemFillRecord(
+            pmemobj_direct_latency(pmem_oid), pmem_oid, size, key, val);
+
+    return pmemLinkToPmemListByOid(pmem_oid);
+}
+
+/* pmem-write-path publish: writes without a transaction, using the action
+ * API of libpmemobj. A new record, or a new value, is reserved and filled
+ * while unreachable, then persisted. A single pmemobj_publish() makes it
+ * reachable: the pointer stores are applied from a redo log, atomically,
+ * together with the reservation and the deferred frees. */
+#define PMEM_PUBLISH_MAX_ACTIONS 24
+
+typedef struct pmemPublishBatch {
+    struct pobj_action actv[PMEM_PUBLISH_MAX_ACTIONS];
+    int count;
+} pmemPublishBatch;
+
+static void pmemPublishSet(pmemPublishBatch *b, uint64_t *ptr, uint64_t value) {
+    serverAssert(b->count < PMEM_PUBLISH_MAX_ACTIONS);
+    pmemobj_set_value(server.pm_pool, &b->actv[b->count++], ptr, value);
+}
+
+/* A NULL oid may have a zero pool uuid: set it too when it differs. */
+static void pmemPublishSetOid(pmemPublishBatch *b, PMEMoid *dst, PMEMoid oid) {
+    if (dst->pool_uuid_lo != oid.pool_uuid_lo)
+        pmemPublishSet(b, &dst->pool_uuid_lo, oid.pool_uuid_lo);
+    pmemPublishSet(b, &dst->off, oid.off);
+}
+
+static int pmemPublishCommit(pmemPublishBatch *b) {
+    if (pmemobj_publish_latency(server.pm_pool, b->actv, b->count) == 0)
+        return C_OK;
+    serverLog(LL_WARNING, "PMEM publish failed: %s", strerror(errno));
+    pmemobj_cancel(server.pm_pool, b->actv, b->count);
+    return C_ERR;
+}
+
+/* Publishes a record of the key and the value at the head of the pmem list,
+ * with the absolute expire time 'expire' in ms (-1 for none). Returns
+ * OID_NULL, nothing being changed, when the write needs the transactional
+ * path: the hash index of a new pool does not exist yet. */
+PMEMoid pmemPublishRecord(int dbid, sds key, robj *val, long long expire) {
+    struct redis_pmem_root *root = getPmemRootObject();
+    TOID(struct key_val_pair_PM) *table = pmemIndexTable(root);
+    size_t size = pmemRecordSize(key, val), usable;
+    struct key_val_pair_PM *pmem_obj;
+    pmemPublishBatch b;
+    PMEMoid pmem_oid;
+
+    if (server.pmem_lazy_reconstruct && table == NULL) return OID_NULL;
+
+    b.count = 1;
+    pmem_oid = pmemobj_reserve_latency(server.pm_pool, &b.actv[0], size,
+            pm_type_key_val_pair_PM);
+    if (OID_IS_NULL(pmem_oid)) return OID_NULL;
+    pmem_obj = pmemobj_direct_latency(pmem_oid);
+    memset(pmem_obj, 0, sizeof(*pmem_obj));
+    usable = pmemFillRecord(pmem_obj, pmem_oid, size, key, val);
+    pmem_obj->dbid = dbid;
+    pmem_obj->expire = expire < 0 ? 0 : expire;
+    pmem_obj->pmem_list_next = root->pe_first;
+    if (table != NULL) {
+        uint64_t bucket = pmemIndexBucket(dbid, key, root->index_buckets);
+        uint64_t *count = pmemIndexDbCount(root, dbid);
+
+        pmem_obj->index_next = table[bucket];
+        pmemPublishSetOid(&b, &table[bucket].oid, pmem_oid);
+        if (count) pmemPublishSet(&b, count, *count + 1);
+    }
+    pmemobj_persist_latency(server.pm_pool, pmem_obj, size);
+
+    if (!TOID_IS_NULL(root->pe_first))
+        pmemPublishSetOid(&b,
+                &D_RW_LATENCY(root->pe_first)->pmem_list_prev.oid, pmem_oid);
+    if (TOID_IS_NULL(root->pe_last))
+        pmemPublishSetOid(&b, &root->pe_last.oid, pmem_oid);
+    pmemPublishSetOid(&b, &root->pe_first.oid, pmem_oid);
+    pmemPublishSet(&b, &root->num_dict_entries, root->num_dict_entries + 1);
+    if (pmemPublishCommit(&b) == C_ERR) return OID_NULL;
+
+    server.used_pmem_memory += usable;
     return pmem_oid;
 }
 
+/* Moves a node to the head of the pmem list, for strict allkeys-lru. */
+static void pmemPublishMoveToHead(pmemPublishBatch *b, PMEMoid oid) {
+    struct redis_pmem_root *root = getPmemRootObject();
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    TOID(struct key_val_pair_PM) prev = pmem_obj->pmem_list_prev;
+    TOID(struct key_val_pair_PM) next = pmem_obj->pmem_list_next;
+
+    if (root->pe_first.oid.off == oid.off) return;
+    pmemWarmupForget(oid);
+    /* Not the head: there is a previous node. */
+    pmemPublishSetOid(b, &D_RW_LATENCY(prev)->pmem_list_next.oid, next.oid);
+    if (root->pe_last.oid.off == oid.off)
+        pmemPublishSetOid(b, &root->pe_last.oid, prev.oid);
+    else
+        pmemPublishSetOid(b, &D_RW_LATENCY(next)->pmem_list_prev.oid, prev.oid);
+    pmemPublishSetOid(b, &pmem_obj->pmem_list_next.oid, root->pe_first.oid);
+    pmemPublishSetOid(b, &pmem_obj->pmem_list_prev.oid, OID_NULL);
+    pmemPublishSetOid(b, &D_RW_LATENCY(root->pe_first)->pmem_list_prev.oid, oid);
+    pmemPublishSetOid(b, &root->pe_first.oid, oid);
+}
+
+/* Publishes a new value for the PMEM key of 'de', in its own allocation
+ * like dictReplaceTODIS(), and frees the previous one in the same publish,
+ * along with the absolute expire time 'expire' in ms (-1 for none).
+ * The value object of the entry is updated in place, so the write needs
+ * the transactional path when it is shared (C_ERR, nothing changed). */
+int pmemPublishValue(dictEntry *de, sds val, long long expire) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    robj *o = dictGetVal(de);
+    size_t size = sizeof(PMEMoid) + sdsEmbedSize(sdslen(val));
+    size_t old_size = 0;
+    uint16_t flags = pmem_obj->flags & ~PMEM_NODE_VAL_INLINE;
+    uint64_t flags_word;
+    pmemPublishBatch b;
+    PMEMoid val_oid, old_oid;
+    sds val_PM, old = o->ptr;
+    char *buf;
+
+    if (o->refcount != 1) return C_ERR;
+    pmemCacheDrop(de);
+
+    b.count = 1;
+    val_oid = pmemobj_reserve_latency(server.pm_pool, &b.actv[0], size,
+            PM_TYPE_SDS);
+    if (OID_IS_NULL(val_oid)) return C_ERR;
+    buf = pmemobj_direct_latency(val_oid);
+    memset(buf, 0, sizeof(PMEMoid));
+    val_PM = sdsnewlenAt(buf + sizeof(PMEMoid), val, sdslen(val), sdslen(val));
+    pmemobj_persist_latency(server.pm_pool, buf, size);
+
+    if (pmem_obj->val_oid.pool_uuid_lo != val_oid.pool_uuid_lo)
+        pmemPublishSet(&b, &pmem_obj->val_oid.pool_uuid_lo,
+                val_oid.pool_uuid_lo);
+    pmemPublishSet(&b, &pmem_obj->val_oid.off, val_oid.off + (val_PM - buf));
+    pmemPublishSet(&b, &pmem_obj->lru_stamp, ++server.pmem_lru_clock);
+    /* flags starts the 8 bytes word it shares with dbid and de_gen. */
+    memcpy(&flags_word, &pmem_obj->flags, sizeof(flags_word));
+    memcpy(&flags_word, &flags, sizeof(flags));
+    pmemPublishSet(&b, (uint64_t *)&pmem_obj->flags, flags_word);
+    if (!pmemExpireEquals(de, expire))
+        pmemPublishSet(&b, (uint64_t *)&pmem_obj->expire,
+                expire < 0 ? 0 : expire);
+    if (!(pmem_obj->flags & PMEM_NODE_VAL_INLINE)) {
+        old_size = sdsAllocSizePM(old);
+        old_oid.pool_uuid_lo = server.pool_uuid_lo;
+        old_oid.off = (uint64_t)sdsPMEMoidBackReference(old) -
+            (uint64_t)server.pm_pool->addr;
+        pmemobj_defer_free(server.pm_pool, old_oid, &b.actv[b.count++]);
+    }
+    if (!pmemVolatileOrder()) pmemPublishMoveToHead(&b, oid);
+    if (pmemPublishCommit(&b) == C_ERR) return C_ERR;
+
+    server.used_pmem_memory += size - old_size;
+    o->ptr = val_PM;
+    o->encoding = OBJ_ENCODING_RAW;
+    pmemLruTouch(de);
+    return C_OK;
+}
+
+/* Sets the PMEM string 's' to the 'len' bytes of 'buf' and persists it.
+ * The allocation of 's' can hold them. */
+static void pmemValueWrite(sds s, const char *buf, size_t len) {
+    char *start = sdsAllocPtr(s);
+
+    memcpy(s, buf, len);
+    s[len] = '\0';
+    sdssetlen(s, len);
+    pmemobj_persist_latency(server.pm_pool, start, s - start + len + 1);
+}
+
+/* Completes an in-place overwrite interrupted after its redo record was
+ * committed. Called when an existing pool is opened. */
+void pmemValueRedoRecover(void) {
+    struct pmem_value_redo *redo = &getPmemRootObject()->value_redo;
+
+    if (redo->target == 0) return;
+    pmemValueWrite((char *)server.pm_pool->addr + redo->target, redo->buf,
+            redo->len);
+    redo->target = 0;
+    pmemobj_persist(server.pm_pool, &redo->target, sizeof(redo->target));
+    serverLog(LL_NOTICE, "PMEM value overwrite completed from the redo record");
+}
+
+/* Commits 'len' bytes of 'val' to the redo record of the root as the next
+ * value of the PMEM sds 's'. Once it returns, the overwrite is completed by
+ * pmemValueRedoRecover() if the process dies before it is applied. */
+static void pmemValueRedoLog(sds s, sds val, size_t len) {
+    struct pmem_value_redo *redo = &getPmemRootObject()->value_redo;
+
+    memcpy(redo->buf, val, len);
+    redo->len = len;
+    pmemobj_persist_latency(server.pm_pool, &redo->len,
+            sizeof(redo->len) + len);
+    redo->target = (uint64_t)s - (uint64_t)server.pm_pool->addr;
+    pmemobj_persist_latency(server.pm_pool, &redo->target,
+            sizeof(redo->target));
+}
+
+/* Overwrites the PMEM value of 'de' in place when the new value fits the
+ * sds allocation of the current one, without allocating or freeing. In a
+ * transaction the range joins its undo log, otherwise the bytes are first
+ * committed to the redo record of the root. Returns C_ERR, nothing being
+ * changed, if the value does not fit, is shared, or outside of a
+ * transaction is larger than the redo record. The allocation, thus the
+ * accounted memory, stays the same. */
+int pmemOverwriteValue(dictEntry *de, sds val) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    robj *o = dictGetVal(de);
+    sds s = o->ptr;
+    size_t len = sdslen(val);
+
+    if (o->refcount != 1 || o->encoding == OBJ_ENCODING_INT ||
+        len > sdsalloc(s)) return C_ERR;
+    /* The allocation size of a type 5 header is its length. */
+    if ((s[-1] & SDS_TYPE_MASK) == SDS_TYPE_5 && len != sdslen(s))
+        return C_ERR;
+    pmemCacheDrop(de);
+
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        char *start = sdsAllocPtr(s);
+
+        TX_ADD_RANGE_DIRECT_LATENCY(start, s - start + len + 1);
+        TX_ADD_FIELD_DIRECT_LATENCY(pmem_obj, lru_stamp);
+        pmemValueWrite(s, val, len);
+        pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+        if (!pmemVolatileOrder())
+            pmemKVpairSetRearrangeList(dictGetKey(de), s);
+    } else {
+        struct pmem_value_redo *redo = &getPmemRootObject()->value_redo;
+        pmemPublishBatch b;
+
+        if (len > PMEM_VALUE_REDO_MAX) return C_ERR;
+        pmemValueRedoLog(s, val, len);
+        pmemValueWrite(s, val, len);
+        redo->target = 0;
+        pmemobj_persist_latency(server.pm_pool, &redo->target,
+                sizeof(redo->target));
+
+        pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+        pmemobj_persist_latency(server.pm_pool, &pmem_obj->lru_stamp,
+                sizeof(pmem_obj->lru_stamp));
+        if (!pmemVolatileOrder()) {
+            b.count = 0;
+            pmemPublishMoveToHead(&b, oid);
+            if (b.count > 0) pmemPublishCommit(&b);
+        }
+    }
+    pmemLruTouch(de);
+    return C_OK;
+}
+
+/* DEBUG PMEM-REDO-CRASH: commits the redo record of an in-place overwrite of
+ * the PMEM value of 'de' by 'val' without applying it, as a crash right
+ * after the commit would. Returns C_ERR if the value can't be overwritten in
+ * place outside of a transaction. */
+int pmemDebugValueRedo(dictEntry *de, sds val) {
+    robj *o = dictGetVal(de);
+    sds s = o->ptr;
+    size_t len = sdslen(val);
+
+    if (de->location != LOCATION_PMEM || o->refcount != 1 ||
+        o->encoding == OBJ_ENCODING_INT || len > sdsalloc(s) ||
+        len > PMEM_VALUE_REDO_MAX) return C_ERR;
+    if ((s[-1] & SDS_TYPE_MASK) == SDS_TYPE_5 && len != sdslen(s))
+        return C_ERR;
+    pmemValueRedoLog(s, val, len);
+    return C_OK;
+}
+
+/* Sets the value of the PMEM key of 'de' to an integer stored in its node.
+ * Replacing an integer is a single atomic 8 bytes store, made outside of a
+ * transaction too. Replacing a string needs a transaction, the string
+ * being freed. Returns C_ERR, nothing being changed, outside of a
+ * transaction for a string, or if the value object is shared. */
+int pmemSetIntValue(dictEntry *de, long value) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    robj *o = dictGetVal(de);
+    int in_tx = pmemobj_tx_stage() == TX_STAGE_WORK;
+
+    if (o->refcount != 1) return C_ERR;
+    pmemCacheDrop(de);
+
+    if (pmem_obj->flags & PMEM_NODE_INT_VAL) {
+        if (in_tx) {
+            TX_ADD_RANGE_DIRECT_LATENCY(&pmem_obj->val_oid.off,
+                    offsetof(struct key_val_pair_PM, flags) -
+                    offsetof(struct key_val_pair_PM, val_oid.off));
+        } else {
+            emulateWriteLatency();
+        }
+        pmem_obj->val_oid.off = (uint64_t)value;
+        pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+        pmemobj_persist(server.pm_pool, &pmem_obj->val_oid.off,
+                sizeof(pmem_obj->val_oid.off) + sizeof(pmem_obj->lru_stamp));
+    } else {
+        if (!in_tx) return C_ERR;
+        if (!(pmem_obj->flags & PMEM_NODE_EMBED_VAL)) sdsfreePM(o->ptr);
+        TX_ADD_RANGE_DIRECT_LATENCY(&pmem_obj->val_oid,
+                offsetof(struct key_val_pair_PM, dbid) -
+                offsetof(struct key_val_pair_PM, val_oid));
+        pmem_obj->val_oid.pool_uuid_lo = 0;
+        pmem_obj->val_oid.off = (uint64_t)value;
+        pmem_obj->lru_stamp = ++server.pmem_lru_clock;
+        pmem_obj->flags = (pmem_obj->flags & ~PMEM_NODE_EMBED_VAL) |
+            PMEM_NODE_INT_VAL;
+    }
+
+    if (!pmemVolatileOrder()) {
+        if (in_tx) {
+            pmemKVpairSetRearrangeList(dictGetKey(de), NULL);
+        } else {
+            pmemPublishBatch b;
+
+            b.count = 0;
+            pmemPublishMoveToHead(&b, oid);
+            if (b.count > 0) pmemPublishCommit(&b);
+        }
+    }
+    o->ptr = (void *)value;
+    o->encoding = OBJ_ENCODING_INT;
+    pmemLruTouch(de);
+    return C_OK;
+}
+
+/* Returns 1 if the node of the PMEM key of 'de' holds the absolute expire
+ * time 'when' in ms (-1 for none), as pmemSetExpire() stores it. */
+int pmemExpireEquals(dictEntry *de, long long when) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+
+    return getPMObjectFromOid(oid)->expire == (when < 0 ? 0 : when);
+}
+
+/* Stores the absolute expire time 'when' in ms of the PMEM key of 'de' in
+ * its node, -1 removing it, so that the expire survives a restart. The
+ * time is a single atomic 8 bytes store, made outside of a transaction
+ * too. */
+void pmemSetExpire(dictEntry *de, long long when) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    int64_t expire = when < 0 ? 0 : when;
+
+    if (pmem_obj->expire == expire) return;
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        TX_ADD_FIELD_DIRECT_LATENCY(pmem_obj, expire);
+        pmem_obj->expire = expire;
+    } else {
+        pmem_obj->expire = expire;
+        pmemobj_persist_latency(pmemShardOfOid(oid)->pool, &pmem_obj->expire,
+                sizeof(pmem_obj->expire));
+    }
+}
+#endif
+
 void
 pmemRemoveFromPmemList(PMEMoid oid) {
-#ifdef TODIS
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, pmemRemoveFromPmemList START");
-#endif
     TOID(struct key_val_pair_PM) pmem_toid;
     struct redis_pmem_root *root;
 
@@ -281,11 +1558,10 @@ pmemRemoveFromPmemList(PMEMoid oid) {
     pmem_toid.oid = oid;
 
 #ifdef TODIS
-        serverLog(
-                LL_TODIS,
-                "TODIS, pmemRemoveFromPmemList key_val_pair_PM size: %zu",
-                sizeof(struct key_val_pair_PM));
-        server.used_pmem_memory -= sizeof(struct key_val_pair_PM);
+    pmemWarmupForget(oid);
+    pmemTrace(PMEM_TRACE_LIST_REMOVE, oid.off,
+              pmemNodeAllocSize(getPMObjectFromOid(oid)));
+        server.used_pmem_memory -= pmemNodeAllocSize(getPMObjectFromOid(oid));
 #endif
 
     if (TOID_EQUALS(root->pe_first, pmem_toid) &&
@@ -334,19 +1610,18 @@ pmemRemoveFromPmemList(PMEMoid oid) {
     }
     TX_ADD_FIELD_DIRECT_LATENCY(root,num_dict_entries);
     root->num_dict_entries--;
-    serverLog(LL_TODIS, "TODIS, pmemRemovFromPmemList END");
 }
 #endif
 
 #ifdef TODIS
 PMEMoid pmemUnlinkFromPmemList(PMEMoid oid) {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, pmemUnlinkFromPmemList START");
+    pmemTrace(PMEM_TRACE_LIST_UNLINK, oid.off, 0);
     TOID(struct key_val_pair_PM) pmem_toid;
     struct redis_pmem_root *root;
 
     root = pmemobj_direct_latency(server.pm_rootoid.oid);
     pmem_toid.oid = oid;
+    pmemWarmupForget(oid);
 
     if (TOID_EQUALS(root->pe_first, pmem_toid) &&
         TOID_EQUALS(root->pe_last, pmem_toid)) {
@@ -390,7 +1665,6 @@ PMEMoid pmemUnlinkFromPmemList(PMEMoid oid) {
     }
     TX_ADD_FIELD_DIRECT_LATENCY(root,num_dict_entries);
     root->num_dict_entries--;
-    serverLog(LL_TODIS, "TODIS, pmemUnlinkFromPmemList END");
     return oid;
 
 }
@@ -446,13 +1720,12 @@ void knuthUniqNumberGenerator(int *numbers, const int size, const int range) {
  * - victim_oids: Victim PMEMoids that filled by this function.
  */
 int getBestEvictionKeysPMEMoid(PMEMoid *victim_oids) {
-    TOID(struct redis_pmem_root) root;
     struct redis_pmem_root *root_obj;
-    uint64_t num_pmem_entries;
+    uint64_t num_pmem_entries = 0;
 
-    root = server.pm_rootoid;
-    root_obj = pmemobj_direct_latency(root.oid);
-    num_pmem_entries = root_obj->num_dict_entries;
+    for (int i = 0; i < server.pm_num_shards; i++)
+        num_pmem_entries += pmemShardRoot(server.pm_shards + i)->num_dict_entries;
+    root_obj = getPmemRootObject();
 
     // TODO(totoro): Improves overflow case that performance not bind to this
     // useless loop...
@@ -464,15 +1737,33 @@ int getBestEvictionKeysPMEMoid(PMEMoid *victim_oids) {
 
     /* allkeys-random policy */
     if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
-        // TODO(totoro): Implements bulk victim algorithm for RANDOM policy...
-        /*int *indexes = zmalloc(sizeof(int) * server.pmem_victim_count);*/
-        /*knuthUniqNumberGenerator(*/
-                /*indexes, server.pmem_victim_count, num_pmem_entries);*/
-        /*for (size_t i = 0; i < server.pmem_victim_count; ++i) {*/
-            /*victim_oids[i] = getPmemKvOid(indexes[i]);*/
-        /*}*/
-        /*zfree(indexes);*/
-        return C_ERR;
+        return pmemRandomSelectVictims(victim_oids, server.pmem_victim_count);
+    }
+
+    /* allkeys-sampled-lru policy */
+    else if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_SAMPLED_LRU) {
+        return pmemSampledLruSelectVictims(
+                victim_oids, server.pmem_victim_count);
+    }
+
+    /* allkeys-clock policy */
+    else if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_CLOCK) {
+        return pmemClockSelectVictims(victim_oids, server.pmem_victim_count);
+    }
+
+    /* allkeys-lru policy, recency kept in DRAM */
+    else if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_LRU &&
+             pmemVolatileOrder()) {
+        pmemEntryMeta *meta = server.pmem_lru_tail;
+        for (int i = server.pmem_victim_count - 1; i >= 0; --i) {
+            if (meta == NULL) {
+                victim_oids[i] = OID_NULL;
+                continue;
+            }
+            victim_oids[i] = *sdsPMEMoidBackReference(dictGetKey(meta->de));
+            meta = meta->lru_prev;
+        }
+        return C_OK;
     }
 
     /* allkeys-lru policy */
@@ -497,16 +1788,16 @@ int getBestEvictionKeysPMEMoid(PMEMoid *victim_oids) {
 PMEMoid getBestEvictionKeyPMEMoid(void) {
     TOID(struct redis_pmem_root) root;
     struct redis_pmem_root *root_obj;
-    uint64_t num_pmem_entries;
 
     root = server.pm_rootoid;
     root_obj = pmemobj_direct_latency(root.oid);
-    num_pmem_entries = root_obj->num_dict_entries;
 
     /* allkeys-random policy */
     if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
-        uint64_t index = random() % num_pmem_entries;
-        return getPmemKvOid(index);
+        if (server.pmem_entries_len == 0) return OID_NULL;
+        dictEntry *de =
+            server.pmem_entries[random() % server.pmem_entries_len]->de;
+        return *sdsPMEMoidBackReference(dictGetKey(de));
     }
 
     /* allkeys-lru policy */
@@ -547,34 +1838,31 @@ sds getBestEvictionKeyPM(void) {
 
 #ifdef TODIS
 struct key_val_pair_PM *getPMObjectFromOid(PMEMoid oid) {
-    void *pmem_base_addr = (void *)server.pm_pool->addr;
-
     if (OID_IS_NULL(oid))
         return NULL;
 
-    return (key_val_pair_PM *)(oid.off + (uint64_t) pmem_base_addr);
+    return (key_val_pair_PM *)(oid.off +
+            (uint64_t)pmemShardOfOid(oid)->pool->addr);
 }
 #endif
 
 #ifdef TODIS
 sds getKeyFromPMObject(struct key_val_pair_PM *obj) {
-    void *pmem_base_addr = (void *)server.pm_pool->addr;
-
     if (obj == NULL)
         return NULL;
 
-    return (sds)(obj->key_oid.off + (uint64_t) pmem_base_addr);
+    return (sds)(obj->key_oid.off +
+            (uint64_t)pmemShardOfOid(obj->key_oid)->pool->addr);
 }
 #endif
 
 #ifdef TODIS
 sds getValFromPMObject(struct key_val_pair_PM *obj) {
-    void *pmem_base_addr = (void *)server.pm_pool->addr;
-
     if (obj == NULL)
         return NULL;
 
-    return (sds)(obj->val_oid.off + (uint64_t) pmem_base_addr);
+    return (sds)(obj->val_oid.off +
+            (uint64_t)pmemShardOfOid(obj->val_oid)->pool->addr);
 }
 #endif
 
@@ -594,68 +1882,43 @@ sds getValFromOid(PMEMoid oid) {
 
 #ifdef TODIS
 int evictPmemNodesToVictimList(PMEMoid *victim_oids) {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, evictPmemNodesToVictimList START");
     struct redis_pmem_root *root = pmemobj_direct_latency(server.pm_rootoid.oid);
 
     TOID(struct key_val_pair_PM) start_toid = TOID_NULL(struct key_val_pair_PM);
 
-    if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
-        // TODO(totoro): Implements eviction node algorithm for RAMDOM policy...
-        /*for (size_t i = 0; i < server.pmem_victim_count; ++i) {*/
-            /*TOID(struct key_val_pair_PM) victim_toid;*/
-            /*TOID(struct key_val_pair_PM) victim_legacy_root_toid;*/
-
-            /*PMEMoid victim_oid = victim_oids[i];*/
-            /*if (OID_IS_NULL(victim_oid)) {*/
-                /*serverLog(LL_TODIS, "TODIS_ERROR, victim_oid is null");*/
-                /*return C_ERR;*/
-            /*}*/
-
-            /*[> Adds victim node to Victim list. <]*/
-            /*root = pmemobj_direct_latency(server.pm_rootoid.oid);*/
-            /*victim_obj = (struct key_val_pair_PM *)pmemobj_direct_latency(victim_oid);*/
-            /*victim_toid.oid = victim_oid;*/
-
-            /*victim_legacy_root_toid = start;*/
-            /*if (!TOID_IS_NULL(start)) {*/
-                /*struct key_val_pair_PM *head = D_RW_LATENCY(start);*/
-                /*TX_ADD_FIELD_DIRECT_LATENCY(head, pmem_list_prev);*/
-                /*head->pmem_list_prev = victim_toid;*/
-            /*}*/
-
-            /*start = victim_toid;*/
-            /*if (TOID_IS_NULL(end)) {*/
-                /*end = victim_toid;*/
-                /*struct key_val_pair_PM *rear = D_RW_LATENCY(end);*/
-                /*TX_ADD_FIELD_DIRECT_LATENCY(rear, pmem_list_next);*/
-                /*rear->pmem_list_next = root->victim_start;*/
-
-                /*struct key_val_pair_PM *old_victim_head = D_RW_LATENCY(root->victim_start);*/
-                /*TX_ADD_FIELD_DIRECT_LATENCY(old_victim_head, pmem_list_prev);*/
-                /*old_victim_head->pmem_list_prev = end;*/
-            /*}*/
-
-            /*TX_ADD_DIRECT_LATENCY(root);*/
-            /*root->victim_start = start;*/
-
-            /*serverLog(LL_TODIS, "TODIS, victim key: %s", getKeyFromOid(victim_oid));*/
-
-            /*[> Unlinks victim node from PMEM list. <]*/
-            /*pmemUnlinkFromPmemList(victim_oid);*/
-            /*victim_obj->pmem_list_next = victim_legacy_root_toid;*/
-        /*}*/
-        serverLog(LL_TODIS, "TODIS, evictPmemNodesToVictimList RANDOM END");
-        return C_ERR;
+    if (pmemVolatileOrder()) {
+        /* Victims picked from the DRAM list are scattered over the pmem
+         * list, so they are moved one by one instead of as a tail segment.
+         * Only the victims of the current shard are moved. */
+        int evicted = 0;
+        for (size_t i = 0; i < server.pmem_victim_count; ++i) {
+            if (OID_IS_NULL(victim_oids[i]) ||
+                pmemShardOfOid(victim_oids[i]) != server.pm_shard)
+                continue;
+            if (evictPmemNodeToVictimList(victim_oids[i]) == C_OK)
+                evicted++;
+        }
+        return evicted ? C_OK : C_ERR;
     }
     else if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_LRU) {
         PMEMoid start_oid = OID_NULL;
+        /* The victims are the tail segment: a warm-up cursor inside it has
+         * nothing left behind. */
+        for (size_t i = 0; i < server.pmem_victim_count; ++i) {
+            if (OID_IS_NULL(victim_oids[i]))
+                continue;
+            pmemIndexRemove(victim_oids[i]);
+            if (server.pm_shard->warmup_cursor.off == victim_oids[i].off)
+                server.pm_shard->warmup_cursor = OID_NULL;
+        }
         for (size_t i = 0; i < server.pmem_victim_count; ++i) {
             if (!OID_IS_NULL(victim_oids[i])) {
                 start_oid = victim_oids[i];
                 TX_ADD_DIRECT_LATENCY(root);
                 root->num_dict_entries -= server.pmem_victim_count - i;
                 root->num_victim_entries += server.pmem_victim_count - i;
+                pmemTrace(PMEM_TRACE_VICTIMS_LINK, start_oid.off,
+                          server.pmem_victim_count - i);
                 break;
             }
         }
@@ -665,14 +1928,34 @@ int evictPmemNodesToVictimList(PMEMoid *victim_oids) {
         }
         start_toid.oid = start_oid;
 
+        /* The tail segment goes in front of the victims waiting for their
+         * reclamation. */
+        struct key_val_pair_PM *start_obj = D_RW_LATENCY(start_toid);
+        TOID(struct key_val_pair_PM) new_last = start_obj->pmem_list_prev;
+        if (!TOID_IS_NULL(root->victim_first)) {
+            struct key_val_pair_PM *last = D_RW_LATENCY(root->pe_last);
+            struct key_val_pair_PM *head = D_RW_LATENCY(root->victim_first);
+
+            TX_ADD_FIELD_DIRECT_LATENCY(last, pmem_list_next);
+            last->pmem_list_next = root->victim_first;
+            TX_ADD_FIELD_DIRECT_LATENCY(head, pmem_list_prev);
+            head->pmem_list_prev = root->pe_last;
+        }
+        TX_ADD_FIELD_DIRECT_LATENCY(start_obj, pmem_list_prev);
+        start_obj->pmem_list_prev = TOID_NULL(struct key_val_pair_PM);
+        if (!TOID_IS_NULL(new_last)) {
+            struct key_val_pair_PM *new_last_obj = D_RW_LATENCY(new_last);
+
+            TX_ADD_FIELD_DIRECT_LATENCY(new_last_obj, pmem_list_next);
+            new_last_obj->pmem_list_next = TOID_NULL(struct key_val_pair_PM);
+        }
+
         TX_ADD_FIELD_DIRECT_LATENCY(root, pe_last);
         root->victim_first = start_toid;
-        root->pe_last = D_RO_LATENCY(start_toid)->pmem_list_prev;
+        root->pe_last = new_last;
         if (TOID_IS_NULL(root->pe_last)) {
             root->pe_first = TOID_NULL(struct key_val_pair_PM);
         }
-
-        serverLog(LL_TODIS, "TODIS, evictPmemNodesToVictimList LRU END");
         return C_OK;
     }
 
@@ -682,8 +1965,6 @@ int evictPmemNodesToVictimList(PMEMoid *victim_oids) {
 
 #ifdef TODIS
 int evictPmemNodeToVictimList(PMEMoid victim_oid) {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, evictPmemNodeToVictimList START");
     TOID(struct key_val_pair_PM) victim_toid;
     TOID(struct key_val_pair_PM) victim_legacy_root_toid;
     struct redis_pmem_root *root;
@@ -695,6 +1976,7 @@ int evictPmemNodeToVictimList(PMEMoid victim_oid) {
     }
 
     /* Adds victim node to Victim list. */
+    pmemIndexRemove(victim_oid);
     root = pmemobj_direct_latency(server.pm_rootoid.oid);
     victim_obj = (struct key_val_pair_PM *)pmemobj_direct_latency(victim_oid);
     victim_toid.oid = victim_oid;
@@ -710,61 +1992,150 @@ int evictPmemNodeToVictimList(PMEMoid victim_oid) {
     root->victim_first = victim_toid;
     root->num_victim_entries++;
 
-    serverLog(LL_TODIS, "TODIS, victim key: %s", getKeyFromOid(victim_oid));
+    pmemTrace(PMEM_TRACE_VICTIM_LINK, victim_oid.off, 0);
 
     /* Unlinks victim node from PMEM list. */
     pmemUnlinkFromPmemList(victim_oid);
+    TX_ADD_DIRECT_LATENCY(victim_obj);
     victim_obj->pmem_list_next = victim_legacy_root_toid;
-    serverLog(LL_TODIS, "TODIS, evictPmemNodeToVictimList END");
+    victim_obj->pmem_list_prev = TOID_NULL(struct key_val_pair_PM);
     return C_OK;
 }
 #endif
 
 #ifdef TODIS
 void freeVictim(PMEMoid oid) {
-    sds key = getKeyFromOid(oid);
-    sds val = getValFromOid(oid);
-    sdsfreeVictim(key);
-    sdsfreeVictim(val);
+    struct key_val_pair_PM *obj = getPMObjectFromOid(oid);
+
+    if (!(obj->flags & PMEM_NODE_EMBED_KEY))
+        sdsfreeVictim(getKeyFromPMObject(obj));
+    if (!(obj->flags & PMEM_NODE_VAL_INLINE))
+        sdsfreeVictim(getValFromPMObject(obj));
 }
 #endif
 
 #ifdef TODIS
-void freeVictimList(PMEMoid start_oid) {
-    serverLog(LL_TODIS, "   ");
-    serverLog(LL_TODIS, "TODIS, freeVictimList START");
-    struct redis_pmem_root *root;
+/* Victim reclamation.
+ *
+ * A victim node stays in the victim list of its shard until the AOF record
+ * of its key is fsynced: the restart replays the victim lists. When an AOF
+ * fsync is scheduled, the victims demoted since the previous one are sealed
+ * as a segment of the list, tagged with a new epoch. The bio thread only
+ * publishes the last epoch fsynced; the main thread then frees the segments
+ * of the epochs fsynced, oldest first, so that no PMEM transaction runs
+ * outside of the main thread. New victims are pushed at the head of the
+ * list, the oldest segment is always its tail. */
+
+/* Seals the victims demoted since the previous seal. Returns the epoch to
+ * pass to pmemReclaimDurable() once the AOF is fsynced. */
+uint64_t pmemReclaimSeal(void) {
+    uint64_t epoch = ++server.pmem_reclaim_epoch;
+
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShard *shard = server.pm_shards + i;
+        PMEMoid first = pmemShardRoot(shard)->victim_first.oid;
+        pmemReclaimSegment *seg;
+
+        if (OID_IS_NULL(first) || OID_EQUALS(first, shard->victim_sealed))
+            continue;
+        seg = zmalloc(sizeof(*seg));
+        seg->shard = shard;
+        seg->first = first;
+        seg->epoch = epoch;
+        seg->sealed = mstime();
+        listAddNodeTail(server.pmem_reclaim_queue, seg);
+        shard->victim_sealed = first;
+    }
+    return epoch;
+}
 
-    root = pmemobj_direct_latency(server.pm_rootoid.oid);
-    TOID(struct key_val_pair_PM) victim_first_toid;
-    victim_first_toid.oid = start_oid;
+/* Returns true if a shard has victims demoted since the last seal. */
+int pmemReclaimUnsealed(void) {
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShard *shard = server.pm_shards + i;
+        PMEMoid first = pmemShardRoot(shard)->victim_first.oid;
 
-    if (OID_IS_NULL(start_oid)) {
-        serverLog(LL_TODIS, "TODIS, freeVictimList END");
-        return;
+        if (!OID_IS_NULL(first) && !OID_EQUALS(first, shard->victim_sealed))
+            return 1;
     }
+    return 0;
+}
 
-    /* Unlinks victim list from another victim list. */
-    if (TOID_EQUALS(root->victim_first, victim_first_toid)) {
-        TX_ADD_DIRECT_LATENCY(root);
-        root->victim_first = TOID_NULL(struct key_val_pair_PM);
-    }
-    TOID(struct key_val_pair_PM) prev_toid = D_RO_LATENCY(victim_first_toid)->pmem_list_prev;
-    if (!TOID_IS_NULL(prev_toid)) {
-        struct key_val_pair_PM *prev_obj = pmemobj_direct_latency(prev_toid.oid);
-        prev_obj->pmem_list_next = TOID_NULL(struct key_val_pair_PM);
-    }
+/* Called, from any thread, once the AOF records of the victims sealed up to
+ * 'epoch' are fsynced. */
+void pmemReclaimDurable(uint64_t epoch) {
+    uint64_t durable = __atomic_load_n(&server.pmem_reclaim_durable,
+            __ATOMIC_RELAXED);
 
-    /* Free all Victim list. */
-    while (!TOID_IS_NULL(victim_first_toid)) {
-        TOID(struct key_val_pair_PM) next_toid = D_RO_LATENCY(victim_first_toid)->pmem_list_next;
-        freeVictim(victim_first_toid.oid);
-        TX_FREE_LATENCY(victim_first_toid);
-        TX_ADD_DIRECT_LATENCY(root);
-        root->num_victim_entries--;
-        victim_first_toid = next_toid;
+    while (durable < epoch &&
+           !__atomic_compare_exchange_n(&server.pmem_reclaim_durable,
+               &durable, epoch, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees the oldest segment of a victim list in one transaction: the list is
+ * cut once before the segment and the root updated once. */
+static void pmemReclaimSegmentFree(pmemReclaimSegment *seg) {
+    struct redis_pmem_root *root = pmemShardRoot(seg->shard);
+    struct key_val_pair_PM *first = getPMObjectFromOid(seg->first);
+    TOID(struct key_val_pair_PM) toid;
+    uint64_t freed = 0;
+    int aborted = 0;
+
+    pmemShardSelect(seg->shard);
+    TX_BEGIN(server.pm_pool) {
+        if (TOID_IS_NULL(first->pmem_list_prev)) {
+            TX_ADD_FIELD_DIRECT_LATENCY(root, victim_first);
+            root->victim_first = TOID_NULL(struct key_val_pair_PM);
+        } else {
+            struct key_val_pair_PM *prev = D_RW_LATENCY(first->pmem_list_prev);
+
+            TX_ADD_FIELD_DIRECT_LATENCY(prev, pmem_list_next);
+            prev->pmem_list_next = TOID_NULL(struct key_val_pair_PM);
+        }
+        /* The freed nodes need no undo log. */
+        for (toid.oid = seg->first; !TOID_IS_NULL(toid); freed++) {
+            TOID(struct key_val_pair_PM) next = D_RO_LATENCY(toid)->pmem_list_next;
+
+            freeVictim(toid.oid);
+            TX_FREE_LATENCY(toid);
+            toid = next;
+        }
+        TX_ADD_FIELD_DIRECT_LATENCY(root, num_victim_entries);
+        root->num_victim_entries -= freed;
+    } TX_ONABORT {
+        serverLog(LL_TODIS, "TODIS_ERROR, free victim list failed: (%s)", __func__);
+        aborted = 1;
+    } TX_END
+    if (aborted) return;
+    if (OID_EQUALS(seg->shard->victim_sealed, seg->first))
+        seg->shard->victim_sealed = OID_NULL;
+    server.stat_pmem_reclaimed_victims += freed;
+    pmemTrace(PMEM_TRACE_VICTIMS_FREE, seg->first.off, freed);
+}
+
+/* Frees the segments of the epochs fsynced. Called by the server cron, and
+ * after a synchronous fsync. */
+void pmemReclaimCron(void) {
+    uint64_t durable = __atomic_load_n(&server.pmem_reclaim_durable,
+            __ATOMIC_ACQUIRE);
+    listNode *ln;
+
+    while ((ln = listFirst(server.pmem_reclaim_queue)) != NULL) {
+        pmemReclaimSegment *seg = listNodeValue(ln);
+
+        if (seg->epoch > durable) break;
+        pmemReclaimSegmentFree(seg);
+        zfree(seg);
+        listDelNode(server.pmem_reclaim_queue, ln);
     }
-    serverLog(LL_TODIS, "TODIS, freeVictimList END");
+}
+
+/* Age in milliseconds of the oldest segment not freed yet. */
+long long pmemReclaimLag(void) {
+    listNode *ln = listFirst(server.pmem_reclaim_queue);
+
+    if (ln == NULL) return 0;
+    return mstime() - ((pmemReclaimSegment *)listNodeValue(ln))->sealed;
 }
 #endif
 
@@ -776,21 +2147,7 @@ size_t pmem_used_memory(void) {
 
 #ifdef TODIS
 size_t sizeOfPmemNode(PMEMoid oid) {
-    size_t total_size = 0;
-
-    sds key = getKeyFromOid(oid);
-    sds val = getValFromOid(oid);
-    size_t node_size = sizeof(struct key_val_pair_PM);
-
-    total_size += sdsAllocSizePM(key);
-    total_size += sdsAllocSizePM(val);
-    total_size += node_size;
-    serverLog(
-            LL_TODIS,
-            "TODIS, sizeOfPmemNode: %zu",
-            total_size);
-
-    return total_size;
+    return pmemNodeSize(getPMObjectFromOid(oid));
 }
 #endif
 
@@ -799,3 +2156,267 @@ struct redis_pmem_root *getPmemRootObject(void) {
     return pmemobj_direct_latency(server.pm_rootoid.oid);
 }
 #endif
+
+#ifdef TODIS
+/* Every PMEM entry is tracked on the DRAM side in two ways:
+ *
+ * - a list threaded through its pmemEntryMeta. allkeys-lru keeps it in
+ *   recency order (head is the most recently used), allkeys-clock uses it
+ *   as the ring swept by the clock hand.
+ * - a dense array (server.pmem_entries) of the metadata, with the slot
+ *   stored in the entry, so allkeys-random and allkeys-sampled-lru pick
+ *   entries in O(1).
+ *
+ * Only strict allkeys-lru without pmem-volatile-lru, on a single shard and
+ * without pmem-tiering (which demotes keys out of order), keeps the
+ * persistent list in order; for every other policy it only records
+ * membership, so hits never write to the pool. */
+int pmemVolatileOrder(void) {
+    return server.pmem_volatile_lru || server.pm_num_shards > 1 ||
+        server.pmem_tiering != PMEM_TIERING_NONE ||
+        server.max_pmem_memory_policy != MAXMEMORY_ALLKEYS_LRU;
+}
+
+/* Records the db and the DRAM dictEntry of a PMEM key in its node, so that
+ * eviction resolves a victim node without hashing the key. Must be called
+ * in the transaction that allocated the node. The db is found through the
+ * privdata of the db dict. */
+void pmemBindEntry(dict *d, dictEntry *de) {
+    PMEMoid oid = *sdsPMEMoidBackReference(dictGetKey(de));
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    redisDb *db = d->privdata;
+
+    pmem_obj->dbid = db != NULL ? db->id : 0;
+    pmemAttachEntry(de);
+    pmemIndexInsert(oid);
+}
+
+/* Sets the volatile dictEntry pointer of a node, for the nodes published
+ * with their db and index link already (pmemPublishRecord()). */
+void pmemAttachEntry(dictEntry *de) {
+    struct key_val_pair_PM *pmem_obj =
+        getPMObjectFromOid(*sdsPMEMoidBackReference(dictGetKey(de)));
+
+    pmem_obj->de = de;
+    pmem_obj->de_gen = server.pmem_boot_gen;
+}
+
+/* Returns the dictEntry of a victim node and sets '*db' to its db. Nodes
+ * left unbound fall back to a lookup in their db, or are materialized while
+ * the lazy reconstruction warms up. */
+dictEntry *pmemGetVictimEntry(PMEMoid oid, struct redisDb **db) {
+    struct key_val_pair_PM *pmem_obj = getPMObjectFromOid(oid);
+    dictEntry *de = pmemNodeBound(pmem_obj) ? pmem_obj->de : NULL;
+
+    if (pmem_obj->dbid >= (uint32_t)server.dbnum) return NULL;
+    *db = &server.db[pmem_obj->dbid];
+    if (de == NULL && server.pmem_warming)
+        de = pmemMaterializeNode(pmem_obj);
+    if (de == NULL)
+        de = dictFind((*db)->dict, getKeyFromPMObject(pmem_obj));
+    if (de == NULL || de->location != LOCATION_PMEM ||
+        sdsPMEMoidBackReference(dictGetKey(de))->off != oid.off)
+        return NULL;
+    return de;
+}
+
+static pmemEntryMeta *pmemEntriesAdd(dictEntry *de) {
+    pmemEntryMeta *meta = zcalloc(sizeof(*meta));
+
+    if (server.pmem_entries_len == server.pmem_entries_size) {
+        server.pmem_entries_size = server.pmem_entries_size ?
+            server.pmem_entries_size * 2 : 1024;
+        server.pmem_entries = zrealloc(server.pmem_entries,
+                sizeof(pmemEntryMeta *) * server.pmem_entries_size);
+    }
+    meta->de = de;
+    server.pmem_entries[server.pmem_entries_len++] = meta;
+    de->pmem_slot = server.pmem_entries_len;
+    return meta;
+}
+
+static void pmemEntriesSwap(unsigned long a, unsigned long b) {
+    pmemEntryMeta *tmp = server.pmem_entries[a];
+
+    server.pmem_entries[a] = server.pmem_entries[b];
+    server.pmem_entries[a]->de->pmem_slot = a + 1;
+    server.pmem_entries[b] = tmp;
+    tmp->de->pmem_slot = b + 1;
+}
+
+/* Swap-remove: the last entry takes the slot of the removed one. */
+static void pmemEntriesRemove(dictEntry *de) {
+    pmemEntriesSwap(de->pmem_slot - 1, server.pmem_entries_len - 1);
+    server.pmem_entries_len--;
+    de->pmem_slot = 0;
+}
+
+/* Moves the entry at 'slot' past the end of the '*avail' sampling window,
+ * so the same entry is not picked twice while a batch is selected. */
+static dictEntry *pmemEntriesReserve(unsigned long slot, unsigned long *avail) {
+    (*avail)--;
+    pmemEntriesSwap(slot, *avail);
+    return server.pmem_entries[*avail]->de;
+}
+
+static void pmemLruLinkHead(pmemEntryMeta *meta) {
+    meta->lru_prev = NULL;
+    meta->lru_next = server.pmem_lru_head;
+    if (server.pmem_lru_head != NULL)
+        server.pmem_lru_head->lru_prev = meta;
+    else
+        server.pmem_lru_tail = meta;
+    server.pmem_lru_head = meta;
+}
+
+static void pmemLruDetach(pmemEntryMeta *meta) {
+    if (server.pmem_clock_hand == meta)
+        server.pmem_clock_hand = meta->lru_next;
+    if (meta->lru_prev != NULL)
+        meta->lru_prev->lru_next = meta->lru_next;
+    else
+        server.pmem_lru_head = meta->lru_next;
+    if (meta->lru_next != NULL)
+        meta->lru_next->lru_prev = meta->lru_prev;
+    else
+        server.pmem_lru_tail = meta->lru_prev;
+    meta->lru_prev = meta->lru_next = NULL;
+}
+
+/* Tracks a new PMEM entry. The clock hand sweeps from head to tail, so under
+ * allkeys-clock a new entry goes right behind the hand and is examined last
+ * in the next revolution. */
+void pmemLruAdd(dictEntry *de) {
+    pmemEntryMeta *hand = server.pmem_clock_hand;
+    pmemEntryMeta *meta = pmemEntriesAdd(de);
+
+    if (server.max_pmem_memory_policy != MAXMEMORY_ALLKEYS_CLOCK ||
+        hand == NULL || hand->lru_prev == NULL)
+    {
+        pmemLruLinkHead(meta);
+        return;
+    }
+
+    meta->lru_prev = hand->lru_prev;
+    meta->lru_next = hand;
+    hand->lru_prev->lru_next = meta;
+    hand->lru_prev = meta;
+}
+
+/* Stops tracking a PMEM entry, that is deleted or demoted: its cached value
+ * goes with its metadata. */
+void pmemLruUnlink(dictEntry *de) {
+    pmemEntryMeta *meta = pmemEntryGetMeta(de);
+
+    if (meta == NULL) return;
+    pmemCacheDrop(de);
+    pmemEntriesRemove(de);
+    pmemLruDetach(meta);
+    zfree(meta);
+}
+
+void pmemLruTouch(dictEntry *de) {
+    pmemEntryMeta *meta = pmemEntryGetMeta(de);
+
+    if (meta == NULL) return;
+    if (server.max_pmem_memory_policy == MAXMEMORY_ALLKEYS_CLOCK) {
+        meta->referenced = 1;
+        return;
+    }
+    if (server.pmem_lru_head == meta) return;
+
+    pmemLruDetach(meta);
+    pmemLruLinkHead(meta);
+}
+
+/* Advances the clock hand until 'count' unreferenced entries are found,
+ * clearing the reference bit of every referenced entry it passes. Victims
+ * fill 'victim_oids' from the end, unused slots are set to OID_NULL. */
+int pmemClockSelectVictims(PMEMoid *victim_oids, size_t count) {
+    unsigned long budget = server.pmem_entries_len * 2;
+    size_t found = 0;
+    pmemEntryMeta *meta = server.pmem_clock_hand;
+    pmemEntryMeta *first = NULL;
+
+    while (found < count && budget--) {
+        if (meta == NULL) meta = server.pmem_lru_head;
+        /* Back at the first victim: every other entry was examined. */
+        if (meta == NULL || meta == first) break;
+        if (meta->referenced) {
+            meta->referenced = 0;
+        } else {
+            victim_oids[count - 1 - found] =
+                *sdsPMEMoidBackReference(dictGetKey(meta->de));
+            if (first == NULL) first = meta;
+            found++;
+        }
+        meta = meta->lru_next;
+    }
+    server.pmem_clock_hand = meta;
+    for (size_t i = found; i < count; ++i)
+        victim_oids[count - 1 - i] = OID_NULL;
+    return found ? C_OK : C_ERR;
+}
+
+/* Picks 'count' distinct random PMEM entries from the dense array. */
+int pmemRandomSelectVictims(PMEMoid *victim_oids, size_t count) {
+    unsigned long avail = server.pmem_entries_len;
+    size_t found = 0;
+
+    while (found < count && avail > 0) {
+        dictEntry *de = pmemEntriesReserve(random() % avail, &avail);
+        victim_oids[count - 1 - found] =
+            *sdsPMEMoidBackReference(dictGetKey(de));
+        found++;
+    }
+    for (size_t i = found; i < count; ++i)
+        victim_oids[count - 1 - i] = OID_NULL;
+    return found ? C_OK : C_ERR;
+}
+
+/* Approximated LRU like freeMemoryIfNeeded(): maxmemory-samples PMEM
+ * entries are sampled into server.pmem_eviction_pool and the entry with the
+ * greatest idle time is taken, 'count' times. */
+int pmemSampledLruSelectVictims(PMEMoid *victim_oids, size_t count) {
+    struct evictionPoolEntry *pool = server.pmem_eviction_pool;
+    unsigned long avail = server.pmem_entries_len;
+    size_t found = 0;
+
+    while (found < count && avail > 0) {
+        dictEntry *de = NULL;
+        int k;
+
+        evictionPoolPopulatePM(pool, avail);
+        /* Go backward from best to worst element to evict. */
+        for (k = MAXMEMORY_EVICTION_POOL_SIZE-1; k >= 0; k--) {
+            if (pool[k].key == NULL) continue;
+            /* The pool keeps the db of the node, as pmemGetVictimEntry()
+             * does, so the key is looked up in its own db only. */
+            if (pool[k].dbid < server.dbnum)
+                de = dictFind(server.db[pool[k].dbid].dict, pool[k].key);
+
+            /* Remove the entry from the pool. */
+            sdsfree(pool[k].key);
+            memmove(pool+k,pool+k+1,
+                sizeof(pool[0])*(MAXMEMORY_EVICTION_POOL_SIZE-k-1));
+            pool[MAXMEMORY_EVICTION_POOL_SIZE-1].key = NULL;
+            pool[MAXMEMORY_EVICTION_POOL_SIZE-1].idle = 0;
+
+            /* Skip keys that are gone, were demoted to DRAM or were already
+             * picked by this batch. */
+            if (de != NULL && de->location == LOCATION_PMEM &&
+                de->pmem_slot && de->pmem_slot <= avail) break;
+            de = NULL;
+        }
+        if (de == NULL) continue;
+
+        pmemEntriesReserve(de->pmem_slot - 1, &avail);
+        victim_oids[count - 1 - found] =
+            *sdsPMEMoidBackReference(dictGetKey(de));
+        found++;
+    }
+    for (size_t i = found; i < count; ++i)
+        victim_oids[count - 1 - i] = OID_NULL;
+    return found ? C_OK : C_ERR;
+}
+#endif
@@ -32,11 +32,62 @@
 
 #include "server.h"
 #include "sds.h"
+#include "dict.h"
 
 #ifdef USE_PMDK
+struct redisDb;
+struct redisObject;
+struct pmemShard;
+
+#ifdef TODIS
+/* A record is a node allocated together with its key and value:
+ *
+ * [key_val_pair_PM][PMEMoid of the node][key sds][value sds][spare]
+ *
+ * The PMEMoid before the key is the usual sds back reference. The value
+ * gets the spare bytes of the allocation class as sds capacity. After an
+ * overwrite the value lives in its own allocation and the embedded one is
+ * left unused.
+ *
+ * An integer value has no sds: it is stored in val_oid.off, and the value
+ * object of its dictEntry has the INT encoding. */
+#define PMEM_NODE_EMBED_KEY (1<<0)  /* Key stored in the node allocation */
+#define PMEM_NODE_EMBED_VAL (1<<1)  /* Value stored in the node allocation */
+#define PMEM_NODE_INT_VAL (1<<2)    /* Integer value in val_oid.off */
+#define PMEM_NODE_VAL_INLINE (PMEM_NODE_EMBED_VAL|PMEM_NODE_INT_VAL)
+
+/* Pool room kept free in a multi key, group or batch transaction, besides
+ * the values written, for the nodes and the undo logs. */
+#define PMEM_GROUP_HEADROOM (64*1024)
+
+/* DRAM side metadata of a PMEM entry, allocated while the entry is tracked
+ * (pmemLruAdd() to pmemLruUnlink()) so that DRAM entries do not pay for it.
+ * The entry keeps its slot in server.pmem_entries, see pmemEntryGetMeta(). */
+typedef struct pmemEntryMeta {
+    dictEntry *de;                  /* PMEM entry */
+    struct pmemEntryMeta *lru_prev; /* Recency links, see pmemLruAdd() */
+    struct pmemEntryMeta *lru_next;
+    unsigned referenced:1;          /* Reference bit of allkeys-clock */
+    unsigned cache_seen:1;          /* Read since last written */
+    unsigned cache_slot:30;         /* Read cache slot plus one, 0 if none */
+} pmemEntryMeta;
+
+#define pmemEntryGetMeta(de) \
+    ((de)->pmem_slot ? server.pmem_entries[(de)->pmem_slot-1] : NULL)
+#endif
+
 typedef struct key_val_pair_PM {
     PMEMoid key_oid;
     PMEMoid val_oid;
+#ifdef TODIS
+    uint64_t lru_stamp; /* Last write order, re-sorts pmem-volatile-lru */
+    uint16_t flags;     /* PMEM_NODE_* */
+    uint16_t dbid;      /* Logical db of the key */
+    uint32_t de_gen;    /* Boot generation 'de' was set in */
+    dictEntry *de;      /* DRAM entry of the key, volatile: see de_gen */
+    int64_t expire;     /* Absolute unix time in ms, 0 for no expire */
+    TOID(struct key_val_pair_PM) index_next; /* Hash index bucket chain */
+#endif
     TOID(struct key_val_pair_PM) pmem_list_next;
     TOID(struct key_val_pair_PM) pmem_list_prev;
 } key_val_pair_PM;
@@ -51,6 +102,10 @@ int pmemReconstructTODIS(void);
 void pmemKVpairSetRearrangeList(void *key, void *val);
 void pmemKVpairSetRearrangeList_legacy(void *key, void *val);
 PMEMoid pmemUnlinkFromPmemList(PMEMoid oid);
+PMEMoid pmemAddRecordToPmemList(sds key, struct redisObject *val);
+size_t pmemRecordSize(sds key, struct redisObject *val);
+int pmemNodeEmbedsKey(PMEMoid oid);
+struct redisObject *pmemCreateValObject(struct key_val_pair_PM *obj);
 int getBestEvictionKeysPMEMoid(PMEMoid *victim_oids);
 PMEMoid getBestEvictionKeyPMEMoid(void);
 sds getBestEvictionKeyPM(void);
@@ -61,10 +116,51 @@ sds getKeyFromOid(PMEMoid oid);
 sds getValFromOid(PMEMoid oid);
 int evictPmemNodesToVictimList(PMEMoid *victim_oids);
 int evictPmemNodeToVictimList(PMEMoid victim_oid);
-void freeVictimList(PMEMoid start_oid);
+uint64_t pmemReclaimSeal(void);
+int pmemReclaimUnsealed(void);
+void pmemReclaimDurable(uint64_t epoch);
+void pmemReclaimCron(void);
+long long pmemReclaimLag(void);
 size_t pmem_used_memory(void);
 size_t sizeOfPmemNode(PMEMoid oid);
 struct redis_pmem_root *getPmemRootObject(void);
+int pmemVolatileOrder(void);
+void pmemBindEntry(dict *d, dictEntry *de);
+void pmemAttachEntry(dictEntry *de);
+PMEMoid pmemPublishRecord(int dbid, sds key, struct redisObject *val,
+        long long expire);
+int pmemPublishValue(dictEntry *de, sds val, long long expire);
+int pmemOverwriteValue(dictEntry *de, sds val);
+int pmemDebugValueRedo(dictEntry *de, sds val);
+int pmemSetIntValue(dictEntry *de, long value);
+int pmemExpireEquals(dictEntry *de, long long when);
+void pmemSetExpire(dictEntry *de, long long when);
+void pmemValueRedoRecover(void);
+dictEntry *pmemGetVictimEntry(PMEMoid oid, struct redisDb **db);
+void pmemLruAdd(dictEntry *de);
+void pmemLruUnlink(dictEntry *de);
+void pmemLruTouch(dictEntry *de);
+int pmemClockSelectVictims(PMEMoid *victim_oids, size_t count);
+int pmemRandomSelectVictims(PMEMoid *victim_oids, size_t count);
+int pmemSampledLruSelectVictims(PMEMoid *victim_oids, size_t count);
+void pmemIndexRemove(PMEMoid oid);
+dictEntry *pmemWarmupLookup(struct redisDb *db, sds key);
+void pmemWarmupForget(PMEMoid oid);
+void pmemWarmupFinish(void);
+void pmemWarmupCron(void);
+int pmemPoolHasRoom(size_t size);
+void pmemGroupBegin(void);
+void pmemGroupPrepare(size_t size);
+void pmemGroupCheck(void);
+void pmemGroupCommit(void);
+int pmemBatchBegin(void);
+void pmemBatchCommit(int opened);
+void pmemShardAttach(struct pmemShard *shard, int created);
+int pmemShardAdd(const char *path, size_t size);
+void pmemShardSelect(struct pmemShard *shard);
+struct pmemShard *pmemShardOfOid(PMEMoid oid);
+struct pmemShard *pmemShardForEntry(dictEntry *de, sds key);
+struct redis_pmem_root *pmemShardRoot(struct pmemShard *shard);
 #endif
 #endif
 
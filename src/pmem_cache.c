@@ -0,0 +1,135 @@
+#ifdef TODIS
+#include "server.h"
+#include "pmem_cache.h"
+#include "pmem_latency.h"
+
+/* Removes a slot, the last slot taking its place. The copy it holds may
+ * still be used by the command that read it, so it is only queued to be
+ * freed in beforeSleep(). */
+static void pmemCacheRemoveSlot(unsigned long i) {
+    pmemCacheSlot *slot = server.pmem_cache_slots+i;
+    unsigned long last = --server.pmem_cache_len;
+
+    slot->meta->cache_slot = 0;
+    slot->meta->cache_seen = 0;
+    server.pmem_cache_used -= slot->size;
+    listAddNodeTail(server.pmem_cache_to_free,slot->val);
+    if (i != last) {
+        *slot = server.pmem_cache_slots[last];
+        slot->meta->cache_slot = i+1;
+    }
+}
+
+/* Evicts slots with CLOCK until 'size' more bytes fit in the cache: the
+ * hand clears the reference bit of the slots read since its last pass, and
+ * evicts the first slot not read. */
+static void pmemCacheMakeRoom(size_t size) {
+    while (server.pmem_cache_len &&
+           server.pmem_cache_used + size > server.pmem_read_cache_size)
+    {
+        pmemCacheSlot *slot;
+
+        if (server.pmem_cache_hand >= server.pmem_cache_len)
+            server.pmem_cache_hand = 0;
+        slot = server.pmem_cache_slots+server.pmem_cache_hand;
+        if (slot->referenced) {
+            slot->referenced = 0;
+            server.pmem_cache_hand++;
+        } else {
+            pmemCacheRemoveSlot(server.pmem_cache_hand);
+            server.stat_pmem_cache_evictions++;
+        }
+    }
+}
+
+/* Copies the value of a PMEM entry into the cache. Returns the copy, or
+ * NULL if the value is too large for the cache. */
+static robj *pmemCacheAdd(pmemEntryMeta *meta, robj *val) {
+    size_t len = sdslen(val->ptr);
+    size_t size = sizeof(pmemCacheSlot)+sizeof(robj)+len;
+    pmemCacheSlot *slot;
+
+    if (size > server.pmem_read_cache_size/PMEM_CACHE_MAX_VALUE_RATIO ||
+        server.pmem_cache_len == PMEM_CACHE_MAX_SLOTS) return NULL;
+    pmemCacheMakeRoom(size);
+    if (server.pmem_cache_len == server.pmem_cache_size) {
+        server.pmem_cache_size = server.pmem_cache_size ?
+            server.pmem_cache_size*2 : 1024;
+        server.pmem_cache_slots = zrealloc(server.pmem_cache_slots,
+            sizeof(pmemCacheSlot)*server.pmem_cache_size);
+    }
+    slot = server.pmem_cache_slots+server.pmem_cache_len;
+    slot->meta = meta;
+    slot->val = createStringObject(val->ptr,len);
+    slot->size = size;
+    slot->referenced = 0;
+    meta->cache_slot = ++server.pmem_cache_len;
+    server.pmem_cache_used += size;
+    return slot->val;
+}
+
+/* Value of a PMEM entry for a read only command: the DRAM copy of the
+ * cache if any, else the PMEM value, copied into the cache if it was read
+ * before. The returned object must not be modified. A copy stays valid until
+ * the next beforeSleep() even if it is evicted or dropped meanwhile, like the
+ * value read by a command that then writes the key. */
+robj *pmemCacheRead(dictEntry *de, int flags) {
+    pmemEntryMeta *meta = pmemEntryGetMeta(de);
+    robj *val = dictGetVal(de), *copy;
+
+    /* An integer is stored in the node itself. */
+    if (val->encoding == OBJ_ENCODING_INT) return val;
+
+    if (meta && meta->cache_slot) {
+        pmemCacheSlot *slot = server.pmem_cache_slots+meta->cache_slot-1;
+
+        slot->referenced = 1;
+        server.stat_pmem_cache_hits++;
+        return slot->val;
+    }
+    emulateReadLatencyLines(PMEM_LATENCY_LINES(sdslen(val->ptr)));
+    if (server.pmem_read_cache_size == 0 || meta == NULL) return val;
+
+    server.stat_pmem_cache_misses++;
+    if (flags & LOOKUP_NOTOUCH) return val;
+    if (!meta->cache_seen) {
+        meta->cache_seen = 1;
+        return val;
+    }
+    copy = pmemCacheAdd(meta,val);
+    return copy ? copy : val;
+}
+
+/* Forgets the cached value of an entry, that is written, deleted or
+ * demoted, and its previous read. */
+void pmemCacheDrop(dictEntry *de) {
+    pmemEntryMeta *meta = pmemEntryGetMeta(de);
+
+    if (meta == NULL) return;
+    if (meta->cache_slot)
+        pmemCacheRemoveSlot(meta->cache_slot-1);
+    else
+        meta->cache_seen = 0;
+}
+
+/* Frees the copies dropped from the cache since the last call. */
+void pmemCacheFreeDropped(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.pmem_cache_to_free)) != NULL) {
+        decrRefCount(listNodeValue(ln));
+        listDelNode(server.pmem_cache_to_free,ln);
+    }
+}
+
+/* Applies a new pmem-read-cache-size. */
+void pmemCacheResize(void) {
+    pmemCacheMakeRoom(0);
+    if (server.pmem_read_cache_size == 0) {
+        zfree(server.pmem_cache_slots);
+        server.pmem_cache_slots = NULL;
+        server.pmem_cache_size = 0;
+        server.pmem_cache_hand = 0;
+    }
+}
+#endif
@@ -0,0 +1,26 @@
+#ifndef __PMEM_CACHE_H
+#define __PMEM_CACHE_H
+
+#ifdef TODIS
+/* DRAM read cache of the values of hot PMEM keys, bounded by
+ * pmem-read-cache-size. A value is copied on its second read since it was
+ * last written or evicted, and dropped when the key is written, deleted or
+ * demoted. CLOCK replacement over a dense array of slots, the slot of an
+ * entry being kept in its pmemEntryMeta. */
+typedef struct pmemCacheSlot {
+    pmemEntryMeta *meta;            /* PMEM entry of the cached value */
+    robj *val;                      /* DRAM copy of the value */
+    size_t size;                    /* Bytes accounted to the copy */
+    int referenced;                 /* Read since the hand last passed */
+} pmemCacheSlot;
+
+#define PMEM_CACHE_MAX_SLOTS ((1UL<<30)-1) /* Fits pmemEntryMeta.cache_slot */
+#define PMEM_CACHE_MAX_VALUE_RATIO 16 /* Largest value, in cache sizes */
+
+robj *pmemCacheRead(dictEntry *de, int flags);
+void pmemCacheDrop(dictEntry *de);
+void pmemCacheFreeDropped(void);
+void pmemCacheResize(void);
+#endif
+
+#endif
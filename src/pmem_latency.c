@@ -3,27 +3,219 @@
 #include "obj.h"
 #include "libpmemobj.h"
 #include "util.h"
+#include "pmem_latency.h"
 
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PMEM_HAVE_TSC 1
+#endif
 
-void emulateReadLatency(void) {
-    struct timespec base = nstimespec();
-    base.tv_nsec += server.pm_read_latency;
-    int count = 0;
-    while (nstimeCompare(base, nstimespec()) == 1) {
-        count++;
+/* Delays in TSC cycles, computed by pmemLatencyUpdate() from the
+ * configuration, 0 when the emulation is off. */
+uint64_t pmem_read_line_cycles = 0;
+uint64_t pmem_write_line_cycles = 0;
+uint64_t pmem_write_bw_line_cycles = 0;
+
+static double pmem_cycles_per_ns = 1;
+static uint64_t pmem_stall_overhead = 0; /* Cycles of a stall of 0 cycles */
+static uint64_t pmem_write_busy_until = 0; /* Writes drained by the media */
+static uint64_t pmem_tx_hist[PMEM_TX_HIST_BUCKETS]; /* Commit latencies */
+static uint64_t pmem_tx_hist_count = 0;
+
+static inline uint64_t pmemLatencyCycles(void) {
+#ifdef PMEM_HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void pmemLatencyPause(void) {
+#ifdef PMEM_HAVE_TSC
+    _mm_pause();
+#endif
+}
+
+static uint64_t pmemLatencyNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Spins until the TSC reaches 'until', without a pause instruction: its
+ * duration, up to a hundred cycles, would add up to the short delays. */
+static inline void pmemLatencySpinUntil(uint64_t until) {
+    while ((int64_t)(until - pmemLatencyCycles()) > 0);
+}
+
+/* Delays for 'cycles', the fixed cost of the call and of reading the TSC
+ * measured by pmemLatencyInit() included. */
+void pmemLatencyStall(uint64_t cycles) {
+    uint64_t start = pmemLatencyCycles();
+
+    if (cycles <= pmem_stall_overhead) return;
+    pmemLatencySpinUntil(start + cycles - pmem_stall_overhead);
+}
+
+/* Charges the write back of 'lines' cache lines: the latency of the lines,
+ * and with pm-write-bandwidth the time the media takes to drain them after
+ * the writes queued before. The bio thread freeing the victims shares the
+ * media with the main thread, so the busy time is updated atomically. */
+void pmemLatencyWrite(size_t lines) {
+    uint64_t now = pmemLatencyCycles();
+    uint64_t until = now + lines * pmem_write_line_cycles;
+
+    if (until - now > pmem_stall_overhead) until -= pmem_stall_overhead;
+
+    if (pmem_write_bw_line_cycles) {
+        uint64_t busy = __atomic_load_n(&pmem_write_busy_until,
+                __ATOMIC_RELAXED);
+        uint64_t next;
+
+        do {
+            next = ((int64_t)(busy - now) < 0 ? now : busy) +
+                lines * pmem_write_bw_line_cycles;
+        } while (!__atomic_compare_exchange_n(&pmem_write_busy_until, &busy,
+                    next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if ((int64_t)(next - until) > 0) until = next;
     }
-    // serverLog(LL_NOTICE, "read latency loop: %d", count);
+    pmemLatencySpinUntil(until);
 }
 
-void emulateWriteLatency(void) {
-    struct timespec base = nstimespec();
-    base.tv_nsec += server.pm_write_latency;
-    int count = 0;
-    while (nstimeCompare(base, nstimespec()) == 1) {
-        count++;
+/* Converts the configured latencies and bandwidth to TSC cycles. Called at
+ * startup and by CONFIG SET. */
+void pmemLatencyUpdate(void) {
+    pmem_read_line_cycles = server.pm_read_latency * pmem_cycles_per_ns;
+    pmem_write_line_cycles = server.pm_write_latency * pmem_cycles_per_ns;
+    /* pm-write-bandwidth is in MB/s: a line takes 64000 / MB/s ns. */
+    pmem_write_bw_line_cycles = server.pm_write_bandwidth ?
+        (double)PMEM_CACHE_LINE * 1000 / server.pm_write_bandwidth *
+        pmem_cycles_per_ns : 0;
+    __atomic_store_n(&pmem_write_busy_until, 0, __ATOMIC_RELAXED);
+}
+
+/* Calibrates the TSC against the monotonic clock for 10 milliseconds,
+ * then measures the fixed cost of a stall. */
+void pmemLatencyInit(void) {
+    uint64_t start, cycles, overhead = 0;
+    int j, k;
+#ifdef PMEM_HAVE_TSC
+    uint64_t start_ns = pmemLatencyNs(), ns;
+
+    start = pmemLatencyCycles();
+    while ((ns = pmemLatencyNs() - start_ns) < 10000000) pmemLatencyPause();
+    pmem_cycles_per_ns = (double)(pmemLatencyCycles() - start) / ns;
+#endif
+    /* The fastest of a few runs, the others being slowed by interrupts. */
+    pmem_stall_overhead = 0;
+    for (k = 0; k < 10; k++) {
+        start = pmemLatencyCycles();
+        for (j = 0; j < 1000; j++) pmemLatencyStall(1);
+        cycles = (pmemLatencyCycles() - start) / 1000;
+        if (k == 0 || cycles < overhead) overhead = cycles;
     }
-    // serverLog(LL_NOTICE, "write latency loop: %d", count);
+    pmem_stall_overhead = overhead;
+    pmemLatencyUpdate();
+}
+
+/* Returns the start time in TSC cycles of a commit to record with
+ * pmemTxLatencyRecord(). */
+uint64_t pmemTxLatencyClock(void) {
+    return pmemLatencyCycles();
+}
+
+/* Like pmemTxLatencyClock(), but returns 0, nothing being recorded, when a
+ * transaction is open already: the write then nests in a group commit or
+ * in a batch, whose commit is recorded instead. */
+uint64_t pmemTxLatencyStart(void) {
+    if (pmemobj_tx_stage() != TX_STAGE_NONE) return 0;
+    return pmemLatencyCycles();
+}
+
+/* Bucket of a latency of 'ns': the values below 4 have their own bucket,
+ * the others are split by their highest bit and the 2 bits below it. */
+static int pmemTxLatencyBucket(uint64_t ns) {
+    int msb;
+
+    if (ns < (1 << PMEM_TX_HIST_SUB_BITS)) return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - PMEM_TX_HIST_SUB_BITS + 1) << PMEM_TX_HIST_SUB_BITS) +
+        ((ns >> (msb - PMEM_TX_HIST_SUB_BITS)) &
+         ((1 << PMEM_TX_HIST_SUB_BITS) - 1));
+}
+
+/* Highest latency in ns falling in 'bucket'. */
+static uint64_t pmemTxLatencyBucketMax(int bucket) {
+    int sub = bucket & ((1 << PMEM_TX_HIST_SUB_BITS) - 1);
+    int shift = (bucket >> PMEM_TX_HIST_SUB_BITS) - 1;
+
+    if (bucket < (1 << PMEM_TX_HIST_SUB_BITS)) return bucket;
+    return (((uint64_t)((1 << PMEM_TX_HIST_SUB_BITS) + sub + 1)) << shift) - 1;
+}
+
+/* Records the latency of a commit started at 'start' (pmemTxLatencyStart()). */
+void pmemTxLatencyRecord(uint64_t start) {
+    uint64_t ns;
+
+    if (start == 0) return;
+    ns = (pmemLatencyCycles() - start) / pmem_cycles_per_ns;
+    pmem_tx_hist[pmemTxLatencyBucket(ns)]++;
+    pmem_tx_hist_count++;
+}
+
+uint64_t pmemTxLatencyCount(void) {
+    return pmem_tx_hist_count;
+}
+
+/* Returns the upper bound in ns of the bucket holding the 'percentile'
+ * (0-100) of the recorded commit latencies, 0 if none was recorded. */
+uint64_t pmemTxLatencyPercentile(double percentile) {
+    uint64_t rank, seen = 0;
+    int j;
+
+    if (pmem_tx_hist_count == 0) return 0;
+    rank = (uint64_t)(percentile / 100 * pmem_tx_hist_count);
+    if (rank == 0) rank = 1;
+    for (j = 0; j < PMEM_TX_HIST_BUCKETS; j++) {
+        seen += pmem_tx_hist[j];
+        if (seen >= rank) return pmemTxLatencyBucketMax(j);
+    }
+    return pmemTxLatencyBucketMax(PMEM_TX_HIST_BUCKETS - 1);
+}
+
+void pmemTxLatencyReset(void) {
+    memset(pmem_tx_hist, 0, sizeof(pmem_tx_hist));
+    pmem_tx_hist_count = 0;
+}
+
+/* Measures the delays actually achieved by the emulator for 'iterations'
+ * line reads and line writes, and the write throughput of page writes. */
+void pmemLatencySelfTest(long iterations, pmemLatencyReport *r) {
+    uint64_t start;
+    long j;
+
+    r->cycles_per_ns = pmem_cycles_per_ns;
+
+    start = pmemLatencyNs();
+    for (j = 0; j < iterations; j++) emulateReadLatency();
+    r->read_ns = (double)(pmemLatencyNs() - start) / iterations;
+
+    __atomic_store_n(&pmem_write_busy_until, 0, __ATOMIC_RELAXED);
+    start = pmemLatencyNs();
+    for (j = 0; j < iterations; j++) emulateWriteLatency();
+    r->write_ns = (double)(pmemLatencyNs() - start) / iterations;
+
+    __atomic_store_n(&pmem_write_busy_until, 0, __ATOMIC_RELAXED);
+    start = pmemLatencyNs();
+    for (j = 0; j < iterations; j++)
+        emulateWriteLatencyLines(PMEM_LATENCY_LINES(4096));
+    r->write_mbps = (double)iterations * 4096 * 1000 /
+        (pmemLatencyNs() - start + 1);
 }
 
 void *pmemobj_direct_latency(PMEMoid oid) {
@@ -32,7 +224,7 @@ void *pmemobj_direct_latency(PMEMoid oid) {
 }
 
 PMEMoid pmemobj_tx_zalloc_latency(size_t size, uint64_t type_num) {
-    emulateWriteLatency();
+    emulateWriteLatencyLines(PMEM_LATENCY_LINES(size));
     return pmemobj_tx_zalloc(size, type_num);
 }
 
@@ -40,4 +232,25 @@ int pmemobj_tx_free_latency(PMEMoid oid) {
     emulateWriteLatency();
     return pmemobj_tx_free(oid);
 }
+
+PMEMoid pmemobj_reserve_latency(PMEMobjpool *pop, struct pobj_action *act,
+        size_t size, uint64_t type_num) {
+    emulateWriteLatency();
+    return pmemobj_reserve(pop, act, size, type_num);
+}
+
+int pmemobj_publish_latency(PMEMobjpool *pop, struct pobj_action *actv,
+        size_t actvcnt) {
+    /* A redo log entry per action. */
+    emulateWriteLatencyLines(actvcnt);
+    return pmemobj_publish(pop, actv, actvcnt);
+}
+
+void pmemobj_persist_latency(PMEMobjpool *pop, const void *addr, size_t len) {
+    uintptr_t first = (uintptr_t)addr / PMEM_CACHE_LINE;
+    uintptr_t last = ((uintptr_t)addr + len - 1) / PMEM_CACHE_LINE;
+
+    emulateWriteLatencyLines(len ? last - first + 1 : 0);
+    pmemobj_persist(pop, addr, len);
+}
 #endif
\ No newline at end of file
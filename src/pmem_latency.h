@@ -34,12 +34,72 @@
 #include "libpmemobj.h"
 
 #ifdef TODIS
-void emulateReadLatency(void);
-void emulateWriteLatency(void);
+/* NVM latency and bandwidth emulator. Accesses are charged per cache line:
+ * pm-read-latency ns for a line read, pm-write-latency ns for a line
+ * written back (snapshot, flush), and pm-write-bandwidth caps the write
+ * throughput. The delays spin on the TSC, calibrated at startup, and cost
+ * a single test when the emulation is off. */
+#define PMEM_CACHE_LINE 64
+#define PMEM_LATENCY_LINES(len) \
+    (((len) + PMEM_CACHE_LINE - 1) / PMEM_CACHE_LINE)
+
+extern uint64_t pmem_read_line_cycles;
+extern uint64_t pmem_write_line_cycles;
+extern uint64_t pmem_write_bw_line_cycles;
+
+typedef struct pmemLatencyReport {
+    double cycles_per_ns;       /* Calibrated TSC frequency */
+    double read_ns;             /* Measured ns per line read */
+    double write_ns;            /* Measured ns per line written */
+    double write_mbps;          /* Measured write throughput, MB/s */
+} pmemLatencyReport;
+
+#define PMEM_LATENCY_SELFTEST_ITERATIONS 1000
+
+void pmemLatencyInit(void);
+void pmemLatencyUpdate(void);
+void pmemLatencySelfTest(long iterations, pmemLatencyReport *r);
+void pmemLatencyStall(uint64_t cycles);
+void pmemLatencyWrite(size_t lines);
+
+static inline void emulateReadLatencyLines(size_t lines) {
+    if (pmem_read_line_cycles) pmemLatencyStall(lines * pmem_read_line_cycles);
+}
+
+static inline void emulateWriteLatencyLines(size_t lines) {
+    if (pmem_write_line_cycles || pmem_write_bw_line_cycles)
+        pmemLatencyWrite(lines);
+}
+
+static inline void emulateReadLatency(void) {
+    emulateReadLatencyLines(1);
+}
+
+static inline void emulateWriteLatency(void) {
+    emulateWriteLatencyLines(1);
+}
+
+/* Log bucketed histogram of the PMEM commit latencies in ns, reported by
+ * INFO tiering: 4 linear sub-buckets per power of two, so a percentile is
+ * off by 25% at most. Recording a commit costs two TSC reads. */
+#define PMEM_TX_HIST_SUB_BITS 2
+#define PMEM_TX_HIST_BUCKETS (64 << PMEM_TX_HIST_SUB_BITS)
+
+uint64_t pmemTxLatencyClock(void);
+uint64_t pmemTxLatencyStart(void);
+void pmemTxLatencyRecord(uint64_t start);
+uint64_t pmemTxLatencyCount(void);
+uint64_t pmemTxLatencyPercentile(double percentile);
+void pmemTxLatencyReset(void);
 
 void *pmemobj_direct_latency(PMEMoid oid);
 PMEMoid pmemobj_tx_zalloc_latency(size_t size, uint64_t type_num);
 int pmemobj_tx_free_latency(PMEMoid oid);
+PMEMoid pmemobj_reserve_latency(PMEMobjpool *pop, struct pobj_action *act,
+        size_t size, uint64_t type_num);
+int pmemobj_publish_latency(PMEMobjpool *pop, struct pobj_action *actv,
+        size_t actvcnt);
+void pmemobj_persist_latency(PMEMobjpool *pop, const void *addr, size_t len);
 
 #define D_RW_LATENCY(o) ({\
     emulateReadLatency();\
@@ -50,7 +110,7 @@ int pmemobj_tx_free_latency(PMEMoid oid);
     D_RO(o);\
 })
 #define TX_ADD_DIRECT_LATENCY(o) ({\
-    emulateWriteLatency();\
+    emulateWriteLatencyLines(PMEM_LATENCY_LINES(sizeof(*(o))));\
     TX_ADD_DIRECT(o);\
 })
 #define TX_FREE_LATENCY(o) ({\
@@ -58,9 +118,13 @@ int pmemobj_tx_free_latency(PMEMoid oid);
     TX_FREE(o);\
 })
 #define TX_ADD_FIELD_DIRECT_LATENCY(o, field) ({\
-    emulateWriteLatency();\
+    emulateWriteLatencyLines(PMEM_LATENCY_LINES(sizeof((o)->field)));\
     TX_ADD_FIELD_DIRECT(o, field);\
 })
+#define TX_ADD_RANGE_DIRECT_LATENCY(p, size) ({\
+    emulateWriteLatencyLines(PMEM_LATENCY_LINES(size));\
+    pmemobj_tx_add_range_direct(p, size);\
+})
 #endif
 
 #endif
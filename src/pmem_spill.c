@@ -0,0 +1,485 @@
+#ifdef TODIS
+#include "server.h"
+#include "bio.h"
+#include "crc64.h"
+#include "endianconv.h"
+#include "pmem_spill.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* The spill log records the keys demoted from PMEM to DRAM, and the expired
+ * DRAM keys, in the order of the events. It is a header, PMEM_SPILL_MAGIC,
+ * followed by records:
+ *
+ *   <body length:u32> <crc64 of the body:u64> <body>
+ *
+ * the body being
+ *
+ *   <type:u8> <db:u32> <aof offset:u64> <expire:i64> <key length:u32>
+ *   <key> [<value>]
+ *
+ * A raw value runs up to the end of the body, an integer value takes 8
+ * bytes, a DEL has no value. The integers are little endian, the expire is
+ * absolute in milliseconds, -1 for none. The AOF offset is the size of the
+ * AOF, its buffer included, when the record was fed.
+ *
+ * The records are buffered, written at once before the AOF buffer and
+ * fsynced with the AOF, so a victim list is freed only once its records are
+ * on disk. At startup the log is replayed along with the AOF, a record
+ * before the AOF command at its offset, so that the events of both keep
+ * their order. An AOF rewrite drops the records written before its fork,
+ * that its snapshot holds, and shifts the offsets of the others to the
+ * rewritten AOF. */
+
+#define PMEM_SPILL_WRITE_ERROR_RATE 30  /* Seconds between errors logging */
+#define PMEM_SPILL_COPY_CHUNK (1024*1024)
+
+static unsigned char *spillPut32(unsigned char *p, uint32_t v) {
+    v = intrev32ifbe(v);
+    memcpy(p,&v,sizeof(v));
+    return p+sizeof(v);
+}
+
+static unsigned char *spillPut64(unsigned char *p, uint64_t v) {
+    v = intrev64ifbe(v);
+    memcpy(p,&v,sizeof(v));
+    return p+sizeof(v);
+}
+
+static uint32_t spillGet32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v,p,sizeof(v));
+    return intrev32ifbe(v);
+}
+
+static uint64_t spillGet64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v,p,sizeof(v));
+    return intrev64ifbe(v);
+}
+
+/* Opens the spill log for appends, creating it if needed. */
+int pmemSpillOpen(void) {
+    struct redis_stat sb;
+    int fd;
+
+    fd = open(server.pmem_spill_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (fd == -1 || redis_fstat(fd,&sb) == -1) {
+        serverLog(LL_WARNING,"Can't open the spill log %s: %s",
+            server.pmem_spill_filename, strerror(errno));
+        if (fd != -1) close(fd);
+        return C_ERR;
+    }
+    if (sb.st_size < PMEM_SPILL_MAGIC_LEN) {
+        /* A new log, or a header torn by a crash. */
+        if (ftruncate(fd,0) == -1 ||
+            write(fd,PMEM_SPILL_MAGIC,PMEM_SPILL_MAGIC_LEN) !=
+                PMEM_SPILL_MAGIC_LEN)
+        {
+            serverLog(LL_WARNING,"Can't write the spill log header: %s",
+                strerror(errno));
+            close(fd);
+            return C_ERR;
+        }
+        sb.st_size = PMEM_SPILL_MAGIC_LEN;
+    }
+    server.pmem_spill_fd = fd;
+    server.pmem_spill_size = sb.st_size;
+    return C_OK;
+}
+
+/* Closes the spill log. The caller flushed and fsynced it. */
+void pmemSpillClose(void) {
+    if (server.pmem_spill_fd == -1) return;
+    close(server.pmem_spill_fd);
+    server.pmem_spill_fd = -1;
+    server.pmem_spill_size = 0;
+    sdsclear(server.pmem_spill_buf);
+}
+
+static void pmemSpillAppend(int type, int dbid, sds key, const char *val,
+        size_t vallen, long long expire)
+{
+    size_t keylen = sdslen(key);
+    uint32_t len = PMEM_SPILL_BODY_MIN+keylen+vallen;
+    size_t start = sdslen(server.pmem_spill_buf);
+    unsigned char *rec, *p;
+
+    server.pmem_spill_buf = sdsMakeRoomFor(server.pmem_spill_buf,
+                                           PMEM_SPILL_HDR_LEN+len);
+    rec = (unsigned char*)server.pmem_spill_buf+start;
+    p = rec+PMEM_SPILL_HDR_LEN;
+    *p++ = type;
+    p = spillPut32(p,dbid);
+    p = spillPut64(p,server.aof_current_size+sdslen(server.aof_buf));
+    p = spillPut64(p,(uint64_t)expire);
+    p = spillPut32(p,keylen);
+    memcpy(p,key,keylen);
+    if (vallen) memcpy(p+keylen,val,vallen);
+
+    p = spillPut32(rec,len);
+    spillPut64(p,crc64(0,rec+PMEM_SPILL_HDR_LEN,len));
+    sdsIncrLen(server.pmem_spill_buf,PMEM_SPILL_HDR_LEN+len);
+    server.stat_pmem_spill_records++;
+}
+
+/* Records a key demoted to DRAM, with its absolute expire or -1. */
+void pmemSpillFeedSet(int dbid, robj *key, robj *val, long long expire) {
+    if (val->encoding == OBJ_ENCODING_INT) {
+        unsigned char buf[8];
+
+        spillPut64(buf,(uint64_t)(long)val->ptr);
+        pmemSpillAppend(PMEM_SPILL_SET_INT,dbid,key->ptr,(char*)buf,
+                        sizeof(buf),expire);
+    } else {
+        pmemSpillAppend(PMEM_SPILL_SET,dbid,key->ptr,val->ptr,
+                        sdslen(val->ptr),expire);
+    }
+}
+
+/* Records the deletion of a DRAM key. */
+void pmemSpillFeedDel(int dbid, sds key) {
+    pmemSpillAppend(PMEM_SPILL_DEL,dbid,key,NULL,0,-1);
+}
+
+int pmemSpillPending(void) {
+    return sdslen(server.pmem_spill_buf) != 0;
+}
+
+/* Writes the buffered records with a single write(2). A failed write is
+ * handled as an AOF write error: the records stay in the buffer and the
+ * writes are refused until it is solved. */
+int pmemSpillFlush(void) {
+    size_t len = sdslen(server.pmem_spill_buf);
+    ssize_t nwritten;
+
+    if (len == 0 || server.pmem_spill_fd == -1) return C_OK;
+    nwritten = write(server.pmem_spill_fd,server.pmem_spill_buf,len);
+    if (nwritten != (ssize_t)len) {
+        static time_t last_write_error_log = 0;
+
+        if (nwritten == -1) {
+            server.aof_last_write_errno = errno;
+        } else {
+            server.aof_last_write_errno = ENOSPC;
+            /* Drop the partial record, or keep what was written. */
+            if (ftruncate(server.pmem_spill_fd,server.pmem_spill_size) == -1) {
+                server.pmem_spill_size += nwritten;
+                sdsrange(server.pmem_spill_buf,nwritten,-1);
+            }
+        }
+        if ((server.unixtime - last_write_error_log) >
+            PMEM_SPILL_WRITE_ERROR_RATE)
+        {
+            serverLog(LL_WARNING,"Error writing to the spill log: %s",
+                strerror(server.aof_last_write_errno));
+            last_write_error_log = server.unixtime;
+        }
+        if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+            serverLog(LL_WARNING,"Can't recover from spill log write error when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        server.aof_last_write_status = C_ERR;
+        return C_ERR;
+    }
+    server.pmem_spill_size += len;
+
+    /* The AOF write clears the error otherwise. */
+    if (server.aof_last_write_status == C_ERR &&
+        sdslen(server.aof_buf) == 0)
+    {
+        serverLog(LL_WARNING,
+            "Spill log write error looks solved, Redis can write again.");
+        server.aof_last_write_status = C_OK;
+    }
+
+    /* Same buffer reuse as the AOF buffer. */
+    if ((sdslen(server.pmem_spill_buf)+sdsavail(server.pmem_spill_buf)) < 4000) {
+        sdsclear(server.pmem_spill_buf);
+    } else {
+        sdsfree(server.pmem_spill_buf);
+        server.pmem_spill_buf = sdsempty();
+    }
+    return C_OK;
+}
+
+/* Called in the parent at the fork of an AOF rewrite: the records up to now
+ * are in the snapshot of the child. */
+void pmemSpillRewriteStart(void) {
+    server.pmem_spill_rewrite_base =
+        server.pmem_spill_size + sdslen(server.pmem_spill_buf);
+}
+
+/* Copies the records of the spill log from 'offset' to its end to 'fd',
+ * their AOF offsets shifted by 'aof_shift' bytes. */
+static int pmemSpillCopy(int fd, off_t offset, long long aof_shift) {
+    FILE *fp = fopen(server.pmem_spill_filename,"r");
+    sds buf = sdsempty();
+    unsigned char *body = NULL;
+    size_t body_size = 0;
+    off_t left = server.pmem_spill_size-offset;
+    int retval = C_ERR;
+
+    if (fp == NULL || fseeko(fp,offset,SEEK_SET) == -1) goto end;
+    while (left > 0) {
+        unsigned char hdr[PMEM_SPILL_HDR_LEN], *p;
+        uint32_t len;
+
+        if (fread(hdr,1,sizeof(hdr),fp) != sizeof(hdr)) goto end;
+        len = spillGet32(hdr);
+        if (len > body_size) {
+            body_size = len;
+            body = zrealloc(body,body_size);
+        }
+        if (fread(body,1,len,fp) != len) goto end;
+        p = body+PMEM_SPILL_AOF_OFFSET_POS;
+        spillPut64(p,spillGet64(p)+aof_shift);
+        spillPut64(hdr+4,crc64(0,body,len));
+        buf = sdscatlen(buf,hdr,sizeof(hdr));
+        buf = sdscatlen(buf,body,len);
+        if (sdslen(buf) >= PMEM_SPILL_COPY_CHUNK) {
+            if (write(fd,buf,sdslen(buf)) != (ssize_t)sdslen(buf)) goto end;
+            sdsclear(buf);
+        }
+        left -= PMEM_SPILL_HDR_LEN+len;
+    }
+    if (sdslen(buf) && write(fd,buf,sdslen(buf)) != (ssize_t)sdslen(buf))
+        goto end;
+    retval = C_OK;
+end:
+    if (fp != NULL) fclose(fp);
+    zfree(body);
+    sdsfree(buf);
+    return retval;
+}
+
+/* Called once the rewritten AOF replaced the old one: the spill log keeps
+ * the records written since the fork only, their AOF offsets shifted by
+ * 'aof_shift', the size of the rewritten AOF less the one of the old AOF.
+ * A crash before the new log is renamed replays the older records on top
+ * of the snapshot, as the old AOF would have. */
+void pmemSpillRewriteDone(long long aof_shift) {
+    char tmpfile[256];
+    off_t base = server.pmem_spill_rewrite_base;
+    int newfd, oldfd;
+
+    server.pmem_spill_rewrite_base = -1;
+    if (server.pmem_spill_fd == -1) {
+        /* No record since the fork: the snapshot has the whole log. */
+        if (unlink(server.pmem_spill_filename) == 0)
+            serverLog(LL_NOTICE,"Spill log merged into the rewritten AOF");
+        return;
+    }
+    if (base < PMEM_SPILL_MAGIC_LEN || pmemSpillFlush() == C_ERR) return;
+
+    snprintf(tmpfile,256,"temp-spill-%d.aof",(int)getpid());
+    newfd = open(tmpfile,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    if (newfd == -1) {
+        serverLog(LL_WARNING,"Can't create the spill log %s: %s",
+            tmpfile, strerror(errno));
+        return;
+    }
+    if (write(newfd,PMEM_SPILL_MAGIC,PMEM_SPILL_MAGIC_LEN) !=
+            PMEM_SPILL_MAGIC_LEN ||
+        pmemSpillCopy(newfd,base,aof_shift) == C_ERR ||
+        aof_fsync(newfd) == -1 ||
+        rename(tmpfile,server.pmem_spill_filename) == -1)
+    {
+        serverLog(LL_WARNING,"Error compacting the spill log: %s",
+            strerror(errno));
+        close(newfd);
+        unlink(tmpfile);
+        return;
+    }
+    serverLog(LL_NOTICE,"Spill log compacted: %lld bytes kept",
+        (long long)(server.pmem_spill_size-base));
+    oldfd = server.pmem_spill_fd;
+    server.pmem_spill_fd = newfd;
+    server.pmem_spill_size = PMEM_SPILL_MAGIC_LEN+server.pmem_spill_size-base;
+    bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
+}
+
+/* State of the replay of the spill log at startup. A record read ahead
+ * waits in 'body' until the AOF reaches its offset. */
+static struct {
+    FILE *fp;
+    unsigned char *body;
+    size_t body_size;
+    uint32_t len;               /* Length of the record read ahead, or 0 */
+    off_t valid_up_to;          /* End of the last record applied */
+    long long records, start;
+    const char *err;
+} spillLoad;
+
+/* Opens the spill log, if any, for its replay along with the AOF. */
+void pmemSpillLoadStart(void) {
+    FILE *fp = fopen(server.pmem_spill_filename,"r");
+    char magic[PMEM_SPILL_MAGIC_LEN];
+
+    if (fp == NULL) {
+        if (errno == ENOENT) return;
+        serverLog(LL_WARNING,"Fatal error: can't open the spill log for reading: %s",strerror(errno));
+        exit(1);
+    }
+    if (fread(magic,1,sizeof(magic),fp) != sizeof(magic)) {
+        fclose(fp);
+        return;
+    }
+    if (memcmp(magic,PMEM_SPILL_MAGIC,PMEM_SPILL_MAGIC_LEN) != 0) {
+        serverLog(LL_WARNING,"Bad spill log signature in %s (expected "
+            PMEM_SPILL_MAGIC "). Exiting.", server.pmem_spill_filename);
+        exit(1);
+    }
+    memset(&spillLoad,0,sizeof(spillLoad));
+    spillLoad.fp = fp;
+    spillLoad.valid_up_to = PMEM_SPILL_MAGIC_LEN;
+    spillLoad.start = ustime();
+}
+
+int pmemSpillLoading(void) {
+    return spillLoad.fp != NULL && spillLoad.err == NULL;
+}
+
+/* Reads the next record ahead. Returns 0 at the end of the log, or on a
+ * torn or corrupted record, 'err' being set. */
+static int pmemSpillReadAhead(void) {
+    unsigned char hdr[PMEM_SPILL_HDR_LEN];
+    size_t nread;
+    uint32_t len;
+
+    if (spillLoad.len) return 1;
+    nread = fread(hdr,1,sizeof(hdr),spillLoad.fp);
+    if (nread == 0 && feof(spillLoad.fp)) return 0;
+    if (nread != sizeof(hdr)) {
+        spillLoad.err = "short record header";
+        return 0;
+    }
+    len = spillGet32(hdr);
+    if (len < PMEM_SPILL_BODY_MIN || len > PMEM_SPILL_MAX_BODY) {
+        spillLoad.err = "bad record length";
+        return 0;
+    }
+    if (len > spillLoad.body_size) {
+        spillLoad.body_size = len;
+        spillLoad.body = zrealloc(spillLoad.body,len);
+    }
+    if (fread(spillLoad.body,1,len,spillLoad.fp) != len) {
+        spillLoad.err = "short record";
+        return 0;
+    }
+    if (crc64(0,spillLoad.body,len) != spillGet64(hdr+4)) {
+        spillLoad.err = "bad record checksum";
+        return 0;
+    }
+    spillLoad.len = len;
+    return 1;
+}
+
+/* Applies the record read ahead to the DRAM dict directly, without the
+ * command table nor a fake client. */
+static void pmemSpillApply(void) {
+    unsigned char *p = spillLoad.body;
+    uint32_t len = spillLoad.len, keylen, dbid;
+    long long expire;
+    robj *key;
+    redisDb *db;
+    int type;
+
+    type = *p++;
+    dbid = spillGet32(p); p += 4;
+    p += 8; /* AOF offset */
+    expire = (long long)spillGet64(p); p += 8;
+    keylen = spillGet32(p); p += 4;
+    if (dbid >= (uint32_t)server.dbnum ||
+        keylen > len-PMEM_SPILL_BODY_MIN ||
+        (type == PMEM_SPILL_SET_INT && len-PMEM_SPILL_BODY_MIN-keylen != 8) ||
+        (type != PMEM_SPILL_SET && type != PMEM_SPILL_SET_INT &&
+         type != PMEM_SPILL_DEL))
+    {
+        spillLoad.err = "bad record";
+        return;
+    }
+    db = server.db+dbid;
+    key = createStringObject((char*)p,keylen);
+    p += keylen;
+    if (type == PMEM_SPILL_DEL) {
+        dbDelete(db,key);
+    } else {
+        robj *val;
+
+        if (type == PMEM_SPILL_SET_INT)
+            val = createStringObjectFromLongLong((long long)spillGet64(p));
+        else
+            val = tryObjectEncoding(createStringObject((char*)p,
+                    len-PMEM_SPILL_BODY_MIN-keylen));
+        setKey(db,key,val);
+        decrRefCount(val);
+        if (expire != -1) setExpire(db,key,expire);
+    }
+    decrRefCount(key);
+    spillLoad.valid_up_to += PMEM_SPILL_HDR_LEN+len;
+    spillLoad.records++;
+    spillLoad.len = 0;
+}
+
+/* Applies the records fed before the AOF command at 'aof_offset'. Called by
+ * loadAppendOnlyFile() before every command. */
+void pmemSpillLoadUpTo(off_t aof_offset) {
+    while (pmemSpillLoading() && pmemSpillReadAhead() &&
+           (off_t)spillGet64(spillLoad.body+PMEM_SPILL_AOF_OFFSET_POS) <=
+               aof_offset)
+    {
+        pmemSpillApply();
+    }
+}
+
+/* Applies the records left once the AOF is loaded, even an empty or missing
+ * one. A torn or corrupted tail is handled as a truncated AOF. */
+void pmemSpillLoadFinish(void) {
+    if (spillLoad.fp == NULL) return;
+    startLoading(spillLoad.fp);
+    while (pmemSpillLoading() && pmemSpillReadAhead()) {
+        /* Serve the clients from time to time */
+        if (!(spillLoad.records % 1000)) {
+            loadingProgress(spillLoad.valid_up_to);
+            processEventsWhileBlocked();
+        }
+        pmemSpillApply();
+    }
+    fclose(spillLoad.fp);
+    spillLoad.fp = NULL;
+    zfree(spillLoad.body);
+    stopLoading();
+
+    if (spillLoad.err) {
+        if (!server.aof_load_truncated) {
+            serverLog(LL_WARNING,"Bad spill log at offset %lld: %s. Set aof-load-truncated yes to load the records before it. Exiting.",
+                (long long)spillLoad.valid_up_to, spillLoad.err);
+            exit(1);
+        }
+        serverLog(LL_WARNING,"!!! Warning: %s at offset %lld of the spill log, the records after it are dropped !!!",
+            spillLoad.err, (long long)spillLoad.valid_up_to);
+        if (truncate(server.pmem_spill_filename,spillLoad.valid_up_to) == -1) {
+            serverLog(LL_WARNING,"Can't truncate the spill log: %s",
+                strerror(errno));
+            exit(1);
+        }
+        if (server.pmem_spill_fd != -1)
+            server.pmem_spill_size = spillLoad.valid_up_to;
+    }
+    serverLog(LL_NOTICE,"%lld records loaded from the spill log: %.3f seconds",
+        spillLoad.records, (float)(ustime()-spillLoad.start)/1000000);
+
+    /* Without the spill log the records go to the AOF again: a rewrite
+     * merges the log into the AOF, then removes it. */
+    if (!server.pmem_spill_log && spillLoad.records &&
+        server.aof_state == AOF_ON)
+    {
+        serverLog(LL_NOTICE,"pmem-spill-log is off: an AOF rewrite will merge the spill log");
+        server.aof_rewrite_scheduled = 1;
+    }
+}
+#endif
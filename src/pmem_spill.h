@@ -0,0 +1,34 @@
+#ifndef __PMEM_SPILL_H
+#define __PMEM_SPILL_H
+
+#ifdef TODIS
+/* Spill log of the keys demoted from PMEM to DRAM: a binary, checksummed
+ * log that takes the place of the AOFSET, PEXPIREAT and DEL commands TODIS
+ * feeds to the AOF. See pmem_spill.c for the format. */
+#define PMEM_SPILL_MAGIC "TDSPILL2"
+#define PMEM_SPILL_MAGIC_LEN 8
+#define PMEM_SPILL_HDR_LEN 12           /* Body length and checksum */
+#define PMEM_SPILL_BODY_MIN 25          /* Type, db, AOF offset, expire,
+                                           key length */
+#define PMEM_SPILL_AOF_OFFSET_POS 5     /* AOF offset in the body */
+#define PMEM_SPILL_MAX_BODY (1024*1024*1024)
+
+#define PMEM_SPILL_SET 1                /* Key and raw string value */
+#define PMEM_SPILL_SET_INT 2            /* Key and integer value */
+#define PMEM_SPILL_DEL 3                /* Key only */
+
+int pmemSpillOpen(void);
+void pmemSpillClose(void);
+void pmemSpillFeedSet(int dbid, robj *key, robj *val, long long expire);
+void pmemSpillFeedDel(int dbid, sds key);
+int pmemSpillPending(void);
+int pmemSpillFlush(void);
+void pmemSpillRewriteStart(void);
+void pmemSpillRewriteDone(long long aof_shift);
+void pmemSpillLoadStart(void);
+int pmemSpillLoading(void);
+void pmemSpillLoadUpTo(off_t aof_offset);
+void pmemSpillLoadFinish(void);
+#endif
+
+#endif
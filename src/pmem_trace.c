@@ -0,0 +1,156 @@
+#ifdef TODIS
+#include "server.h"
+#include "pmem_trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PMEM_TRACE_HAVE_TSC 1
+#endif
+
+/* Ring buffer of a thread. Only its thread writes it: a record is filled,
+ * then published by the increment of 'head'. A dump reads the rings of all
+ * threads without stopping them, so the oldest records it reads may be
+ * overwritten meanwhile. */
+typedef struct pmemTraceRing {
+    uint64_t head;                  /* Records written, the next slot being
+                                       head % PMEM_TRACE_RING_SIZE */
+    int thread;                     /* Thread number, in first trace order */
+    struct pmemTraceRing *next;
+    pmemTraceRecord records[PMEM_TRACE_RING_SIZE];
+} pmemTraceRing;
+
+static pmemTraceRing *pmem_trace_rings = NULL; /* Rings of all the threads */
+
+static const struct {
+    const char *name;
+    const char *args;               /* Format of the two arguments */
+} pmemTraceEvents[PMEM_TRACE_EVENT_COUNT] = {
+    {"dict-add", "key=%#llx"},
+    {"dict-add-pm", "key=%#llx val=%#llx"},
+    {"dict-add-raw-pm", "entry=%#llx pmem_used=%llu"},
+    {"dict-reconstruct", "key=%#llx pmem_used=%llu"},
+    {"dict-reconstruct-dup", "key=%#llx"},
+    {"sds-new-pm", "sds=%#llx size=%llu"},
+    {"sds-free-pm", "sds=%#llx size=%llu"},
+    {"list-add", "node=%#llx size=%llu"},
+    {"list-remove", "node=%#llx size=%llu"},
+    {"list-unlink", "node=%#llx"},
+    {"list-rearrange", "key=%#llx"},
+    {"evict-start", "used=%llu tofree=%llu"},
+    {"evict-key", "entry=%#llx size=%llu"},
+    {"victims-link", "first=%#llx count=%llu"},
+    {"victim-link", "node=%#llx"},
+    {"victims-free", "first=%#llx count=%llu"},
+    {"aof-feed", "key=%#llx expire=%lld"},
+    {"aof-flush", "size=%llu"},
+    {"aof-fsync", "fd=%llu"},
+    {"propagate-expire", "entry=%#llx"},
+    {"reconstruct-victim", "key=%#llx"}
+};
+
+#ifdef TODIS_TRACE
+static __thread pmemTraceRing *pmem_trace_ring = NULL;
+static int pmem_trace_threads = 0;
+
+static inline uint64_t pmemTraceClock(void) {
+#ifdef PMEM_TRACE_HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Allocates the ring of the calling thread and pushes it on the list of
+ * the rings, that is never shrunk: a dump can walk it at any time. */
+static pmemTraceRing *pmemTraceCreateRing(void) {
+    pmemTraceRing *ring = zcalloc(sizeof(*ring));
+
+    ring->thread = __atomic_fetch_add(&pmem_trace_threads, 1,
+                                      __ATOMIC_RELAXED);
+    do {
+        ring->next = __atomic_load_n(&pmem_trace_rings, __ATOMIC_ACQUIRE);
+    } while (!__atomic_compare_exchange_n(&pmem_trace_rings, &ring->next,
+                ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return ring;
+}
+
+#endif
+
+void pmemTraceAdd(int event, uint64_t arg0, uint64_t arg1) {
+#ifdef TODIS_TRACE
+    pmemTraceRing *ring = pmem_trace_ring;
+    pmemTraceRecord *r;
+    uint64_t head;
+
+    if (ring == NULL) ring = pmem_trace_ring = pmemTraceCreateRing();
+    head = ring->head;
+    r = &ring->records[head & (PMEM_TRACE_RING_SIZE-1)];
+    r->tsc = pmemTraceClock();
+    r->event = event;
+    r->arg[0] = arg0;
+    r->arg[1] = arg1;
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+#else
+    UNUSED(event);
+    UNUSED(arg0);
+    UNUSED(arg1);
+#endif
+}
+
+/* Calls 'fn' with a line of text for each of the last 'count' records of
+ * every thread, oldest first. */
+void pmemTraceDump(long count, void (*fn)(void *privdata, const char *line),
+        void *privdata)
+{
+    pmemTraceRing *ring;
+    char line[256];
+
+    if (count > PMEM_TRACE_RING_SIZE) count = PMEM_TRACE_RING_SIZE;
+    ring = __atomic_load_n(&pmem_trace_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t seq = head > (uint64_t)count ? head - count : 0;
+
+        for (; seq < head; seq++) {
+            pmemTraceRecord *r = &ring->records[seq & (PMEM_TRACE_RING_SIZE-1)];
+            int len;
+
+            if (r->event >= PMEM_TRACE_EVENT_COUNT) continue;
+            len = snprintf(line, sizeof(line), "thread=%d seq=%llu tsc=%llu %s ",
+                ring->thread, (unsigned long long)seq,
+                (unsigned long long)r->tsc, pmemTraceEvents[r->event].name);
+            snprintf(line+len, sizeof(line)-len, pmemTraceEvents[r->event].args,
+                (unsigned long long)r->arg[0], (unsigned long long)r->arg[1]);
+            fn(privdata, line);
+        }
+    }
+}
+
+/* Forgets the records of every thread. A thread tracing meanwhile may keep
+ * its last record. */
+void pmemTraceReset(void) {
+    pmemTraceRing *ring = __atomic_load_n(&pmem_trace_rings, __ATOMIC_ACQUIRE);
+
+    for (; ring != NULL; ring = ring->next)
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef TODIS_TRACE
+static void pmemTraceLogLine(void *privdata, const char *line) {
+    UNUSED(privdata);
+    serverLogRaw(LL_WARNING|LL_RAW, line);
+    serverLogRaw(LL_WARNING|LL_RAW, "\n");
+}
+#endif
+
+/* Logs the last records of every thread in the crash report. */
+void pmemTraceLogCrash(void) {
+#ifdef TODIS_TRACE
+    serverLogRaw(LL_WARNING|LL_RAW, "\n------ TODIS TRACE ------\n");
+    pmemTraceDump(PMEM_TRACE_CRASH_RECORDS, pmemTraceLogLine, NULL);
+#endif
+}
+#endif
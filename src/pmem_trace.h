@@ -0,0 +1,67 @@
+#ifndef __PMEM_TRACE_H
+#define __PMEM_TRACE_H
+
+#include <stdint.h>
+
+#ifdef TODIS
+/* Trace points of the TODIS hot paths (dict, sds and list of PMEM records,
+ * eviction, victim list, AOF). Built with TODIS_TRACE=yes, a trace point
+ * stores a fixed size binary record in a ring buffer of the calling thread,
+ * without lock nor formatting; otherwise it compiles to nothing and its
+ * arguments are not evaluated. The rings are dumped by PMEMTRACE and in the
+ * crash report. */
+typedef enum pmemTraceEvent {
+    PMEM_TRACE_DICT_ADD = 0,        /* key, - */
+    PMEM_TRACE_DICT_ADD_PM,         /* key, value object */
+    PMEM_TRACE_DICT_ADD_RAW_PM,     /* entry, pmem entries of the dict */
+    PMEM_TRACE_DICT_RECONSTRUCT,    /* key, pmem entries of the dict */
+    PMEM_TRACE_DICT_RECONSTRUCT_DUP, /* key, - */
+    PMEM_TRACE_SDS_NEW_PM,          /* sds, allocation size */
+    PMEM_TRACE_SDS_FREE_PM,         /* sds, allocation size */
+    PMEM_TRACE_LIST_ADD,            /* node offset, node size */
+    PMEM_TRACE_LIST_REMOVE,         /* node offset, node size */
+    PMEM_TRACE_LIST_UNLINK,         /* node offset, - */
+    PMEM_TRACE_LIST_REARRANGE,      /* key, - */
+    PMEM_TRACE_EVICT_START,         /* used pmem memory, bytes to free */
+    PMEM_TRACE_EVICT_KEY,           /* entry, node size */
+    PMEM_TRACE_VICTIMS_LINK,        /* first victim offset, victims */
+    PMEM_TRACE_VICTIM_LINK,         /* victim offset, - */
+    PMEM_TRACE_VICTIMS_FREE,        /* first victim offset, victims freed */
+    PMEM_TRACE_AOF_FEED,            /* key, expire */
+    PMEM_TRACE_AOF_FLUSH,           /* AOF size, - */
+    PMEM_TRACE_AOF_FSYNC,           /* fd, - */
+    PMEM_TRACE_PROPAGATE_EXPIRE,    /* entry, - */
+    PMEM_TRACE_RECONSTRUCT_VICTIM,  /* key, - */
+    PMEM_TRACE_EVENT_COUNT
+} pmemTraceEvent;
+
+#define PMEM_TRACE_RING_SIZE 4096   /* Records per thread, a power of two */
+#define PMEM_TRACE_CRASH_RECORDS 64 /* Records per thread in a crash report */
+
+typedef struct pmemTraceRecord {
+    uint64_t tsc;                   /* Time stamp counter */
+    uint64_t event;                 /* PMEM_TRACE_* */
+    uint64_t arg[2];
+} pmemTraceRecord;
+
+/* Disabled, the call is dead code: the arguments are type checked and
+ * count as used, but are not evaluated. */
+#ifdef TODIS_TRACE
+#define PMEM_TRACE_ENABLED 1
+#else
+#define PMEM_TRACE_ENABLED 0
+#endif
+
+void pmemTraceAdd(int event, uint64_t arg0, uint64_t arg1);
+#define pmemTrace(event,arg0,arg1) do { \
+    if (PMEM_TRACE_ENABLED) pmemTraceAdd((event), \
+        (uint64_t)(uintptr_t)(arg0), (uint64_t)(uintptr_t)(arg1)); \
+} while(0)
+
+void pmemTraceDump(long count, void (*fn)(void *privdata, const char *line),
+        void *privdata);
+void pmemTraceReset(void);
+void pmemTraceLogCrash(void);
+#endif
+
+#endif
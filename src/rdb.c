@@ -863,6 +863,9 @@ int rdbSave(char *filename) {
     rio rdb;
     int error = 0;
 
+#ifdef TODIS
+    pmemWarmupFinish();
+#endif
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
     if (!fp) {
@@ -920,6 +923,10 @@ int rdbSaveBackground(char *filename) {
     long long start;
 
     if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+#ifdef TODIS
+    /* The child must not touch the pmem nodes. */
+    pmemWarmupFinish();
+#endif
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "c42fc1fe"
+#define REDIS_GIT_DIRTY "394"
+#define REDIS_BUILD_ID "vm-1792285775"
@@ -41,6 +41,7 @@
 #ifdef USE_PMDK
 #include "server.h"
 #include "pmem_latency.h"
+#include "pmem_trace.h"
 #endif
 
 static inline int sdsHdrSize(char type) {
@@ -169,7 +170,7 @@ sds sdsnewlenPM(const void *init, size_t initlen) {
     sh = pmemobj_direct_latency(oid);
 
 #ifdef TODIS
-    serverLog(LL_TODIS, "TODIS, sdsnewlenPM sds size: %zu", totallen);
+    pmemTrace(PMEM_TRACE_SDS_NEW_PM, sh, totallen);
     server.used_pmem_memory += totallen;
 #endif
 
@@ -226,6 +227,67 @@ PMEMoid *sdsPMEMoidBackReference(sds s)
 }
 #endif
 
+#ifdef TODIS
+/* Strings built in place never use SDS_TYPE_5: it has no alloc field, so
+ * the spare bytes of the enclosing allocation could not be recorded. */
+static inline char sdsEmbedType(size_t initlen) {
+    char type = sdsReqType(initlen);
+
+    return type == SDS_TYPE_5 ? SDS_TYPE_8 : type;
+}
+
+/* Bytes taken by a string of 'initlen' bytes built with sdsnewlenAt(),
+ * header and null term included. */
+size_t sdsEmbedSize(size_t initlen) {
+    return sdsHdrSize(sdsEmbedType(initlen)) + initlen + 1;
+}
+
+/* Builds a string in 'buf', which is part of a larger allocation (see the
+ * PMEM key/value records). 'alloc' is the capacity of the string: 'buf'
+ * must hold sdsEmbedSize(initlen) + alloc - initlen bytes. The capacity is
+ * clamped to what the header picked for 'initlen' can represent. */
+sds sdsnewlenAt(void *buf, const void *init, size_t initlen, size_t alloc) {
+    char type = sdsEmbedType(initlen);
+    sds s = (char*)buf+sdsHdrSize(type);
+
+    if (alloc < initlen) alloc = initlen;
+    switch(type) {
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            if (alloc > UINT8_MAX) alloc = UINT8_MAX;
+            sh->len = initlen;
+            sh->alloc = alloc;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            if (alloc > UINT16_MAX) alloc = UINT16_MAX;
+            sh->len = initlen;
+            sh->alloc = alloc;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            if (alloc > UINT32_MAX) alloc = UINT32_MAX;
+            sh->len = initlen;
+            sh->alloc = alloc;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = initlen;
+            sh->alloc = alloc;
+            break;
+        }
+    }
+    s[-1] = type;
+    if (initlen && init)
+        memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+#endif
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -265,10 +327,10 @@ void sdsfreePM(sds s) {
     PMEMoid oid;
     if (s == NULL) return;
     if (server.persistent) {
-        oid.off = (uint64_t)((char*)s-sdsHdrSize(s[-1])) - sizeof(PMEMoid) - (uint64_t)server.pm_pool;
-        oid.pool_uuid_lo = server.pool_uuid_lo;
+        /* The pool of the allocation, that may not be the current shard. */
+        oid = pmemobj_oid((char*)s-sdsHdrSize(s[-1])-sizeof(PMEMoid));
 #ifdef TODIS
-        serverLog(LL_TODIS, "TODIS, sdsfreePM, sds size: %zu", sdsAllocSizePM(s));
+        pmemTrace(PMEM_TRACE_SDS_FREE_PM, s, sdsAllocSizePM(s));
         server.used_pmem_memory -= sdsAllocSizePM(s);
 #endif
         pmemobj_tx_free_latency(oid);
@@ -284,8 +346,8 @@ void sdsfreeVictim(sds s) {
     PMEMoid oid;
     if (s == NULL) return;
     if (server.persistent) {
-        oid.off = (uint64_t)((char*)s-sdsHdrSize(s[-1])) - sizeof(PMEMoid) - (uint64_t)server.pm_pool;
-        oid.pool_uuid_lo = server.pool_uuid_lo;
+        /* The pool of the allocation, that may not be the current shard. */
+        oid = pmemobj_oid((char*)s-sdsHdrSize(s[-1])-sizeof(PMEMoid));
         pmemobj_tx_free_latency(oid);
     } else {
         s_free((char*)s-sdsHdrSize(s[-1]));
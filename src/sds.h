@@ -270,6 +270,8 @@ size_t sdsAllocSize(sds s);
 #ifdef TODIS
 size_t sdsAllocSizePM(sds s);
 void sdsfreeVictim(sds s);
+size_t sdsEmbedSize(size_t initlen);
+sds sdsnewlenAt(void *buf, const void *init, size_t initlen, size_t alloc);
 #endif
 void *sdsAllocPtr(sds s);
 
@@ -57,6 +57,9 @@
 
 #ifdef TODIS
 #include "pmem_latency.h"
+#include "pmem_trace.h"
+#include "pmem_spill.h"
+#include "pmem_cache.h"
 #endif
 
 /* Our shared "common" objects */
@@ -304,6 +307,9 @@ struct redisCommand redisCommandTable[] = {
     {"aofset",aofSetCommand,-3,"wm",0,NULL,1,1,1,0,0},
     {"pmprocesstime",getPmemProcessTimeCommand,1,"r",0,NULL,0,0,0,0,0},
     {"pmemstatus",getPmemStatusCommand,-1,"r",0,NULL,0,0,0,0,0},
+    {"pmemlatency",pmemLatencyCommand,-1,"as",0,NULL,0,0,0,0,0},
+    {"pmemtrace",pmemTraceCommand,-1,"as",0,NULL,0,0,0,0,0},
+    {"pmemaddpart",pmemAddPartCommand,3,"as",0,NULL,0,0,0,0,0},
     {"dramstatus",getDramStatusCommand,-1,"r",0,NULL,0,0,0,0,0},
     {"lpmemstatus",getListPmemStatusCommand,1,"r",0,NULL,0,0,0,0,0},
     {"rlpmemstatus",getReverseListPmemStatusCommand,1,"r",0,NULL,0,0,0,0,0},
@@ -319,8 +325,15 @@ struct evictionPoolEntry *evictionPoolAlloc(void);
 /* Low level logging. To use only for very big messages, otherwise
  * serverLog() is to prefer. */
 void serverLogRaw(int level, const char *msg) {
+#ifdef TODIS
+    /* LL_TODIS shifts the other levels by one. */
+    const int syslogLevelMap[] = { LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_NOTICE,
+                                   LOG_WARNING };
+    const char *c = "T.-*#";
+#else
     const int syslogLevelMap[] = { LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING };
     const char *c = ".-*#";
+#endif
     FILE *fp;
     char buf[64];
     int rawmode = (level & LL_RAW);
@@ -534,10 +547,12 @@ void dictObjectDestructorPM(void *privdata, dictEntry *entry, void *val)
 
 #ifdef TODIS
 void dictObjectDestructorTODIS(void *privdata, dictEntry *entry, void *val) {
-    if (entry->location == LOCATION_DRAM)
+    if (entry->location == LOCATION_DRAM) {
         dictObjectDestructor(privdata, entry, val);
-    else
+    } else {
+        pmemCacheDrop(entry);
         dictObjectDestructorPM(privdata, entry, val);
+    }
 }
 #endif
 
@@ -557,7 +572,13 @@ void dictSdsDestructorPM(void *privdata, dictEntry *entry, void *val)
 
     TX_BEGIN(server.pm_pool) {
         kv_PM_oid = sdsPMEMoidBackReference(val);
+#ifdef TODIS
+        pmemIndexRemove(*kv_PM_oid);
+        /* A record key goes with its node. */
+        if (!pmemNodeEmbedsKey(*kv_PM_oid)) sdsfreePM(val);
+#else
         sdsfreePM(val);
+#endif
         pmemRemoveFromPmemList(*kv_PM_oid);
     } TX_ONABORT {
         serverLog(LL_WARNING,"ERROR: removing an element from PM failed (%s)", __func__);
@@ -567,10 +588,12 @@ void dictSdsDestructorPM(void *privdata, dictEntry *entry, void *val)
 
 #ifdef TODIS
 void dictSdsDestructorTODIS(void *privdata, dictEntry *entry, void *val) {
-    if (entry->location == LOCATION_DRAM)
+    if (entry->location == LOCATION_DRAM) {
         dictSdsDestructor(privdata, entry, val);
-    else
+    } else {
+        pmemLruUnlink(entry);
         dictSdsDestructorPM(privdata, entry, val);
+    }
 }
 #endif
 
@@ -857,7 +880,9 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
         robj *keyobj = createStringObject(key,sdslen(key));
 
 #ifdef TODIS
-        propagateExpireTODIS(db, de);
+        /* 'de' belongs to the expires dict: the tier of the key is the one
+         * of its entry in the main dict. */
+        propagateExpireTODIS(db, dictFind(db->dict,key));
 #else
         propagateExpire(db,keyobj);
 #endif
@@ -974,6 +999,11 @@ void activeExpireCycle(int type) {
             if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
                 num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
 
+#ifdef TODIS
+            /* The PMEM records of the keys expired by a loop are freed in
+             * a single transaction. */
+            int pmem_batch = server.persistent ? pmemBatchBegin() : 0;
+#endif
             while (num--) {
                 dictEntry *de;
                 long long ttl;
@@ -987,6 +1017,9 @@ void activeExpireCycle(int type) {
                     ttl_samples++;
                 }
             }
+#ifdef TODIS
+            pmemBatchCommit(pmem_batch);
+#endif
 
             /* Update the average TTL stats for this database. */
             if (ttl_samples) {
@@ -1153,6 +1186,20 @@ void databasesCron(void) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
 
+#ifdef TODIS
+    /* Demote PMEM keys between the eviction watermarks. */
+    pmemEvictionCron();
+
+    /* Move keys between DRAM and PMEM by access frequency. */
+    pmemTieringCron();
+
+    /* Materialize the keys the lazy reconstruction did not reach yet. */
+    if (server.pmem_warming) pmemWarmupCron();
+
+    /* Free the victims of the fsynced epochs. */
+    pmemReclaimCron();
+#endif
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
@@ -1236,6 +1283,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 server.stat_net_input_bytes);
         trackInstantaneousMetric(STATS_METRIC_NET_OUTPUT,
                 server.stat_net_output_bytes);
+#ifdef TODIS
+        trackInstantaneousMetric(STATS_METRIC_PMEM_EVICTED,
+                server.stat_pmem_evicted_keys);
+#endif
     }
 
     /* We have just LRU_BITS bits per object for LRU information.
@@ -1476,6 +1527,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+#ifdef TODIS
+    /* Free the cached values dropped while serving commands. */
+    pmemCacheFreeDropped();
+#endif
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
@@ -1614,10 +1670,59 @@ void initServerConfig(void) {
     server.used_pmem_memory = 0;
     server.max_used_pmem_memory = 0;
     server.max_pmem_memory = CONFIG_DEFAULT_MAX_PMEM_MEMORY_SIZE;
-    server.pmem_fire_evict_percent = 0;
+    server.pmem_fire_evict_percent = CONFIG_DEFAULT_PMEM_FIRE_EVICT_PERCENT;
+    server.pmem_stop_evict_percent = CONFIG_DEFAULT_PMEM_STOP_EVICT_PERCENT;
+    server.pmem_evicting = 0;
     server.max_pmem_memory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.pmem_victim_count = CONFIG_MIN_PMEM_VICTIM_COUNT;
+    server.pmem_reconstruct_threads = CONFIG_DEFAULT_PMEM_RECONSTRUCT_THREADS;
+    server.pmem_lazy_reconstruct = CONFIG_DEFAULT_PMEM_LAZY_RECONSTRUCT;
+    server.pmem_write_path = CONFIG_DEFAULT_PMEM_WRITE_PATH;
+    server.pmem_group_commit = CONFIG_DEFAULT_PMEM_GROUP_COMMIT;
+    server.pmem_spill_log = CONFIG_DEFAULT_PMEM_SPILL_LOG;
+    server.pmem_spill_fd = -1;
+    server.pmem_spill_size = 0;
+    server.pmem_spill_rewrite_base = -1;
+    server.pmem_group_open = 0;
+    server.pmem_group_need = 0;
+    server.pmem_index_buckets = CONFIG_DEFAULT_PMEM_INDEX_BUCKETS;
+    server.pmem_boot_gen = 0;
+    server.pmem_warming = 0;
+    server.pmem_warmup_shard = 0;
+    server.pmem_reclaim_epoch = 0;
+    server.pmem_reclaim_durable = 0;
+    server.pm_num_shards = 0;
+    server.pm_shard = NULL;
+    server.pmem_batch_open = 0;
+    server.pmem_warmup_keys = 0;
+    server.pmem_warmup_start = 0;
+    server.pmem_reconstruct_time = 0;
     server.todis_log_only = CONFIG_DEFAULT_TODIS_LOG_ONLY;
+    server.pmem_volatile_lru = CONFIG_DEFAULT_PMEM_VOLATILE_LRU;
+    server.pmem_lru_head = NULL;
+    server.pmem_lru_tail = NULL;
+    server.pmem_clock_hand = NULL;
+    server.pmem_entries = NULL;
+    server.pmem_entries_len = 0;
+    server.pmem_entries_size = 0;
+    server.pmem_read_cache_size = CONFIG_DEFAULT_PMEM_READ_CACHE_SIZE;
+    server.pmem_cache_slots = NULL;
+    server.pmem_cache_len = 0;
+    server.pmem_cache_size = 0;
+    server.pmem_cache_hand = 0;
+    server.pmem_cache_used = 0;
+    server.pmem_tiering = CONFIG_DEFAULT_PMEM_TIERING;
+    server.pmem_lfu_log_factor = CONFIG_DEFAULT_PMEM_LFU_LOG_FACTOR;
+    server.pmem_lfu_decay_time = CONFIG_DEFAULT_PMEM_LFU_DECAY_TIME;
+    server.pmem_promote_per_sec = CONFIG_DEFAULT_PMEM_PROMOTE_PER_SEC;
+    server.pmem_demote_per_sec = CONFIG_DEFAULT_PMEM_DEMOTE_PER_SEC;
+    server.pmem_tier_promote_credit = 0;
+    server.pmem_tier_demote_credit = 0;
+    server.pmem_tier_db = 0;
+    server.pmem_lru_clock = 0;
+    server.pm_read_latency = CONFIG_DEFAULT_PM_READ_LATENCY;
+    server.pm_write_latency = CONFIG_DEFAULT_PM_WRITE_LATENCY;
+    server.pm_write_bandwidth = CONFIG_DEFAULT_PM_WRITE_BANDWIDTH;
 #endif
     server.supervised = 0;
     server.supervised_mode = SUPERVISED_NONE;
@@ -1728,6 +1833,7 @@ void initServerConfig(void) {
     populateCommandTable();
 #ifdef TODIS
     server.aofSetCommand = lookupCommandByCString("aofset");
+    server.pexpireatCommand = lookupCommandByCString("pexpireat");
 #endif
     server.delCommand = lookupCommandByCString("del");
     server.multiCommand = lookupCommandByCString("multi");
@@ -1985,6 +2091,20 @@ void resetServerStats(void) {
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
+#ifdef TODIS
+    server.stat_dram_hits = 0;
+    server.stat_pmem_hits = 0;
+    server.stat_pmem_evicted_keys = 0;
+    server.stat_pmem_promoted_keys = 0;
+    server.stat_pmem_reclaimed_victims = 0;
+    server.stat_pmem_spill_records = 0;
+    server.stat_pmem_cache_hits = 0;
+    server.stat_pmem_cache_misses = 0;
+    server.stat_pmem_cache_evictions = 0;
+    server.stat_pmem_tier_promoted = 0;
+    server.stat_pmem_tier_demoted = 0;
+    pmemTxLatencyReset();
+#endif
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
@@ -2062,7 +2182,7 @@ void initServer(void) {
     for (j = 0; j < server.dbnum; j++) {
 #if defined(TODIS) && defined(USE_PMDK)
         if (server.persistent) {
-            server.db[j].dict = dictCreate(&dbDictTypeTODIS, NULL);
+            server.db[j].dict = dictCreate(&dbDictTypeTODIS, &server.db[j]);
             pm_type_root_type_id = TOID_TYPE_NUM(struct redis_pmem_root);
             pm_type_key_val_pair_PM = TOID_TYPE_NUM(struct key_val_pair_PM);
         }
@@ -2082,7 +2202,15 @@ void initServer(void) {
         server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+#ifdef TODIS
+        server.db[j].pmem_cold_keys = 0;
+#endif
     }
+#ifdef TODIS
+    server.pmem_reclaim_queue = listCreate();
+    server.pmem_cache_to_free = listCreate();
+    server.pmem_eviction_pool = evictionPoolAlloc();
+#endif
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
@@ -2140,6 +2268,13 @@ void initServer(void) {
             exit(1);
         }
     }
+#ifdef TODIS
+    server.pmem_spill_filename =
+        sdscatfmt(sdsempty(),"%s.spill",server.aof_filename);
+    server.pmem_spill_buf = sdsempty();
+    if (server.aof_state == AOF_ON && server.pmem_spill_log &&
+        pmemSpillOpen() == C_ERR) exit(1);
+#endif
 
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
@@ -2418,6 +2553,9 @@ void call(client *c, int flags) {
     /* Call the command. */
     dirty = server.dirty;
     start = ustime();
+#ifdef TODIS
+    selectCommandShardPM(c->db,c->cmd,c->argv,c->argc);
+#endif
     c->cmd->proc(c);
     duration = ustime()-start;
     dirty = server.dirty-dirty;
@@ -2741,6 +2879,10 @@ int prepareForShutdown(int flags) {
     int nosave = flags & SHUTDOWN_NOSAVE;
 
     serverLog(LL_WARNING,"User requested shutdown...");
+#ifdef TODIS
+    /* Commit the writes of the batch of the SHUTDOWN command. */
+    pmemGroupCommit();
+#endif
 
     /* Kill all the Lua debugger forked sessions. */
     ldbKillForkedSessions();
@@ -2771,6 +2913,9 @@ int prepareForShutdown(int flags) {
         /* Append only file: fsync() the AOF and exit */
         serverLog(LL_NOTICE,"Calling fsync() on the AOF file.");
 #ifdef TODIS
+        /* The SHUTDOWN command itself may have demoted keys: their records
+         * must reach the file before their victims are freed. */
+        flushAppendOnlyFile(1);
         aofFsyncWithFlushVictim(server.aof_fd);
 #else
         aof_fsync(server.aof_fd);
@@ -3236,6 +3381,17 @@ sds genRedisInfoString(char *section) {
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
+#ifdef TODIS
+            if (server.pmem_spill_fd != -1) {
+                info = sdscatprintf(info,
+                    "pmem_spill_log_size:%lld\r\n"
+                    "pmem_spill_buffer_length:%zu\r\n"
+                    "pmem_spill_records:%lld\r\n",
+                    (long long) server.pmem_spill_size,
+                    sdslen(server.pmem_spill_buf),
+                    server.stat_pmem_spill_records);
+            }
+#endif
         }
 
         if (server.loading) {
@@ -3477,6 +3633,133 @@ sds genRedisInfoString(char *section) {
         server.cluster_enabled);
     }
 
+#ifdef TODIS
+    /* Tiering */
+    if (server.persistent &&
+        (allsections || defsections || !strcasecmp(section,"tiering")))
+    {
+        long long lookups = server.stat_dram_hits + server.stat_pmem_hits +
+            server.stat_keyspace_misses;
+        uint64_t allocated = 0, victims = 0;
+        int stats = 0;
+
+        for (int i = 0; i < server.pm_num_shards; i++) {
+            uint64_t shard_allocated;
+
+            victims += pmemShardRoot(server.pm_shards + i)->num_victim_entries;
+            if (pmemobj_ctl_get(server.pm_shards[i].pool,
+                    "stats.heap.curr_allocated", &shard_allocated) == 0)
+            {
+                allocated += shard_allocated;
+                stats++;
+            }
+        }
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Tiering\r\n"
+            "used_pmem_memory:%zu\r\n"
+            "used_pmem_memory_peak:%zu\r\n"
+            "max_pmem_memory:%zu\r\n"
+            "pmem_pool_size:%zu\r\n",
+            server.used_pmem_memory,
+            server.max_used_pmem_memory,
+            server.max_pmem_memory,
+            server.pm_file_size);
+        /* Bytes actually allocated in the pool, with the headers of the
+         * allocations and the values outgrown by an overwrite. */
+        if (stats == server.pm_num_shards) {
+            info = sdscatprintf(info,
+                "pmem_allocator_used:%llu\r\n"
+                "pmem_allocator_overhead_ratio:%.2f\r\n",
+                (unsigned long long)allocated,
+                server.used_pmem_memory ?
+                    (double)allocated/server.used_pmem_memory : 0);
+        }
+        info = sdscatprintf(info,
+            "dram_keyspace_hits:%lld\r\n"
+            "pmem_keyspace_hits:%lld\r\n"
+            "dram_hit_ratio:%.4f\r\n"
+            "pmem_hit_ratio:%.4f\r\n"
+            "pmem_evicted_keys:%lld\r\n"
+            "pmem_evicted_keys_per_sec:%lld\r\n"
+            "pmem_promoted_keys:%lld\r\n"
+            "pmem_evicting:%d\r\n"
+            "pmem_victim_list_length:%zu\r\n"
+            "pmem_pending_victim_frees:%zu\r\n"
+            "pmem_reclaim_segments:%lu\r\n"
+            "pmem_reclaim_epoch:%llu\r\n"
+            "pmem_reclaim_durable_epoch:%llu\r\n"
+            "pmem_reclaim_lag_ms:%lld\r\n"
+            "pmem_reclaimed_victims:%lld\r\n"
+            "pmem_commits:%llu\r\n"
+            "pmem_commit_p50_ns:%llu\r\n"
+            "pmem_commit_p90_ns:%llu\r\n"
+            "pmem_commit_p99_ns:%llu\r\n"
+            "pmem_commit_p999_ns:%llu\r\n"
+            "pmem_reconstruct_time_ms:%lld\r\n"
+            "pmem_warming:%d\r\n"
+            "pmem_warmup_keys:%lu\r\n"
+            "pmem_read_cache_size:%llu\r\n"
+            "pmem_read_cache_used:%zu\r\n"
+            "pmem_read_cache_keys:%lu\r\n"
+            "pmem_read_cache_hits:%lld\r\n"
+            "pmem_read_cache_misses:%lld\r\n"
+            "pmem_read_cache_hit_ratio:%.4f\r\n"
+            "pmem_read_cache_evictions:%lld\r\n"
+            "pmem_tiering:%s\r\n"
+            "pmem_tier_promoted_keys:%lld\r\n"
+            "pmem_tier_demoted_keys:%lld\r\n",
+            server.stat_dram_hits,
+            server.stat_pmem_hits,
+            lookups ? (double)server.stat_dram_hits/lookups : 0,
+            lookups ? (double)server.stat_pmem_hits/lookups : 0,
+            server.stat_pmem_evicted_keys,
+            getInstantaneousMetric(STATS_METRIC_PMEM_EVICTED),
+            server.stat_pmem_promoted_keys,
+            server.pmem_evicting,
+            (size_t)victims,
+            /* Every victim is freed once its epoch is durable. */
+            (size_t)victims,
+            listLength(server.pmem_reclaim_queue),
+            (unsigned long long)server.pmem_reclaim_epoch,
+            (unsigned long long)__atomic_load_n(&server.pmem_reclaim_durable,
+                                                __ATOMIC_ACQUIRE),
+            pmemReclaimLag(),
+            server.stat_pmem_reclaimed_victims,
+            (unsigned long long)pmemTxLatencyCount(),
+            (unsigned long long)pmemTxLatencyPercentile(50),
+            (unsigned long long)pmemTxLatencyPercentile(90),
+            (unsigned long long)pmemTxLatencyPercentile(99),
+            (unsigned long long)pmemTxLatencyPercentile(99.9),
+            server.pmem_reconstruct_time/1000,
+            server.pmem_warming,
+            server.pmem_warmup_keys,
+            server.pmem_read_cache_size,
+            server.pmem_cache_used,
+            server.pmem_cache_len,
+            server.stat_pmem_cache_hits,
+            server.stat_pmem_cache_misses,
+            (server.stat_pmem_cache_hits+server.stat_pmem_cache_misses) ?
+                (double)server.stat_pmem_cache_hits/
+                (server.stat_pmem_cache_hits+server.stat_pmem_cache_misses) : 0,
+            server.stat_pmem_cache_evictions,
+            server.pmem_tiering == PMEM_TIERING_LFU ? "lfu" : "none",
+            server.stat_pmem_tier_promoted,
+            server.stat_pmem_tier_demoted);
+        info = sdscatprintf(info, "pmem_shards:%d\r\n", server.pm_num_shards);
+        for (int i = 0; i < server.pm_num_shards; i++) {
+            struct redis_pmem_root *root = pmemShardRoot(server.pm_shards + i);
+
+            info = sdscatprintf(info,
+                "pmem_shard%d:path=%s,size=%zu,keys=%llu,victims=%llu\r\n",
+                i, server.pm_shards[i].path, server.pm_shards[i].size,
+                (unsigned long long)root->num_dict_entries,
+                (unsigned long long)root->num_victim_entries);
+        }
+    }
+#endif
+
     /* Key space */
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3486,11 +3769,25 @@ sds genRedisInfoString(char *section) {
 
             keys = dictSize(server.db[j].dict);
             vkeys = dictSize(server.db[j].expires);
+#ifdef TODIS
+            keys += server.db[j].pmem_cold_keys;
+            if (keys || vkeys) {
+                info = sdscatprintf(info,
+                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld",
+                    j, keys, vkeys, server.db[j].avg_ttl);
+                if (server.persistent)
+                    info = sdscatprintf(info, ",pmem=%lu",
+                        dictSizePM(server.db[j].dict) +
+                        server.db[j].pmem_cold_keys);
+                info = sdscatlen(info, "\r\n", 2);
+            }
+#else
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
                     j, keys, vkeys, server.db[j].avg_ttl);
             }
+#endif
         }
     }
     return info;
@@ -3578,6 +3875,18 @@ struct evictionPoolEntry *evictionPoolAlloc(void) {
  * right. */
 
 #define EVICTION_SAMPLES_ARRAY_SIZE 16
+
+/* Idle time of 'o' ranking it in an eviction pool. With pmem-tiering lfu
+ * the lru field holds the access counter instead of the LRU clock: the
+ * least frequently used keys rank as the most idle. */
+static unsigned long long evictionPoolIdle(robj *o) {
+#ifdef TODIS
+    if (server.pmem_tiering == PMEM_TIERING_LFU)
+        return 255 - LFUDecrAndReturn(o);
+#endif
+    return estimateObjectIdleTime(o);
+}
+
 void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *_samples[EVICTION_SAMPLES_ARRAY_SIZE];
@@ -3605,7 +3914,7 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
          * again in the key dictionary to obtain the value object. */
         if (sampledict != keydict) de = dictFind(keydict, key);
         o = dictGetVal(de);
-        idle = estimateObjectIdleTime(o);
+        idle = evictionPoolIdle(o);
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -3651,8 +3960,11 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
-void evictionPoolPopulatePM(dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+ * right.
+ *
+ * PMEM entries are sampled from the first 'avail' slots of the dense
+ * server.pmem_entries array instead of a dict. */
+void evictionPoolPopulatePM(struct evictionPoolEntry *pool, unsigned long avail) {
     int j, k, count;
     dictEntry *_samples[EVICTION_SAMPLES_ARRAY_SIZE];
     dictEntry **samples;
@@ -3665,7 +3977,10 @@ void evictionPoolPopulatePM(dict *sampledict, dict *keydict, struct evictionPool
         samples = zmalloc(sizeof(samples[0])*server.maxmemory_samples);
     }
 
-    count = dictGetSomeKeysPM(sampledict,samples,server.maxmemory_samples);
+    count = avail < (unsigned long) server.maxmemory_samples ?
+        (int) avail : server.maxmemory_samples;
+    for (j = 0; j < count; j++)
+        samples[j] = server.pmem_entries[random() % avail]->de;
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -3674,12 +3989,8 @@ void evictionPoolPopulatePM(dict *sampledict, dict *keydict, struct evictionPool
 
         de = samples[j];
         key = dictGetKey(de);
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (sampledict != keydict) de = dictFind(keydict, key);
         o = dictGetVal(de);
-        idle = estimateObjectIdleTime(o);
+        idle = evictionPoolIdle(o);
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -3713,6 +4024,7 @@ void evictionPoolPopulatePM(dict *sampledict, dict *keydict, struct evictionPool
         }
         pool[k].key = sdsdup(key);
         pool[k].idle = idle;
+        pool[k].dbid = getPMObjectFromOid(*sdsPMEMoidBackReference(key))->dbid;
     }
     if (samples != _samples) zfree(samples);
 }
@@ -3886,143 +4198,353 @@ int freeMemoryIfNeeded(void) {
 }
 
 #ifdef TODIS
-int freePmemMemoryIfNeeded(void) {
+/* Demotes the PMEM keys of the pmem-victim-count 'victim_oids' to DRAM,
+ * logging them to the AOF, and moves their nodes to the victim lists.
+ * OID_NULL slots are skipped. Returns the PMEM bytes freed, or -1 if a
+ * victim has no entry and nothing was demoted. */
+static long long pmemDemoteVictims(PMEMoid *victim_oids) {
+    /* Live across the setjmp() of the transactions below. */
+    volatile long long pmem_freed = 0;
+    int keys_freed = 0;
+
+    for (size_t i = 0; i < server.pmem_victim_count; ++i) {
+        PMEMoid victim_oid = victim_oids[i];
+        dictEntry *victim_de;
+        redisDb *db = NULL;
+
+        if (OID_IS_NULL(victim_oid))
+            continue;
+
+        /* The PMEM node knows its db and dict entry. */
+        victim_de = pmemGetVictimEntry(victim_oid, &db);
+        if (victim_de == NULL) {
+            if (keys_freed)
+                continue;
+            serverLog(LL_TODIS, "TODIS_ERROR, Victim entry is not exist");
+            return -1; /* Nothing to free... */
+        }
+
+        /* Finally demote the selected key. */
+        pmemTrace(PMEM_TRACE_EVICT_KEY, victim_de,
+                  sizeOfPmemNode(victim_oid));
+
+        sds bestkey = dictGetKey(victim_de);
+        robj *bestval = (robj *) dictGetVal(victim_de);
+
+        /* The PMEM key and value stay referenced by the victim node
+         * until the AOF is flushed: switch the entry to DRAM copies,
+         * reusing the dictEntry and the value object. */
+        sds dramkey = sdsdup(bestkey);
+        pmemLruUnlink(victim_de);
+        if (bestval->encoding != OBJ_ENCODING_INT) {
+            bestval->ptr = sdsdup(bestval->ptr);
+            bestval->encoding = OBJ_ENCODING_RAW;
+        }
+        dictDemoteEntryPM(db->dict, victim_de, dramkey, bestval);
+
+        /* Expires share the key sds with the main dict. */
+        long long expire = -1;
+        if (dictSize(db->expires) > 0) {
+            dictEntry *expire_de = dictFind(db->expires, bestkey);
+            if (expire_de != NULL) {
+                dictSetKey(db->expires, expire_de, dramkey);
+                expire = dictGetSignedIntegerVal(expire_de);
+            }
+        }
+        server.used_pmem_memory -= sizeOfPmemNode(victim_oid);
+
+        /* Evicts to aof logs. */
+        robj dramkeyobj;
+        initStaticStringObject(dramkeyobj, dramkey);
+        feedAppendOnlyFileTODIS(db, &dramkeyobj, bestval, expire);
+
+        /* Adds freed memory proportion. */
+        pmem_freed += sizeOfPmemNode(victim_oid);
+        server.stat_pmem_evicted_keys++;
+        keys_freed++;
+    }
+
+    /* (TIER 2) Evict PMEM node from PMEM list to Victim list, in each
+     * shard the victims of the shard. */
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        pmemShardSelect(server.pm_shards + i);
+        TX_BEGIN(server.pm_pool) {
+            evictPmemNodesToVictimList(victim_oids);
+        } TX_ONABORT {
+            serverLog(
+                    LL_TODIS,
+                    "TODIS_ERROR: evict pmem node to victim list failed (%s)",
+                    __func__);
+        } TX_END
+    }
+    return pmem_freed;
+}
+
+/* Demotes batches of pmem-victim-count PMEM keys to DRAM until the used
+ * pmem memory drops to 'target' bytes. If 'timelimit' (microseconds) is
+ * positive, stops once it is exhausted even if the target was not reached. */
+static int pmemEvictUntil(size_t target, long long timelimit) {
     /* Compute how much pmem memory we need to free. */
     size_t pmem_used = pmem_used_memory();
-    size_t pmem_tofree = pmem_used - server.max_pmem_memory;;
-    /*
-    if (server.pmem_fire_evict_percent > 0) {
-        pmem_tofree = pmem_used - server.pm_file_size * server.pmem_fire_evict_percent / 100;
-    } else {
-        pmem_tofree = pmem_used - server.max_pmem_memory;
-    }
-    */
+    size_t pmem_tofree;
     size_t pmem_freed = 0;
+    long long start = ustime();
 
-    /* Check if we are over the persistent memory limit. */
-    /*
-    if (
-        (
-            server.pmem_fire_evict_percent > 0 &&
-            pmem_used <= server.pm_file_size * server.pmem_fire_evict_percent / 100
-        ) ||
-        (
-            server.pmem_fire_evict_percent <= 0 &&
-            pmem_used <= server.max_pmem_memory
-        )
-    ) {
-        return C_OK;
+    if (pmem_used <= target) return C_OK;
+    pmem_tofree = pmem_used - target;
+    pmemTrace(PMEM_TRACE_EVICT_START, pmem_used, pmem_tofree);
+
+    while (pmem_freed < pmem_tofree) {
+        if (timelimit > 0 && ustime() - start > timelimit) break;
+        long long freed;
+
+        /* Find a victim key. */
+        PMEMoid *victim_oids = zmalloc(sizeof(PMEMoid) * server.pmem_victim_count);
+        if (getBestEvictionKeysPMEMoid(victim_oids) == C_ERR) {
+            zfree(victim_oids);
+            return C_ERR;
+        }
+
+        freed = pmemDemoteVictims(victim_oids);
+        zfree(victim_oids);
+        if (freed < 0) return C_ERR;
+        pmem_freed += freed;
     }
-    */
-    if (pmem_used <= server.max_pmem_memory) {
+    return C_OK;
+}
+
+/* Called before every command: evict synchronously only when the hard
+ * limit max-pmem-memory is exceeded, the watermarks are handled by
+ * pmemEvictionCron(). */
+int freePmemMemoryIfNeeded(void) {
+    if (pmem_used_memory() <= server.max_pmem_memory)
         return C_OK;
-    }
 
     if (server.max_pmem_memory_policy == MAXMEMORY_NO_EVICTION)
         return C_ERR; /* We need to free pmem memory, but policy forbids. */
 
-    serverLog(LL_TODIS, "##############################");
-    serverLog(LL_TODIS, "TODIS, pmem eviction is fired.");
-    // serverLog(LL_NOTICE, "TODIS, pmem eviction is fired.");
+    return pmemEvictUntil(server.max_pmem_memory, 0);
+}
 
-    while (pmem_freed < pmem_tofree) {
-        serverLog(LL_TODIS, "TODIS, pmem freed: %zu, pmem tofree: %zu", pmem_freed, pmem_tofree);
-        int keys_freed = 0;
-        dictEntry *victim_de = NULL;
-        redisDb *db = NULL;
+/* Watermarks of the background pmem eviction in bytes. Both percents are
+ * relative to max-pmem-memory; the low watermark defaults to ten points
+ * below the high one. */
+static size_t pmemHighWatermark(void) {
+    return server.max_pmem_memory / 100 * server.pmem_fire_evict_percent;
+}
 
-        /* Find a victim key. */
-        PMEMoid *victim_oids = zmalloc(sizeof(PMEMoid) * server.pmem_victim_count);
-        if (getBestEvictionKeysPMEMoid(victim_oids) == C_ERR)
-            return C_ERR;
+static size_t pmemLowWatermark(void) {
+    size_t percent = server.pmem_stop_evict_percent;
 
-        for (size_t i = 0; i < server.pmem_victim_count; ++i) {
-            PMEMoid victim_oid = victim_oids[i];
-            if (OID_IS_NULL(victim_oid))
-                continue;
-            sds victim_key = getKeyFromOid(victim_oid);
-            if (victim_key == NULL) return C_ERR;
-            /* Find victim dict entry */
-            for (int j = 0; j < server.dbnum; j++) {
-                /* Find expired first. */
-                victim_de = dictFind(server.db[j].expires, victim_key);
-                if (victim_de != NULL) {
-                    db = &server.db[j];
-                    break;
-                }
-                victim_de = dictFind(server.db[j].dict, victim_key);
-                if (victim_de != NULL) {
-                    db = &server.db[j];
-                    break;
-                }
-            }
+    if (percent == 0 || percent >= server.pmem_fire_evict_percent) {
+        percent = server.pmem_fire_evict_percent > 10 ?
+            server.pmem_fire_evict_percent - 10 : 1;
+    }
+    return server.max_pmem_memory / 100 * percent;
+}
 
-            if (db == NULL || victim_de == NULL) {
-                if (keys_freed)
-                    continue;
-                serverLog(LL_TODIS, "TODIS_ERROR, Victim entry is not exist");
-                return C_ERR; /* Nothing to free... */
-            }
+/* Incremental pmem eviction called by databasesCron(). Once the usage
+ * crosses the high watermark (pmem-fire-evict-percent), every cron cycle
+ * evicts for at most PMEM_EVICT_CYCLE_SLOW_TIME_PERC percent of the cycle
+ * time, until the usage falls below the low watermark
+ * (pmem-stop-evict-percent). */
+void pmemEvictionCron(void) {
+    long long timelimit;
+
+    if (server.pmem_fire_evict_percent == 0 ||
+        server.max_pmem_memory_policy == MAXMEMORY_NO_EVICTION) {
+        server.pmem_evicting = 0;
+        return;
+    }
 
-            /* Finally remove the selected key. */
-            serverLog(LL_TODIS, "TODIS, start to replace eviction entry: %p", victim_de);
+    if (!server.pmem_evicting) {
+        if (pmem_used_memory() <= pmemHighWatermark()) return;
+        server.pmem_evicting = 1;
+    }
 
-            sds bestkey = dictGetKey(victim_de);
-            robj *bestval = (robj *) dictGetVal(victim_de);
+    timelimit = 1000000*PMEM_EVICT_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
 
-            serverLog(
-                    LL_TODIS,
-                    "TODIS, eviction bestkey: %s, bestval: %s",
-                    (sds) bestkey,
-                    (sds) bestval->ptr);
+    if (pmemEvictUntil(pmemLowWatermark(), timelimit) == C_ERR ||
+        pmem_used_memory() <= pmemLowWatermark()) {
+        server.pmem_evicting = 0;
+    }
+}
 
-            robj *dramval = createStringObject(sdsdup(bestval->ptr), sdslen(bestval->ptr));
+/* A key sampled by the tiering pass and its access frequency. */
+typedef struct pmemTierSample {
+    dictEntry *de;
+    redisDb *db;
+    unsigned long freq;
+} pmemTierSample;
 
-            serverLog(
-                    LL_TODIS,
-                    "TODIS, eviction dramkey: %s, dramval: %s",
-                    (sds) bestkey,
-                    (sds) dramval->ptr);
+static int pmemTierHotFirst(const void *a, const void *b) {
+    const pmemTierSample *sa = a, *sb = b;
 
-            robj *keyobj = createStringObject(sdsdup(bestkey), sdslen(bestkey));
+    return (sa->freq < sb->freq) - (sa->freq > sb->freq);
+}
 
-            /* Unlink PMEM dictEntry from DB. */
-            dictEntry *pmementry = dbDeleteNoFree(db, keyobj);
+static int pmemTierColdFirst(const void *a, const void *b) {
+    return pmemTierHotFirst(b, a);
+}
+
+/* Keys a tiering pass may move for a per second budget, at server.hz
+ * passes per second. The remainder is carried to the next passes. */
+static long long pmemTierAllowance(long long per_sec, long long *credit) {
+    long long allowance;
+
+    *credit += per_sec;
+    allowance = *credit / server.hz;
+    *credit %= server.hz;
+    return allowance;
+}
 
-            /* Free pmem dictEntry
-             * This is not free key and val.
-             * Just free a pmem dictEntry itself. */
-            zfree(pmementry);
-            decrRefCount(keyobj);
-            server.used_pmem_memory -= sizeOfPmemNode(victim_oid);
+/* Samples up to PMEM_TIER_SAMPLES DRAM string keys, the dbs taking turns.
+ * Only strings can live in PMEM. */
+static int pmemTierSampleDRAM(pmemTierSample *samples) {
+    dictEntry *des[PMEM_TIER_SAMPLES];
+    int count = 0;
 
-            /* Adds DRAM dictEntry to DB. */
-            robj *dramkeyobj = createStringObject(bestkey, sdslen(bestkey));
-            dbAdd(db, dramkeyobj, dramval);
+    for (int j = 0; j < server.dbnum && count < PMEM_TIER_SAMPLES; j++) {
+        redisDb *db = server.db + server.pmem_tier_db;
+        unsigned int n;
 
-            /* Evicts to aof logs. */
-            feedAppendOnlyFileTODIS(db, dramkeyobj, dramval);
-            decrRefCount(dramkeyobj);
+        server.pmem_tier_db = (server.pmem_tier_db + 1) % server.dbnum;
+        if (dictSize(db->dict) == dictSizePM(db->dict)) continue;
+        n = dictGetSomeKeys(db->dict, des, PMEM_TIER_SAMPLES);
+        for (unsigned int k = 0; k < n && count < PMEM_TIER_SAMPLES; k++) {
+            robj *val = dictGetVal(des[k]);
 
-            /* Adds freed memory proportion. */
-            pmem_freed += sizeOfPmemNode(victim_oid);
-            keys_freed++;
+            if (des[k]->location != LOCATION_DRAM || val->type != OBJ_STRING)
+                continue;
+            samples[count].de = des[k];
+            samples[count].db = db;
+            samples[count].freq = LFUDecrAndReturn(val);
+            count++;
         }
+    }
+    return count;
+}
 
-        /* (TIER 2) Evict PMEM node from PMEM list to Victim list. */
-        TX_BEGIN(server.pm_pool) {
-            evictPmemNodesToVictimList(victim_oids);
-        } TX_ONABORT {
-            serverLog(
-                    LL_TODIS,
-                    "TODIS_ERROR: evict pmem node to victim list failed (%s)",
-                    __func__);
-        } TX_END
-        zfree(victim_oids);
+/* Samples PMEM_TIER_SAMPLES PMEM keys, possibly the same one twice. */
+static int pmemTierSamplePMEM(pmemTierSample *samples) {
+    int count;
+
+    if (server.pmem_entries_len == 0) return 0;
+    for (count = 0; count < PMEM_TIER_SAMPLES; count++) {
+        dictEntry *de =
+            server.pmem_entries[random() % server.pmem_entries_len]->de;
+
+        samples[count].de = de;
+        samples[count].db = NULL;
+        samples[count].freq = LFUDecrAndReturn(dictGetVal(de));
     }
+    return count;
+}
 
-    serverLog(LL_TODIS, "##############################");
-    return C_OK;
+/* Returns 1 if 'de' is one of the first 'count' samples. */
+static int pmemTierSampled(pmemTierSample *samples, int count, dictEntry *de) {
+    for (int k = 0; k < count; k++)
+        if (samples[k].de == de) return 1;
+    return 0;
+}
+
+/* Tiering pass of pmem-tiering lfu, called by databasesCron(). The hottest
+ * keys of a sample of DRAM strings are promoted to PMEM, while it has room
+ * below the eviction high watermark (max-pmem-memory if the background
+ * eviction is off). Room is made by demoting the coldest keys of a sample
+ * of PMEM keys, only as long as they are colder than the key to promote,
+ * so that keys don't bounce between the tiers. A key is only promoted if
+ * it was read since it was created. pmem-promote-per-sec and
+ * pmem-demote-per-sec bound the keys moved each second.
+ *
+ * The moves are planned first, so that the demotions are made in batches of
+ * pmem-victim-count keys, a transaction per shard each, before the
+ * promotions. */
+void pmemTieringCron(void) {
+    pmemTierSample hot[PMEM_TIER_SAMPLES], cold[PMEM_TIER_SAMPLES];
+    PMEMoid *victim_oids;
+    long long promote, demote;
+    size_t limit, used;
+    int nhot, ncold = 0, npromote = 0, ndemote = 0, j = 0;
+
+    if (server.pmem_tiering != PMEM_TIERING_LFU ||
+        server.pmem_warming || server.pmem_evicting) return;
+
+    promote = pmemTierAllowance(server.pmem_promote_per_sec,
+                                &server.pmem_tier_promote_credit);
+    demote = pmemTierAllowance(server.pmem_demote_per_sec,
+                               &server.pmem_tier_demote_credit);
+    if (server.max_pmem_memory_policy == MAXMEMORY_NO_EVICTION) demote = 0;
+    if (promote == 0) return;
+
+    nhot = pmemTierSampleDRAM(hot);
+    if (nhot == 0) return;
+    qsort(hot, nhot, sizeof(*hot), pmemTierHotFirst);
+    if (demote) {
+        ncold = pmemTierSamplePMEM(cold);
+        qsort(cold, ncold, sizeof(*cold), pmemTierColdFirst);
+    }
+
+    /* Plan the moves: the planned keys are packed at the start of hot and
+     * cold. A key may be sampled twice, so it is only planned once. */
+    limit = server.pmem_fire_evict_percent ?
+        pmemHighWatermark() : server.max_pmem_memory;
+    used = pmem_used_memory();
+    for (int i = 0; i < nhot && npromote < promote; i++) {
+        int planned = ndemote;
+        size_t need;
+
+        if (hot[i].freq < PMEM_TIER_PROMOTE_MIN_FREQ) break;
+        if (pmemTierSampled(hot, npromote, hot[i].de)) continue;
+        need = pmemRecordSize(dictGetKey(hot[i].de), dictGetVal(hot[i].de));
+        while (used + need > limit) {
+            PMEMoid oid;
+            size_t freed;
+
+            while (j < ncold && pmemTierSampled(cold, ndemote, cold[j].de))
+                j++;
+            if (ndemote == demote || j == ncold ||
+                cold[j].freq >= hot[i].freq)
+            {
+                /* No room for this key: don't demote keys for it. */
+                ndemote = planned;
+                goto plan_done;
+            }
+            oid = *sdsPMEMoidBackReference(dictGetKey(cold[j].de));
+            freed = sizeOfPmemNode(oid);
+            used = used > freed ? used - freed : 0;
+            cold[ndemote++] = cold[j++];
+        }
+        used += need;
+        hot[npromote++] = hot[i];
+    }
+plan_done:
+    victim_oids = zmalloc(sizeof(PMEMoid) * server.pmem_victim_count);
+    for (int k = 0; k < ndemote;) {
+        size_t n = 0;
+
+        for (; n < server.pmem_victim_count && k < ndemote; n++, k++)
+            victim_oids[n] = *sdsPMEMoidBackReference(dictGetKey(cold[k].de));
+        for (size_t m = n; m < server.pmem_victim_count; m++)
+            victim_oids[m] = OID_NULL;
+        if (pmemDemoteVictims(victim_oids) < 0) break;
+        server.stat_pmem_tier_demoted += n;
+    }
+    zfree(victim_oids);
+
+    for (int i = 0; i < npromote; i++) {
+        robj *val = dictGetVal(hot[i].de);
+
+        /* Short of room if a batch of demotions failed. */
+        if (pmem_used_memory() + pmemRecordSize(dictGetKey(hot[i].de), val) >
+            limit) break;
+        if (dbPromoteKeyPM(hot[i].db, hot[i].de) == C_ERR) {
+            serverLog(LL_WARNING, "PMEM tiering: promotion aborted");
+            break;
+        }
+        server.stat_pmem_tier_promoted++;
+    }
 }
 #endif
 
@@ -4220,10 +4742,15 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == AOF_ON) {
+#ifdef TODIS
+        /* The spill log is replayed along with the AOF, even an empty one. */
+        pmemSpillLoadStart();
+#endif
         if (loadAppendOnlyFile(server.aof_filename) == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
 #ifdef TODIS
             serverLog(LL_TODIS,"TODIS, DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
+        pmemSpillLoadFinish();
 #endif
     } else {
         if (rdbLoad(server.rdb_filename) == C_OK) {
@@ -4354,16 +4881,68 @@ int redisIsSupervised(int mode) {
 }
 
 #ifdef USE_PMDK
+#ifdef TODIS
+/* Creates, or opens if it exists, the pool of a shard. An opened pool gets
+ * its interrupted in-place overwrite completed, and the PMEM data has to be
+ * reconstructed. */
+static void initPersistentMemoryShard(pmemShard *shard) {
+    shard->pool = pmemobj_create(shard->path, PM_LAYOUT_NAME, shard->size,
+            0666);
+    if (shard->pool == NULL) {
+        shard->pool = pmemobj_open(shard->path, PM_LAYOUT_NAME);
+        if (shard->pool == NULL) {
+            char hmem[64];
+
+            bytesToHuman(hmem, shard->size);
+            serverLog(LL_WARNING,"Cannot init persistent memory poolset file "
+                "%s size %s (layout " PM_LAYOUT_NAME "): %s", shard->path,
+                hmem, strerror(errno));
+            exit(1);
+        }
+        server.pm_reconstruct_required = true;
+        pmemShardAttach(shard, 0);
+        pmemShardSelect(shard);
+        pmemValueRedoRecover();
+    } else {
+        pmemShardAttach(shard, 1);
+    }
+}
+#endif
+
 void initPersistentMemory(void) {
+#ifndef TODIS
     PMEMoid oid;
     struct redis_pmem_root *root;
+#endif
 
     long long start = ustime();
     char pmfile_hmem[64];
     bytesToHuman(pmfile_hmem, server.pm_file_size);
     serverLog(LL_NOTICE,"Start init Persistent memory file %s size %s",
             server.pm_file_path, pmfile_hmem);
+#ifdef TODIS
+    pmemLatencyInit();
+    if (server.pm_read_latency || server.pm_write_latency ||
+        server.pm_write_bandwidth)
+    {
+        pmemLatencyReport r;
 
+        pmemLatencySelfTest(PMEM_LATENCY_SELFTEST_ITERATIONS, &r);
+        serverLog(LL_NOTICE,
+            "PMEM latency emulation: read %zu ns/line (measured %.1f), "
+            "write %zu ns/line (measured %.1f), write bandwidth %zu MB/s "
+            "(measured %.0f), %.3f TSC cycles/ns",
+            server.pm_read_latency, r.read_ns,
+            server.pm_write_latency, r.write_ns,
+            server.pm_write_bandwidth, r.write_mbps, r.cycles_per_ns);
+    }
+#endif
+
+#ifdef TODIS
+    for (int i = 0; i < server.pm_num_shards; i++)
+        initPersistentMemoryShard(server.pm_shards + i);
+    pmemShardSelect(server.pm_shards);
+#else
     /* Create new PMEM pool file. */
     server.pm_pool = pmemobj_create(server.pm_file_path, PM_LAYOUT_NAME, server.pm_file_size, 0666);
 
@@ -4388,6 +4967,7 @@ void initPersistentMemory(void) {
     /* Get pool UUID from root object's OID. */
     oid = pmemobj_root(server.pm_pool, 1);
     server.pool_uuid_lo = oid.pool_uuid_lo;
+#endif
 
     serverLog(LL_NOTICE,"Init Persistent memory file %s time %.3f "
             "seconds",
@@ -4561,16 +5141,18 @@ int main(int argc, char **argv) {
 #ifndef TODIS
             reconstruct_result = pmemReconstruct();
 #else
-            TX_BEGIN(server.pm_pool) {
-                reconstruct_result = pmemReconstructTODIS();
-            } TX_ONABORT {
+            /* Every shard is written in a transaction of its own. */
+            reconstruct_result = pmemReconstructTODIS();
+            if (reconstruct_result != C_OK)
                 serverLog(
                         LL_TODIS,
                         "TODIS_ERROR, pmem reconstruct failed (%s)",
                         __func__);
-            } TX_END
 #endif
             if (reconstruct_result == C_OK) {
+#ifdef TODIS
+                server.pmem_reconstruct_time = ustime()-start;
+#endif
                 serverLog(LL_NOTICE,"DB loaded from PMEM: %.3f seconds",(float)(ustime()-start)/1000000);
 #ifdef TODIS
                 serverLog(LL_TODIS,"TODIS, DB loaded from PMEM: %.3f seconds",(float)(ustime()-start)/1000000);
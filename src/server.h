@@ -53,7 +53,13 @@
 #include <sys/queue.h>
 #include "libpmemobj.h"
 
+#ifdef TODIS
+/* The TODIS nodes and root differ from the store_db ones: pools of another
+ * layout are refused when opened. Bumped on every layout change. */
+#define PM_LAYOUT_NAME "store_db_todis_v2"
+#else
 #define PM_LAYOUT_NAME "store_db"
+#endif
 
 POBJ_LAYOUT_BEGIN(store_db);
 POBJ_LAYOUT_TOID(store_db, struct redis_pmem_root);
@@ -74,14 +80,63 @@ uint64_t pm_type_emb_sds_type_id;
 /* Type Embedded SDS Object */
 #define PM_TYPE_EMB_SDS pm_type_emb_sds_type_id
 
+#ifdef TODIS
+#define PMEM_VALUE_REDO_MAX 1024
+
+/* Redo record of an in-place overwrite of a PMEM value outside of a
+ * transaction, applied again at startup while 'target' is set. */
+struct pmem_value_redo {
+    uint64_t target;    /* Pool offset of the sds string, 0 if none */
+    uint64_t len;
+    char buf[PMEM_VALUE_REDO_MAX];
+};
+#endif
+
 struct redis_pmem_root {
 	uint64_t num_dict_entries;
 	TOID(struct key_val_pair_PM) pe_first;
     TOID(struct key_val_pair_PM) pe_last;
     uint64_t num_victim_entries;
     TOID(struct key_val_pair_PM) victim_first;
+#ifdef TODIS
+    uint64_t boot_gen;      /* Incremented by every reconstruction */
+    uint64_t index_buckets; /* Size of the hash index, 0 if there is none */
+    PMEMoid index;          /* Hash index: TOID(struct key_val_pair_PM)[]
+                               then uint64_t nodes[index_dbs] */
+    struct pmem_value_redo value_redo;
+    uint64_t index_dbs;     /* Databases counted by the hash index */
+#endif
 };
 
+#ifdef TODIS
+#define PMEM_MAX_SHARDS 16
+
+/* A pool of the PMEM tier, one per pmfile line. Every shard has its own
+ * root, so its own pmem list, victim list and hash index. New keys go to
+ * the shard of their hash slot (pmemShardForEntry()), a key keeps the shard
+ * of its record. A write command runs with the shard of its first key
+ * selected (selectCommandShardPM()). */
+typedef struct pmemShard {
+    char *path;
+    size_t size;                    /* Size of a pool to create */
+    PMEMobjpool *pool;
+    TOID(struct redis_pmem_root) rootoid;
+    uint64_t uuid_lo;
+    PMEMoid warmup_cursor;          /* Next node of the lazy warm-up */
+    PMEMoid victim_sealed;          /* Head of the last sealed victims */
+} pmemShard;
+
+/* Victims of a shard sealed at an AOF fsync epoch: the nodes from 'first'
+ * to the end of the victim list. They are freed once that epoch is durable,
+ * the segments of a shard oldest first. */
+typedef struct pmemReclaimSegment {
+    pmemShard *shard;
+    PMEMoid first;
+    uint64_t epoch;
+    long long sealed;               /* Seal time in milliseconds */
+} pmemReclaimSegment;
+#endif
+
 #endif
 
 #ifdef TODIS
@@ -193,6 +248,27 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_MAX_PMEM_MEMORY_SIZE CONFIG_MIN_MAX_PMEM_MEMORY_SIZE
 #define CONFIG_DEFAULT_TODIS_LOG_ONLY 0
 #define CONFIG_MIN_PMEM_VICTIM_COUNT 1
+#define CONFIG_DEFAULT_PMEM_VOLATILE_LRU 0
+#define CONFIG_DEFAULT_PMEM_FIRE_EVICT_PERCENT 0
+#define CONFIG_DEFAULT_PMEM_STOP_EVICT_PERCENT 0
+#define PMEM_EVICT_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for pmem eviction */
+#define CONFIG_DEFAULT_PMEM_RECONSTRUCT_THREADS 1
+#define CONFIG_MAX_PMEM_RECONSTRUCT_THREADS 64
+#define CONFIG_DEFAULT_PMEM_LAZY_RECONSTRUCT 0
+#define CONFIG_DEFAULT_PMEM_INDEX_BUCKETS (1024*1024)
+#define CONFIG_DEFAULT_PMEM_WRITE_PATH PMEM_WRITE_PATH_TX
+#define CONFIG_DEFAULT_PMEM_GROUP_COMMIT 0
+#define CONFIG_DEFAULT_PMEM_SPILL_LOG 0
+#define CONFIG_DEFAULT_PMEM_READ_CACHE_SIZE 0
+#define CONFIG_DEFAULT_PMEM_TIERING PMEM_TIERING_NONE
+#define CONFIG_DEFAULT_PMEM_LFU_LOG_FACTOR 10
+#define CONFIG_DEFAULT_PMEM_LFU_DECAY_TIME 1 /* Minutes */
+#define CONFIG_DEFAULT_PMEM_PROMOTE_PER_SEC 100
+#define CONFIG_DEFAULT_PMEM_DEMOTE_PER_SEC 100
+#define PMEM_TIER_SAMPLES 64 /* Keys sampled per tier by a tiering pass */
+#define CONFIG_DEFAULT_PM_READ_LATENCY 0
+#define CONFIG_DEFAULT_PM_WRITE_LATENCY 0
+#define CONFIG_DEFAULT_PM_WRITE_BANDWIDTH 0
 #endif
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
@@ -206,7 +282,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
 #define STATS_METRIC_NET_INPUT 1    /* Bytes read to network .*/
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
+#ifdef TODIS
+#define STATS_METRIC_PMEM_EVICTED 3 /* Keys evicted from PMEM. */
+#define STATS_METRIC_COUNT 4
+#else
 #define STATS_METRIC_COUNT 3
+#endif
 
 /* Protocol and I/O related defines */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
@@ -263,6 +344,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#ifdef TODIS
+#define OBJ_ENCODING_EMBPM 10  /* sds embedded in a PMEM record */
+#endif
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -452,8 +536,29 @@ typedef long long mstime_t; /* millisecond time type. */
 #define MAXMEMORY_ALLKEYS_LRU 3
 #define MAXMEMORY_ALLKEYS_RANDOM 4
 #define MAXMEMORY_NO_EVICTION 5
+#ifdef TODIS
+#define MAXMEMORY_ALLKEYS_CLOCK 6 /* max-pmem-memory-policy only */
+#define MAXMEMORY_ALLKEYS_SAMPLED_LRU 7 /* max-pmem-memory-policy only */
+#endif
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
+#ifdef TODIS
+/* PMEM write paths */
+#define PMEM_WRITE_PATH_TX 0
+#define PMEM_WRITE_PATH_PUBLISH 1
+
+/* Placement of the keys between DRAM and PMEM */
+#define PMEM_TIERING_NONE 0 /* Set by the writes and the PMEM eviction */
+#define PMEM_TIERING_LFU 1  /* Also moved by access frequency */
+
+/* With pmem-tiering lfu the lru field of an object holds the time of its
+ * last access in minutes (16 bits) and a logarithmic access counter (8
+ * bits), decremented once every pmem-lfu-decay-time minutes idle. */
+#define LFU_INIT_VAL 5 /* Counter of a new object, so it is not demoted
+                          before it had a chance to be read */
+#define PMEM_TIER_PROMOTE_MIN_FREQ (LFU_INIT_VAL+1) /* Read since created */
+#endif
+
 /* Scripting */
 #define LUA_SCRIPT_TIME_LIMIT 5000 /* milliseconds */
 
@@ -559,6 +664,9 @@ typedef struct redisObject {
 struct evictionPoolEntry {
     unsigned long long idle;    /* Object idle time. */
     sds key;                    /* Key name. */
+#ifdef TODIS
+    int dbid;                   /* DB of a PMEM key, from its node. */
+#endif
 };
 
 /* Redis database representation. There are multiple databases identified
@@ -573,6 +681,9 @@ typedef struct redisDb {
     struct evictionPoolEntry *eviction_pool;    /* Eviction pool of keys */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
+#ifdef TODIS
+    unsigned long pmem_cold_keys; /* PMEM keys not warmed up into dict yet */
+#endif
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -817,7 +928,7 @@ struct redisServer {
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
                         *rpopCommand, *sremCommand, *execCommand;
 #ifdef TODIS
-    struct redisCommand *aofSetCommand;
+    struct redisCommand *aofSetCommand, *pexpireatCommand;
 #endif
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
@@ -827,6 +938,19 @@ struct redisServer {
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
+#ifdef TODIS
+    long long stat_dram_hits;       /* Successful lookups of DRAM keys */
+    long long stat_pmem_hits;       /* Successful lookups of PMEM keys */
+    long long stat_pmem_evicted_keys; /* Keys evicted from PMEM to DRAM */
+    long long stat_pmem_promoted_keys; /* DRAM keys written back to PMEM */
+    long long stat_pmem_reclaimed_victims; /* Victims freed after a fsync */
+    long long stat_pmem_spill_records; /* Records fed to the spill log */
+    long long stat_pmem_cache_hits; /* PMEM values read from the cache */
+    long long stat_pmem_cache_misses; /* PMEM values read from PMEM */
+    long long stat_pmem_cache_evictions; /* Values evicted by the CLOCK */
+    long long stat_pmem_tier_promoted; /* Hot DRAM keys moved to PMEM */
+    long long stat_pmem_tier_demoted; /* Cold PMEM keys moved to DRAM */
+#endif
     size_t stat_peak_memory;        /* Max used memory record */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
@@ -871,6 +995,12 @@ struct redisServer {
     uint64_t pool_uuid_lo;          /* PMEM pool UUID */
 #endif
 #ifdef TODIS
+    /* pm_pool, pm_rootoid and pool_uuid_lo are those of the selected
+     * shard, see pmemShardSelect(). */
+    pmemShard pm_shards[PMEM_MAX_SHARDS];
+    int pm_num_shards;              /* Number of pmfile lines */
+    pmemShard *pm_shard;            /* Selected shard */
+    int pmem_batch_open;            /* pmemBatchBegin() transaction open */
     long long pmem_list_time;       /* TEMP: time checking for pmem list */
     long long insert_time;
     long long access_time;
@@ -881,11 +1011,60 @@ struct redisServer {
     size_t max_used_pmem_memory;    /* Maximum used memory capacity in pmem */
     size_t max_pmem_memory;         /* Maximum memory capacity for pmem */
     size_t pmem_fire_evict_percent; /* Percent of pmem memory firing eviction */
+    size_t pmem_stop_evict_percent; /* Percent of pmem memory ending eviction */
+    int pmem_evicting;              /* Background pmem eviction in progress */
     int max_pmem_memory_policy;     /* Policy for key eviction */
     size_t pmem_victim_count;       /* Number of Victim in eviction */
     int todis_log_only;             /* Force to write todis log only */
-    size_t pm_read_latency;
-    size_t pm_write_latency;
+    int pmem_volatile_lru;          /* Keep pmem LRU order in DRAM only */
+    int pmem_reconstruct_threads;   /* Threads rebuilding the dict at startup */
+    int pmem_lazy_reconstruct;      /* Warm up the dict from the hash index */
+    unsigned long pmem_index_buckets; /* Buckets of the persistent hash index */
+    int pmem_write_path;            /* PMEM_WRITE_PATH_* used by SET */
+    int pmem_group_commit;          /* One transaction per client batch */
+    int pmem_group_open;            /* Group transaction in progress */
+    size_t pmem_group_need;         /* Pool room of the command in a group */
+    int pmem_spill_log;             /* Demotions go to the spill log */
+    char *pmem_spill_filename;      /* Name of the spill log */
+    int pmem_spill_fd;              /* Spill log, -1 if not open */
+    sds pmem_spill_buf;             /* Records not written yet */
+    off_t pmem_spill_size;          /* Bytes written to the spill log */
+    off_t pmem_spill_rewrite_base;  /* Spill log size at the rewrite fork */
+    uint32_t pmem_boot_gen;         /* Tags the volatile pointers of pmem nodes */
+    int pmem_warming;               /* Lazy warm-up in progress */
+    int pmem_warmup_shard;          /* Shard being warmed up */
+    list *pmem_reclaim_queue;       /* pmemReclaimSegment, oldest first */
+    uint64_t pmem_reclaim_epoch;    /* Last sealed AOF fsync epoch */
+    uint64_t pmem_reclaim_durable;  /* Last fsynced epoch, set by any thread */
+    unsigned long pmem_warmup_keys; /* Keys materialized by the warm-up */
+    long long pmem_warmup_start;    /* Warm-up start time in microseconds */
+    long long pmem_reconstruct_time; /* Dict rebuild from PMEM, microseconds */
+    struct pmemEntryMeta *pmem_lru_head; /* Most recently used pmem entry */
+    struct pmemEntryMeta *pmem_lru_tail; /* Least recently used pmem entry */
+    struct pmemEntryMeta *pmem_clock_hand; /* Next entry seen by allkeys-clock */
+    struct pmemEntryMeta **pmem_entries; /* Dense array of pmem entries */
+    unsigned long pmem_entries_len; /* Number of pmem entries */
+    unsigned long pmem_entries_size; /* Allocated slots in pmem_entries */
+    unsigned long long pmem_read_cache_size; /* DRAM read cache, 0 if off */
+    struct pmemCacheSlot *pmem_cache_slots; /* Dense array of cached values */
+    unsigned long pmem_cache_len;   /* Number of cached values */
+    unsigned long pmem_cache_size;  /* Allocated slots in pmem_cache_slots */
+    unsigned long pmem_cache_hand;  /* Next slot examined by the CLOCK */
+    size_t pmem_cache_used;         /* Bytes accounted to the cached values */
+    list *pmem_cache_to_free;       /* Dropped copies, freed in beforeSleep() */
+    int pmem_tiering;               /* PMEM_TIERING_*, set at startup */
+    int pmem_lfu_log_factor;        /* Reads per counter step, roughly */
+    int pmem_lfu_decay_time;        /* Minutes per counter decrement */
+    long long pmem_promote_per_sec; /* Tiering promotions budget */
+    long long pmem_demote_per_sec;  /* Tiering demotions budget */
+    long long pmem_tier_promote_credit; /* Budget carried to the next pass */
+    long long pmem_tier_demote_credit;
+    int pmem_tier_db;               /* Next db sampled by the tiering pass */
+    struct evictionPoolEntry *pmem_eviction_pool; /* allkeys-sampled-lru pool */
+    uint64_t pmem_lru_clock;        /* Last write stamp given to a pmem node */
+    size_t pm_read_latency;         /* Emulated ns per cache line read */
+    size_t pm_write_latency;        /* Emulated ns per cache line written */
+    size_t pm_write_bandwidth;      /* Emulated write MB/s, 0 unlimited */
 #endif
     /* AOF persistence */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
@@ -1316,7 +1495,14 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+#ifdef TODIS
+unsigned long LFUGetTimeInMinutes(void);
+unsigned long LFUDecrAndReturn(robj *o);
+void updateLFU(robj *o);
+#define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR || objptr->encoding == OBJ_ENCODING_EMBPM)
+#else
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
+#endif
 
 #ifdef USE_PMDK
 /* Persistent Memory support */
@@ -1369,7 +1555,8 @@ void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 #ifdef TODIS
 void aofFsyncWithFlushVictim(int fd);
-void feedAppendOnlyFileTODIS(redisDb *db, robj *key, robj *val);
+void feedAppendOnlyFileTODIS(redisDb *db, robj *key, robj *val, long long expire);
+void feedAppendOnlyFileDelTODIS(redisDb *db, sds key);
 void forceFlushAppendOnlyFileTODIS();
 #endif
 void aofRemoveTempFile(pid_t childpid);
@@ -1415,6 +1602,9 @@ unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
 int freeMemoryIfNeeded(void);
 #ifdef TODIS
 int freePmemMemoryIfNeeded(void);
+void pmemEvictionCron(void);
+void pmemTieringCron(void);
+void evictionPoolPopulatePM(struct evictionPoolEntry *pool, unsigned long avail);
 void writeStatusLogs(void);
 #endif
 int processCommand(client *c);
@@ -1513,7 +1703,7 @@ int rewriteConfig(char *path);
 int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key);
 #ifdef TODIS
-int dbReconstructVictim(redisDb *db, robj *key, robj *val);
+int dbReconstructVictim(redisDb *db, robj *key, robj *val, long long expire);
 void propagateExpireTODIS(redisDb *db, dictEntry *entry);
 #endif
 int expireIfNeeded(redisDb *db, robj *key);
@@ -1537,6 +1727,16 @@ void dbOverwrite(redisDb *db, robj *key, robj *val);
 void dbOverwritePM(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
 void setKeyPM(redisDb *db, robj *key, robj *val);
+#ifdef TODIS
+void selectCommandShardPM(redisDb *db, struct redisCommand *cmd,
+        robj **argv, int argc);
+int setKeyPublishPM(redisDb *db, robj *key, robj *val, long long expire);
+int setKeyCommitPM(redisDb *db, robj *key, robj *val, long long expire);
+int dbWriteCommitPM(redisDb *db, robj *key, robj *val);
+int setKeysCommitPM(redisDb *db, robj **argv, int argc, char *set);
+robj *dbCopyStringValuePM(robj *o);
+int dbPromoteKeyPM(redisDb *db, dictEntry *de);
+#endif
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
@@ -1776,6 +1976,9 @@ void securityWarningCommand(client *c);
 void aofSetCommand(client *c);
 void getPmemProcessTimeCommand(client *c);
 void getPmemStatusCommand(client *c);
+void pmemLatencyCommand(client *c);
+void pmemTraceCommand(client *c);
+void pmemAddPartCommand(client *c);
 void getDramStatusCommand(client *c);
 void getListPmemStatusCommand(client *c);
 void getReverseListPmemStatusCommand(client *c);
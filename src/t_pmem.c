@@ -5,6 +5,7 @@
 #include "libpmemobj.h"
 #include "util.h"
 #include "pmem_latency.h"
+#include "pmem_trace.h"
 #endif
 #include <math.h> /* isnan(), isinf() */
 
@@ -37,7 +38,6 @@
 
 void aofSetGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire, int unit, robj *ok_reply, robj *abort_reply) {
     long long milliseconds = 0; /* initialized to avoid any harmness warning */
-    robj *convertedVal = val;
 
     if (expire) {
         if (getLongLongFromObjectOrReply(c, expire, &milliseconds, NULL) != C_OK)
@@ -55,14 +55,7 @@ void aofSetGenericCommand(client *c, int flags, robj *key, robj *val, robj *expi
         addReply(c, abort_reply ? abort_reply : shared.nullbulk);
         return;
     }
-#ifdef TODIS
-    if (val->encoding == OBJ_ENCODING_INT) {
-        char int_str_buf[1024];
-        sprintf(int_str_buf, "%lld", val->ptr);
-        convertedVal = createStringObject(int_str_buf, strlen(int_str_buf));
-    }
-#endif
-    setKey(c->db, key, convertedVal);
+    setKey(c->db, key, val);
     server.dirty++;
     if (expire) setExpire(c->db,key,mstime()+milliseconds);
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->db->id);
@@ -122,6 +115,24 @@ void aofSetCommand(client *c) {
  * Check PMEM / DRAM status command
  *----------------------------------------------------------------------------*/
 #ifdef TODIS
+/* Formats a key and its string value, which may be INT encoded. */
+static void statusFormatEntry(char *buf, sds key, robj *val) {
+    if (val->encoding == OBJ_ENCODING_INT)
+        sprintf(buf, "key: %s, val: %ld", key, (long) val->ptr);
+    else
+        sprintf(buf, "key: %s, val: %s", key, (sds) val->ptr);
+}
+
+/* Same as statusFormatEntry() for a pmem node. */
+static void statusFormatNode(char *buf, struct key_val_pair_PM *obj) {
+    if (obj->flags & PMEM_NODE_INT_VAL)
+        sprintf(buf, "key: %s, val: %ld", getKeyFromPMObject(obj),
+                (long) obj->val_oid.off);
+    else
+        sprintf(buf, "key: %s, val: %s", getKeyFromPMObject(obj),
+                getValFromPMObject(obj));
+}
+
 void getPmemProcessTimeCommand(client *c) {
     void *replylen = addDeferredMultiBulkLength(c);
     unsigned long numreplies = 0;
@@ -238,7 +249,7 @@ void getPmemStatusCommand(client *c) {
 
         keyobj = createStringObject(sdsdup(key), sdslen(key));
         if (expireIfNeeded(c->db, keyobj) == 0) {
-            sprintf(str_buf, "key: %s, val: %s", (sds) key, (sds) valobj->ptr);
+            statusFormatEntry(str_buf, key, valobj);
             addReplyBulkCString(c, str_buf);
             numreplies++;
         }
@@ -249,6 +260,146 @@ void getPmemStatusCommand(client *c) {
     setDeferredMultiBulkLength(c, replylen, numreplies);
 }
 
+/* PMEMLATENCY [iterations]
+ * Self-test of the NVM emulator: the latencies and the write bandwidth
+ * achieved, measured over 'iterations' accesses, next to the configured
+ * ones. */
+void pmemLatencyCommand(client *c) {
+    long long iterations = PMEM_LATENCY_SELFTEST_ITERATIONS;
+    pmemLatencyReport r;
+
+    if (c->argc > 2) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+    if (c->argc == 2 &&
+        getLongLongFromObjectOrReply(c, c->argv[1], &iterations, NULL) != C_OK)
+        return;
+    if (iterations <= 0) {
+        addReplyError(c, "iterations must be positive");
+        return;
+    }
+
+    pmemLatencySelfTest(iterations, &r);
+    addReplyMultiBulkLen(c, 14);
+    addReplyBulkCString(c, "read latency (ns/line):");
+    addReplyBulkLongLong(c, server.pm_read_latency);
+    addReplyBulkCString(c, "measured read latency:");
+    addReplyDouble(c, r.read_ns);
+    addReplyBulkCString(c, "write latency (ns/line):");
+    addReplyBulkLongLong(c, server.pm_write_latency);
+    addReplyBulkCString(c, "measured write latency:");
+    addReplyDouble(c, r.write_ns);
+    addReplyBulkCString(c, "write bandwidth (MB/s):");
+    addReplyBulkLongLong(c, server.pm_write_bandwidth);
+    addReplyBulkCString(c, "measured write bandwidth:");
+    addReplyDouble(c, r.write_mbps);
+    addReplyBulkCString(c, "TSC cycles/ns:");
+    addReplyDouble(c, r.cycles_per_ns);
+}
+
+/* PMEMADDPART <path> <size>
+ * Grows the PMEM tier without a restart: a new pool is created at 'path'
+ * and added as a shard, and max-pmem-memory is raised in proportion. The
+ * config file is rewritten with a pmfile line for the new pool, so that
+ * the restart recovers it with the others. */
+void pmemAddPartCommand(client *c) {
+    char *path = c->argv[1]->ptr;
+    long long size;
+    int err;
+
+    if (!server.persistent) {
+        addReplyError(c, "persistent memory is not enabled");
+        return;
+    }
+    if (server.configfile == NULL) {
+        addReplyError(c, "the server is running without a config file, "
+            "the new part could not be recovered at restart");
+        return;
+    }
+    size = memtoll(c->argv[2]->ptr, &err);
+    if (err || size < (long long)CONFIG_MIN_PM_FILE_SIZE) {
+        addReplyError(c, "invalid part size");
+        return;
+    }
+    if (server.pm_num_shards == PMEM_MAX_SHARDS) {
+        addReplyErrorFormat(c, "no more than %d parts", PMEM_MAX_SHARDS);
+        return;
+    }
+    for (int j = 0; j < server.pm_num_shards; j++) {
+        if (!strcmp(server.pm_shards[j].path, path)) {
+            addReplyError(c, "the part is already in use");
+            return;
+        }
+    }
+    if (access(path, F_OK) == 0) {
+        addReplyError(c, "the file exists: a pool holding keys is added with "
+            "a pmfile line and a restart");
+        return;
+    }
+
+    if (pmemShardAdd(path, size) == C_ERR) {
+        addReplyErrorFormat(c, "creating the pool failed: %s",
+            strerror(errno));
+        return;
+    }
+    if (rewriteConfig(server.configfile) == -1) {
+        serverLog(LL_WARNING, "PMEMADDPART: rewriting the config failed: %s, "
+            "add 'pmfile %s %lld' before restarting", strerror(errno), path,
+            size);
+        addReplyErrorFormat(c, "the part was added but rewriting the config "
+            "failed: %s", strerror(errno));
+        return;
+    }
+    addReply(c, shared.ok);
+}
+
+typedef struct pmemTraceReply {
+    client *c;
+    unsigned long lines;
+} pmemTraceReply;
+
+static void pmemTraceReplyLine(void *privdata, const char *line) {
+    pmemTraceReply *reply = privdata;
+
+    addReplyBulkCString(reply->c, line);
+    reply->lines++;
+}
+
+/* PMEMTRACE [count]: the last 'count' trace records of every thread,
+ * default 128, oldest first.
+ * PMEMTRACE RESET: forgets the records. */
+void pmemTraceCommand(client *c) {
+    long long count = 128;
+    pmemTraceReply reply = {c, 0};
+    void *replylen;
+
+    if (!PMEM_TRACE_ENABLED) {
+        addReplyError(c, "tracing not compiled in, build with TODIS_TRACE=yes");
+        return;
+    }
+    if (c->argc > 2) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "reset")) {
+        pmemTraceReset();
+        addReply(c, shared.ok);
+        return;
+    }
+    if (c->argc == 2 &&
+        getLongLongFromObjectOrReply(c, c->argv[1], &count, NULL) != C_OK)
+        return;
+    if (count <= 0) {
+        addReplyError(c, "count must be positive");
+        return;
+    }
+
+    replylen = addDeferredMultiBulkLength(c);
+    pmemTraceDump(count, pmemTraceReplyLine, &reply);
+    setDeferredMultiBulkLength(c, replylen, reply.lines);
+}
+
 void getDramStatusCommand(client *c) {
     long long used_dram_memory = (long long) zmalloc_used_memory();
     void *replylen = addDeferredMultiBulkLength(c);
@@ -277,7 +428,7 @@ void getDramStatusCommand(client *c) {
 
         keyobj = createStringObject(sdsdup(key), sdslen(key));
         if (expireIfNeeded(c->db, keyobj) == 0) {
-            sprintf(str_buf, "key: %s, val: %s", (sds) key, (sds) valobj->ptr);
+            statusFormatEntry(str_buf, key, valobj);
             addReplyBulkCString(c, str_buf);
             numreplies++;
         }
@@ -288,39 +439,27 @@ void getDramStatusCommand(client *c) {
     setDeferredMultiBulkLength(c, replylen, numreplies);
 }
 
+/* The nodes of the PMEM list of every shard, shard after shard. */
 void getListPmemStatusCommand(client *c) {
     void *replylen = addDeferredMultiBulkLength(c);
     unsigned long numreplies = 0;
     char str_buf[1024];
     TOID(struct redis_pmem_root) root;
     TOID(struct key_val_pair_PM) node_toid;
-    struct key_val_pair_PM *node_obj;
-    void *key;
-    void *val;
-    void *pmem_base_addr;
-
-    root = server.pm_rootoid;
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    node_toid = D_RO_LATENCY(root)->pe_first;
-    if (TOID_IS_NULL(node_toid)) {
-        setDeferredMultiBulkLength(c, replylen, numreplies);
-        return;
-    }
-    while (1) {
-        node_obj = (key_val_pair_PM *)(
-                node_toid.oid.off + (uint64_t) pmem_base_addr
-        );
-        key = (void *)(node_obj->key_oid.off + (uint64_t) pmem_base_addr);
-        val = (void *)(node_obj->val_oid.off + (uint64_t) pmem_base_addr);
 
-        sprintf(str_buf, "key: %s, val: %s", (sds) key, (sds) val);
-        addReplyBulkCString(c, str_buf);
-        numreplies++;
-
-        if (TOID_EQUALS(node_toid, D_RO_LATENCY(root)->pe_last))
-            break;
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        root = server.pm_shards[i].rootoid;
+        for (node_toid = D_RO_LATENCY(root)->pe_first;
+            !TOID_IS_NULL(node_toid);
+            node_toid = D_RO_LATENCY(node_toid)->pmem_list_next)
+        {
+            statusFormatNode(str_buf, getPMObjectFromOid(node_toid.oid));
+            addReplyBulkCString(c, str_buf);
+            numreplies++;
 
-        node_toid = D_RO_LATENCY(node_toid)->pmem_list_next;
+            if (TOID_EQUALS(node_toid, D_RO_LATENCY(root)->pe_last))
+                break;
+        }
     }
 
     setDeferredMultiBulkLength(c, replylen, numreplies);
@@ -332,33 +471,20 @@ void getReverseListPmemStatusCommand(client *c) {
     char str_buf[1024];
     TOID(struct redis_pmem_root) root;
     TOID(struct key_val_pair_PM) node_toid;
-    struct key_val_pair_PM *node_obj;
-    void *key;
-    void *val;
-    void *pmem_base_addr;
-
-    root = server.pm_rootoid;
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    node_toid = D_RO_LATENCY(root)->pe_last;
-    if (TOID_IS_NULL(node_toid)) {
-        setDeferredMultiBulkLength(c, replylen, numreplies);
-        return;
-    }
-    while (1) {
-        node_obj = (key_val_pair_PM *)(
-                node_toid.oid.off + (uint64_t) pmem_base_addr
-        );
-        key = (void *)(node_obj->key_oid.off + (uint64_t) pmem_base_addr);
-        val = (void *)(node_obj->val_oid.off + (uint64_t) pmem_base_addr);
-
-        sprintf(str_buf, "key: %s, val: %s", (sds) key, (sds) val);
-        addReplyBulkCString(c, str_buf);
-        numreplies++;
 
-        if (TOID_EQUALS(node_toid, D_RO_LATENCY(root)->pe_first))
-            break;
+    for (int i = server.pm_num_shards - 1; i >= 0; i--) {
+        root = server.pm_shards[i].rootoid;
+        for (node_toid = D_RO_LATENCY(root)->pe_last;
+            !TOID_IS_NULL(node_toid);
+            node_toid = D_RO_LATENCY(node_toid)->pmem_list_prev)
+        {
+            statusFormatNode(str_buf, getPMObjectFromOid(node_toid.oid));
+            addReplyBulkCString(c, str_buf);
+            numreplies++;
 
-        node_toid = D_RO_LATENCY(node_toid)->pmem_list_prev;
+            if (TOID_EQUALS(node_toid, D_RO_LATENCY(root)->pe_first))
+                break;
+        }
     }
 
     setDeferredMultiBulkLength(c, replylen, numreplies);
@@ -368,26 +494,17 @@ void getListVictimStatusCommand(client *c) {
     void *replylen = addDeferredMultiBulkLength(c);
     unsigned long numreplies = 0;
     char str_buf[1024];
-    TOID(struct redis_pmem_root) root;
     TOID(struct key_val_pair_PM) victim_toid;
-    struct key_val_pair_PM *victim_obj;
-    void *key;
-    void *val;
-    void *pmem_base_addr;
-
-    root = server.pm_rootoid;
-    pmem_base_addr = (void *)server.pm_pool->addr;
-    for (victim_toid = D_RO_LATENCY(root)->victim_first;
-        TOID_IS_NULL(victim_toid) == 0;
-        victim_toid = D_RO_LATENCY(victim_toid)->pmem_list_next
-    ) {
-        victim_obj = (key_val_pair_PM *)(victim_toid.oid.off + (uint64_t) pmem_base_addr);
-        key = (void *)(victim_obj->key_oid.off + (uint64_t) pmem_base_addr);
-        val = (void *)(victim_obj->val_oid.off + (uint64_t) pmem_base_addr);
-
-        sprintf(str_buf, "key: %s, val: %s", (sds) key, (sds) val);
-        addReplyBulkCString(c, str_buf);
-        numreplies++;
+
+    for (int i = 0; i < server.pm_num_shards; i++) {
+        for (victim_toid = pmemShardRoot(server.pm_shards + i)->victim_first;
+            TOID_IS_NULL(victim_toid) == 0;
+            victim_toid = D_RO_LATENCY(victim_toid)->pmem_list_next
+        ) {
+            statusFormatNode(str_buf, getPMObjectFromOid(victim_toid.oid));
+            addReplyBulkCString(c, str_buf);
+            numreplies++;
+        }
     }
 
     setDeferredMultiBulkLength(c, replylen, numreplies);
@@ -66,7 +66,7 @@ static int checkStringLength(client *c, long long size) {
 
 void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire, int unit, robj *ok_reply, robj *abort_reply) {
     long long milliseconds = 0; /* initialized to avoid any harmness warning */
-#ifdef USE_PMDK
+#if defined(USE_PMDK) && !defined(TODIS)
     robj* newVal = 0;
 #endif
 
@@ -93,13 +93,12 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
         bool isNeedFree = false;
 
 #ifdef TODIS
-        if (val->encoding == OBJ_ENCODING_INT) {
-            char int_str_buf[32];
-            int int_str_buf_len = ll2string(int_str_buf, 32, (long long) val->ptr);
-            convertedVal = createStringObject(int_str_buf, int_str_buf_len);
-            isNeedFree = true;
-        }
-#endif
+        /* Copy key and value from RAM to PM in a single record, or the
+         * value alone if the key is already in PM. An INT encoded value
+         * is stored as an integer, the expire with them. */
+        if (setKeyCommitPM(c->db,key,convertedVal,
+                expire ? mstime()+milliseconds : -1) == C_ERR) error = 1;
+#else
         /* Copy value from RAM to PM - create RedisObject and sds(value) */
         TX_BEGIN(server.pm_pool) {
             newVal = dupStringObjectPM(convertedVal);
@@ -109,6 +108,7 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
         } TX_ONABORT {
             error = 1;
         } TX_END
+#endif
 
         if (isNeedFree) {
             decrRefCount(convertedVal);
@@ -125,7 +125,13 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
     setKey(c->db,key,val);
 #endif
     server.dirty++;
+#if defined(USE_PMDK) && defined(TODIS)
+    /* setKeyCommitPM() did set the expire already. */
+    if (expire && !server.persistent)
+        setExpire(c->db,key,mstime()+milliseconds);
+#else
     if (expire) setExpire(c->db,key,mstime()+milliseconds);
+#endif
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->db->id);
     if (expire) notifyKeyspaceEvent(NOTIFY_GENERIC,
         "expire",key,c->db->id);
@@ -220,6 +226,33 @@ void getCommand(client *c) {
 }
 
 void getsetCommand(client *c) {
+#ifdef TODIS
+    /* The old value is replied from a DRAM copy: the PMEM value may be
+     * overwritten in place, or freed, by the write. */
+    if (server.persistent) {
+        robj *o = lookupKeyWrite(c->db,c->argv[1]), *old = NULL;
+
+        if (o != NULL) {
+            if (checkType(c,o,OBJ_STRING)) return;
+            old = dbCopyStringValuePM(o);
+        }
+        c->argv[2] = tryObjectEncoding(c->argv[2]);
+        if (setKeyCommitPM(c->db,c->argv[1],c->argv[2],-1) == C_ERR) {
+            if (old) decrRefCount(old);
+            addReplyError(c, "setting key in PM failed!");
+            return;
+        }
+        if (old) {
+            addReplyBulk(c,old);
+            decrRefCount(old);
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+        notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[1],c->db->id);
+        server.dirty++;
+        return;
+    }
+#endif
     if (getGenericCommand(c) == C_ERR) return;
     c->argv[2] = tryObjectEncoding(c->argv[2]);
     setKey(c->db,c->argv[1],c->argv[2]);
@@ -253,7 +286,11 @@ void setrangeCommand(client *c) {
             return;
 
         o = createObject(OBJ_STRING,sdsnewlen(NULL, offset+sdslen(value)));
+#ifdef TODIS
+        if (!server.persistent) dbAdd(c->db,c->argv[1],o);
+#else
         dbAdd(c->db,c->argv[1],o);
+#endif
     } else {
         size_t olen;
 
@@ -273,18 +310,38 @@ void setrangeCommand(client *c) {
             return;
 
         /* Create a copy when the object is shared or encoded. */
+#ifdef TODIS
+        if (server.persistent)
+            o = dbCopyStringValuePM(o);
+        else
+            o = dbUnshareStringValue(c->db,c->argv[1],o);
+#else
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+#endif
     }
 
     if (sdslen(value) > 0) {
         o->ptr = sdsgrowzero(o->ptr,offset+sdslen(value));
         memcpy((char*)o->ptr+offset,value,sdslen(value));
+#ifdef TODIS
+        /* The new value built in DRAM is written to PMEM. */
+        if (server.persistent &&
+            dbWriteCommitPM(c->db,c->argv[1],o) == C_ERR)
+        {
+            decrRefCount(o);
+            addReplyError(c, "setting key in PM failed!");
+            return;
+        }
+#endif
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,
             "setrange",c->argv[1],c->db->id);
         server.dirty++;
     }
     addReplyLongLong(c,sdslen(o->ptr));
+#ifdef TODIS
+    if (server.persistent) decrRefCount(o);
+#endif
 }
 
 void getrangeCommand(client *c) {
@@ -367,6 +424,44 @@ void msetGenericCommand(client *c, int nx) {
         }
     }
 
+#ifdef TODIS
+    /* The keys are written to PMEM in a transaction per shard. */
+    if (server.persistent) {
+        char *set = zcalloc((c->argc-1)/2);
+        int retval;
+
+        for (j = 1; j < c->argc; j += 2)
+            c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
+        retval = setKeysCommitPM(c->db,c->argv+1,c->argc-1,set);
+        for (j = 1; j < c->argc; j += 2) {
+            if (!set[(j-1)/2]) continue;
+            notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[j],c->db->id);
+            server.dirty++;
+        }
+        if (retval == C_ERR) {
+            /* The pool is full: only the keys set are propagated, with a
+             * MSET of their pairs. */
+            robj **argv = zmalloc(sizeof(robj*)*c->argc);
+            int argc = 1;
+
+            argv[0] = createStringObject("MSET",4);
+            for (j = 1; j < c->argc; j += 2) {
+                if (!set[(j-1)/2]) continue;
+                argv[argc] = c->argv[j];
+                argv[argc+1] = c->argv[j+1];
+                incrRefCount(argv[argc]);
+                incrRefCount(argv[argc+1]);
+                argc += 2;
+            }
+            replaceClientCommandVector(c,argc,argv);
+            addReplyError(c, "setting key in PM failed!");
+        } else {
+            addReply(c, nx ? shared.cone : shared.ok);
+        }
+        zfree(set);
+        return;
+    }
+#endif
     for (j = 1; j < c->argc; j += 2) {
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         setKey(c->db,c->argv[j],c->argv[j+1]);
@@ -400,6 +495,26 @@ void incrDecrCommand(client *c, long long incr) {
     }
     value += incr;
 
+#ifdef TODIS
+    /* The new value is written to PMEM: an integer replacing the integer
+     * of a PMEM key is a single 8 bytes store. */
+    if (server.persistent) {
+        new = createStringObjectFromLongLong(value);
+        if (dbWriteCommitPM(c->db,c->argv[1],new) == C_ERR) {
+            decrRefCount(new);
+            addReplyError(c, "setting key in PM failed!");
+            return;
+        }
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_STRING,"incrby",c->argv[1],c->db->id);
+        server.dirty++;
+        addReply(c,shared.colon);
+        addReply(c,new);
+        addReply(c,shared.crlf);
+        decrRefCount(new);
+        return;
+    }
+#endif
     if (o && o->refcount == 1 && o->encoding == OBJ_ENCODING_INT &&
         (value < 0 || value >= OBJ_SHARED_INTEGERS) &&
         value >= LONG_MIN && value <= LONG_MAX)
@@ -460,10 +575,25 @@ void incrbyfloatCommand(client *c) {
         return;
     }
     new = createStringObjectFromLongDouble(value,1);
+#ifdef TODIS
+    if (server.persistent) {
+        if (dbWriteCommitPM(c->db,c->argv[1],new) == C_ERR) {
+            decrRefCount(new);
+            addReplyError(c, "setting key in PM failed!");
+            return;
+        }
+    } else {
+        if (o)
+            dbOverwrite(c->db,c->argv[1],new);
+        else
+            dbAdd(c->db,c->argv[1],new);
+    }
+#else
     if (o)
         dbOverwrite(c->db,c->argv[1],new);
     else
         dbAdd(c->db,c->argv[1],new);
+#endif
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"incrbyfloat",c->argv[1],c->db->id);
     server.dirty++;
@@ -476,6 +606,9 @@ void incrbyfloatCommand(client *c) {
     rewriteClientCommandArgument(c,0,aux);
     decrRefCount(aux);
     rewriteClientCommandArgument(c,2,new);
+#ifdef TODIS
+    if (server.persistent) decrRefCount(new);
+#endif
 }
 
 void appendCommand(client *c) {
@@ -486,8 +619,20 @@ void appendCommand(client *c) {
     if (o == NULL) {
         /* Create the key */
         c->argv[2] = tryObjectEncoding(c->argv[2]);
+#ifdef TODIS
+        if (server.persistent) {
+            if (dbWriteCommitPM(c->db,c->argv[1],c->argv[2]) == C_ERR) {
+                addReplyError(c, "setting key in PM failed!");
+                return;
+            }
+        } else {
+            dbAdd(c->db,c->argv[1],c->argv[2]);
+            incrRefCount(c->argv[2]);
+        }
+#else
         dbAdd(c->db,c->argv[1],c->argv[2]);
         incrRefCount(c->argv[2]);
+#endif
         totlen = stringObjectLen(c->argv[2]);
     } else {
         /* Key exists, check type */
@@ -501,9 +646,29 @@ void appendCommand(client *c) {
             return;
 
         /* Append the value */
+#ifdef TODIS
+        /* The new value is built in DRAM and written to PMEM, in place
+         * when the allocation of the old value has room for it. */
+        if (server.persistent) {
+            o = dbCopyStringValuePM(o);
+            o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
+            totlen = sdslen(o->ptr);
+            if (dbWriteCommitPM(c->db,c->argv[1],o) == C_ERR) {
+                decrRefCount(o);
+                addReplyError(c, "setting key in PM failed!");
+                return;
+            }
+            decrRefCount(o);
+        } else {
+            o = dbUnshareStringValue(c->db,c->argv[1],o);
+            o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
+            totlen = sdslen(o->ptr);
+        }
+#else
         o = dbUnshareStringValue(c->db,c->argv[1],o);
         o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
         totlen = sdslen(o->ptr);
+#endif
     }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"append",c->argv[1],c->db->id);
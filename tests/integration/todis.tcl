@@ -0,0 +1,630 @@
+set server_path [file normalize [tmpdir server.todis]]
+set defaults [list dir $server_path pmfile "$server_path/todis.pm 64mb" \
+    save {""}]
+
+# Kills the server without letting it shut down, like a crash.
+proc crash_server_todis {} {
+    set pid [srv 0 pid]
+    catch {exec kill -9 $pid}
+    wait_for_condition 50 100 {
+        [catch {exec ps -p $pid}]
+    } else {
+        fail "Server didn't exit after SIGKILL"
+    }
+}
+
+tags {"todis"} {
+    file delete "$server_path/master.pm" "$server_path/replica.pm"
+    set config [list dir $server_path save {""} max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]
+
+    start_server [list overrides [concat $config \
+        [list pmfile "$server_path/master.pm 64mb"]]] {
+        start_server [list overrides [concat $config \
+            [list pmfile "$server_path/replica.pm 64mb"]]] {
+            test "Writes to DRAM keys reach the replica in order" {
+                r slaveof [srv -1 host] [srv -1 port]
+                wait_for_condition 50 100 {
+                    [s master_link_status] eq {up}
+                } else {
+                    fail "Replication not started"
+                }
+                for {set j 1} {$j <= 1300} {incr j} {
+                    r -1 set k$j $j
+                }
+                set dram [r -1 dramstatus]
+                foreach key {k1 k2 k3 k4 k5} {
+                    assert {[lsearch -glob $dram "key: $key, *"] >= 0}
+                }
+                r -1 incr k1
+                r -1 incrbyfloat k2 0.5
+                r -1 append k3 x
+                r -1 setrange k4 1 y
+                r -1 decr k5
+                r -1 set sync done
+                wait_for_condition 50 100 {
+                    [r get sync] eq {done}
+                } else {
+                    fail "Writes did not reach the replica"
+                }
+                assert_equal [r -1 mget k1 k2 k3 k4 k5 k1300] \
+                    [r mget k1 k2 k3 k4 k5 k1300]
+                r -1 mget k1 k2 k3 k4 k5
+            } {2 2.5 3x 4y 4}
+        }
+    }
+
+    foreach path {transaction publish} {
+        file delete "$server_path/todis.pm"
+        set config [concat $defaults [list pmem-write-path $path]]
+
+        start_server [list overrides $config] {
+            test "SET with a TTL in PMEM ($path)" {
+                r set foo bar ex 1000
+                r set num 10 px 1000000
+                r setex baz 1000 qux
+                r set persisted bar ex 1000
+                r set persisted bar
+                list [r ttl foo] [r ttl num] [r ttl baz] [r ttl persisted]
+            } {1000 1000 1000 -1}
+
+            crash_server_todis
+        }
+
+        start_server [list overrides $config] {
+            test "TTL of the PMEM keys survives a crash ($path)" {
+                assert_equal {bar 10 qux bar} \
+                    [r mget foo num baz persisted]
+                assert {[r ttl foo] > 990 && [r ttl foo] <= 1000}
+                assert {[r pttl num] > 990000 && [r pttl num] <= 1000000}
+                assert {[r ttl baz] > 990 && [r ttl baz] <= 1000}
+                r ttl persisted
+            } {-1}
+        }
+    }
+
+    foreach spill {no yes} {
+        file delete "$server_path/todis.pm" "$server_path/appendonly.aof" \
+            "$server_path/appendonly.aof.spill"
+        set config [concat $defaults [list appendonly yes \
+            max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru \
+            pmem-spill-log $spill]]
+
+        start_server [list overrides $config] {
+            test "Deleting keys demoted to DRAM (spill log $spill)" {
+                for {set j 1} {$j <= 1300} {incr j} {
+                    r set k$j v$j
+                }
+                assert_equal raw [r object encoding k1]
+                assert_equal embpm [r object encoding k1300]
+                r del k1 k2 k1300
+            } {3}
+        }
+
+        start_server [list overrides $config] {
+            test "Keys demoted then deleted stay deleted after a restart (spill log $spill)" {
+                list [r exists k1] [r exists k2] [r exists k1300] [r get k3] \
+                    [r get k1299] [r dbsize]
+            } {0 0 0 v3 v1299 1297}
+        }
+    }
+
+    file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+    set config [concat $defaults [list appendonly yes pmem-tiering lfu \
+        pmem-lfu-log-factor 0 max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]]
+
+    start_server [list overrides $config] {
+        test "LFU tiering promotes the hot keys to PMEM" {
+            for {set j 1} {$j <= 1300} {incr j} {
+                r set k$j v$j
+            }
+            for {set i 0} {$i < 20} {incr i} {
+                for {set j 1} {$j <= 40} {incr j} {
+                    r get k$j
+                }
+            }
+            wait_for_condition 50 100 {
+                [status r pmem_tier_promoted_keys] > 0
+            } else {
+                fail "No key promoted to PMEM"
+            }
+            set promoted {}
+            for {set j 1} {$j <= 40} {incr j} {
+                if {[r object encoding k$j] eq "embpm"} {lappend promoted k$j}
+            }
+            assert {[llength $promoted] > 0}
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "Tiered keys survive a restart" {
+            for {set j 1} {$j <= 1300} {incr j} {
+                if {[r get k$j] ne "v$j"} {
+                    fail "k$j is lost or has a wrong value"
+                }
+            }
+            foreach key $promoted {
+                assert_equal embpm [r object encoding $key]
+            }
+            r dbsize
+        } {1300}
+    }
+
+    file delete "$server_path/todis.pm"
+    set config [concat $defaults [list pmem-reconstruct-threads 4]]
+
+    start_server [list overrides $config] {
+        test "Keys written before a crash (parallel reconstruction)" {
+            for {set j 0} {$j < 5000} {incr j} {
+                r set key$j val$j
+            }
+            r select 3
+            for {set j 0} {$j < 100} {incr j} {
+                r set other$j $j
+            }
+            r select 9
+            r dbsize
+        } {5000}
+
+        crash_server_todis
+    }
+
+    start_server [list overrides $config] {
+        test "Parallel reconstruction restores the keys of every db" {
+            assert_match "*5100 keys with 4 threads*" \
+                [exec grep "PMEM reconstruction" [srv 0 stdout]]
+            for {set j 0} {$j < 5000} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            assert_equal embpm [r object encoding key42]
+            r select 3
+            set other [list [r dbsize] [r get other99]]
+            r select 9
+            list [r dbsize] $other
+        } {5000 {100 99}}
+    }
+
+    file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+    set config [concat $defaults [list appendonly yes \
+        max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru]]
+
+    start_server [list overrides $config] {
+        test "Same keys in two dbs written before a restart" {
+            for {set j 1} {$j <= 300} {incr j} {
+                r set k$j v$j
+            }
+            r select 3
+            for {set j 1} {$j <= 300} {incr j} {
+                r set k$j w$j
+            }
+            r select 9
+            r dbsize
+        } {300}
+    }
+
+    start_server [list overrides $config] {
+        test "Victims are resolved in their own db after a restart" {
+            for {set j 1} {$j <= 600} {incr j} {
+                r set n$j v$j
+            }
+            assert {[status r pmem_evicted_keys] > 0}
+            for {set j 1} {$j <= 300} {incr j} {
+                if {[r get k$j] ne "v$j"} {
+                    fail "k$j has a wrong value in db 9"
+                }
+            }
+            r select 3
+            for {set j 1} {$j <= 300} {incr j} {
+                if {[r get k$j] ne "w$j"} {
+                    fail "k$j has a wrong value in db 3"
+                }
+            }
+            set other [r dbsize]
+            r select 9
+            list [r dbsize] $other
+        } {900 300}
+    }
+
+    file delete "$server_path/todis.pm"
+    set config [concat $defaults [list pmem-lazy-reconstruct yes \
+        pmem-index-buckets 1024]]
+
+    start_server [list overrides $config] {
+        test "Keys written before a crash (lazy reconstruction)" {
+            for {set j 0} {$j < 3000} {incr j} {
+                r set key$j val$j
+            }
+            r set key1 new1
+            r del key2
+            r dbsize
+        } {2999}
+
+        crash_server_todis
+    }
+
+    start_server [list overrides $config] {
+        test "Lazy reconstruction serves the keys from the hash index" {
+            assert_match "*lazy reconstruction*" \
+                [exec grep "PMEM lazy reconstruction" [srv 0 stdout]]
+            # Answered while warming up, from the index counters and the
+            # index lookups.
+            assert_equal 2999 [r dbsize]
+            assert_equal {new1 {} val3} [r mget key1 key2 key3]
+            r set key4 new4
+            r del key5
+            wait_for_condition 50 100 {
+                [status r pmem_warming] == 0
+            } else {
+                fail "PMEM warm-up not done"
+            }
+            assert {[status r pmem_warmup_keys] > 0}
+            for {set j 6} {$j < 3000} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            list [r mget key1 key2 key4 key5] [r dbsize]
+        } {{new1 {} new4 {}} 2998}
+    }
+
+    file delete "$server_path/todis.pm"
+
+    start_server [list overrides $defaults] {
+        test "Records and outgrown values written before a crash" {
+            r set small bar
+            r set grown bar
+            r set grown [string repeat x 1000]
+            r set int 12345
+            list [r object encoding small] [r object encoding grown]
+        } {embpm raw}
+
+        crash_server_todis
+    }
+
+    start_server [list overrides $defaults] {
+        test "Records and outgrown values survive a crash" {
+            assert_equal embpm [r object encoding small]
+            assert_equal [string repeat x 1000] [r get grown]
+            list [r get small] [r get int] [r dbsize]
+        } {bar 12345 3}
+    }
+
+    file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+    set config [concat $defaults [list appendonly yes \
+        pmem-write-path publish max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]]
+
+    start_server [list overrides $config] {
+        test "Writes published without a transaction" {
+            for {set j 1} {$j <= 1300} {incr j} {
+                r set k$j v$j
+            }
+            # k1 is in DRAM: the write promotes it.
+            assert_equal raw [r object encoding k1]
+            r set k1 promoted
+            r set k1299 short
+            r set k1300 [string repeat y 100]
+            r set num 10
+            r set num 20
+            list [r object encoding k1] [r get k1299] [r get num]
+        } {embpm short 20}
+
+        crash_server_todis
+    }
+
+    start_server [list overrides $config] {
+        test "Published writes survive a crash" {
+            assert_equal [string repeat y 100] [r get k1300]
+            for {set j 2} {$j <= 1298} {incr j} {
+                if {[r get k$j] ne "v$j"} {
+                    fail "k$j is lost or has a wrong value"
+                }
+            }
+            list [r get k1] [r get k1299] [r get num] [r dbsize]
+        } {promoted short 20 1301}
+    }
+
+    file delete "$server_path/todis.pm"
+    set config [concat $defaults [list pmem-write-path publish]]
+
+    start_server [list overrides $config] {
+        test "In-place overwrites of PMEM values" {
+            r set short aaaaaaaa
+            r set long [string repeat a 100]
+            r set short bbbbbbbb
+            r set long [string repeat b 90]
+            list [r object encoding short] [r object encoding long] \
+                [r get short] [string length [r get long]]
+        } {embpm embpm bbbbbbbb 90}
+
+        test "Crash after the redo record of an overwrite" {
+            catch {r debug pmem-redo-crash short cccccccc}
+            wait_for_condition 50 100 {
+                [catch {exec ps -p [srv 0 pid]}]
+            } else {
+                fail "Server didn't exit after DEBUG PMEM-REDO-CRASH"
+            }
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "The interrupted overwrite is replayed from the redo record" {
+            assert_match "*completed from the redo record*" \
+                [exec cat [srv 0 stdout]]
+            list [r get short] [r get long]
+        } [list cccccccc [string repeat b 90]]
+
+        test "Overwrites after the replay" {
+            r set short dddddddd
+            r set long [string repeat e 100]
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "In-place overwrites survive a crash" {
+            list [r get short] [r get long] [r object encoding short]
+        } [list dddddddd [string repeat e 100] embpm]
+    }
+
+    file delete "$server_path/todis.pm"
+
+    start_server [list overrides $defaults] {
+        test "Integers are stored in the PMEM node" {
+            r set counter 10
+            for {set j 0} {$j < 100} {incr j} {
+                r incr counter
+            }
+            r decrby counter 30
+            r set negative -123456789
+            r set fromstring abc
+            r set fromstring 42
+            r set tostring 7
+            r append tostring xyz
+            list [r object encoding counter] [r get counter] \
+                [r object encoding negative] [r object encoding fromstring] \
+                [r get tostring]
+        } {int 80 int int 7xyz}
+
+        test "Integers survive a crash" {
+            set used [s used_pmem_memory]
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $defaults] {
+        test "Integers are restored from the PMEM node" {
+            assert_equal $used [s used_pmem_memory]
+            r incr counter
+            list [r get counter] [r get negative] [r get fromstring] \
+                [r get tostring] [r object encoding counter]
+        } {81 -123456789 42 7xyz int}
+    }
+
+    file delete "$server_path/todis.pm"
+
+    start_server [list overrides $defaults] {
+        test "PMEM keys are counted per db" {
+            foreach db {0 3 15} {
+                r select $db
+                for {set j 0} {$j < 10 + $db} {incr j} {
+                    r set key$j db$db
+                }
+            }
+            r select 5
+            r set gone x
+            r flushdb
+            r select 3
+            r expire key0 1000
+            r move key0 4
+            r select 9
+            set keyspace [r info keyspace]
+            assert_match "*db0:keys=10,*pmem=10*" $keyspace
+            assert_match "*db3:keys=12,*pmem=12*" $keyspace
+            assert_match "*db4:keys=1,*pmem=1*" $keyspace
+            assert_match "*db15:keys=25,*pmem=25*" $keyspace
+            assert {![string match "*db5:*" $keyspace]}
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $defaults] {
+        test "PMEM keys are restored in their db" {
+            set reply {}
+            foreach db {0 3 4 5 15} {
+                r select $db
+                lappend reply [r dbsize] [r get key1]
+            }
+            r select 4
+            lappend reply [r get key0]
+            set ttl [r ttl key0]
+            assert {$ttl > 900 && $ttl <= 1000}
+            r select 9
+            set reply
+        } {10 db0 12 db3 1 {} 0 {} 25 db15 db3}
+    }
+
+    # The shards are included, as the overrides hold one line per directive.
+    set shards "$server_path/shards.conf"
+    set fp [open $shards w]
+    for {set j 0} {$j < 3} {incr j} {
+        file delete "$server_path/shard$j.pm"
+        puts $fp "pmfile $server_path/shard$j.pm 32mb"
+    }
+    close $fp
+    set config [list dir $server_path save {""} include $shards]
+
+    start_server [list overrides $config] {
+        test "PMEM keys are sharded across the pmfile pools" {
+            for {set j 0} {$j < 3000} {incr j} {
+                r set key$j val$j
+            }
+            r select 2
+            for {set j 0} {$j < 100} {incr j} {
+                r set key$j db2
+            }
+            r select 9
+            set info [r info tiering]
+            set total 0
+            for {set j 0} {$j < 3} {incr j} {
+                assert {[regexp "pmem_shard$j:path=\[^,\]*shard$j.pm,size=\[0-9\]+,keys=(\\d+)," \
+                    $info -> keys]}
+                assert {$keys > 500}
+                incr total $keys
+            }
+            list [status r pmem_shards] $total
+        } {3 3100}
+
+        test "Sharded keys survive a crash" {
+            r del key0
+            r set key1 changed
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "Every shard is reconstructed" {
+            for {set j 2} {$j < 3000} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            set reply [list [r dbsize] [r exists key0] [r get key1]]
+            r select 2
+            lappend reply [r dbsize] [r get key99]
+            r select 9
+            set reply
+        } {2999 0 changed 100 db2}
+    }
+
+    file delete "$server_path/todis.pm" "$server_path/part1.pm" \
+        "$server_path/appendonly.aof"
+    set config [concat $defaults [list appendonly yes \
+        max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru]]
+
+    start_server [list overrides $config] {
+        test "PMEMADDPART grows the PMEM tier online" {
+            for {set j 0} {$j < 600} {incr j} {
+                r set key$j val$j
+            }
+            set max [status r max_pmem_memory]
+            assert_equal OK [r pmemaddpart "$server_path/part1.pm" 64mb]
+            assert {[status r max_pmem_memory] > $max}
+            set evicted [status r pmem_evicted_keys]
+            for {set j 600} {$j < 1200} {incr j} {
+                r set key$j val$j
+            }
+            regexp {pmem_shard1:[^\r]*keys=(\d+),} [r info tiering] -> keys
+            assert {$keys > 200}
+            assert_equal $evicted [status r pmem_evicted_keys]
+            list [status r pmem_shards] [r dbsize]
+        } {2 1200}
+
+        # The parts are recovered from the pmfile lines of the rewritten
+        # config.
+        set fp [open "$server_path/parts.conf" w]
+        foreach line [split [exec cat [srv 0 config_file]] "\n"] {
+            if {[string match "pmfile *" $line] ||
+                [string match "max-pmem-memory *" $line]} {
+                puts $fp $line
+            }
+        }
+        close $fp
+        crash_server_todis
+    }
+
+    set config [list dir $server_path save {""} appendonly yes \
+        max-pmem-memory-policy allkeys-lru \
+        include "$server_path/parts.conf"]
+    start_server [list overrides $config] {
+        test "Keys of both parts are recovered at restart" {
+            for {set j 0} {$j < 1200} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            list [status r pmem_shards] [r dbsize] \
+                [lindex [split [status r pmem_shard1] ,] 0]
+        } [list 2 1200 "path=$server_path/part1.pm"]
+    }
+
+    file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+    set config [concat $defaults [list appendonly yes \
+        max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru]]
+
+    start_server [list overrides $config] {
+        test "The AOF rewrite skips the PMEM keys" {
+            for {set j 1} {$j <= 1000} {incr j} {
+                r set key$j val$j
+            }
+            set dram {}
+            foreach line [r dramstatus] {
+                if {[regexp {^key: ([^,]+),} $line -> key]} {
+                    lappend dram $key
+                }
+            }
+            assert {[llength $dram] > 200}
+            r bgrewriteaof
+            waitForBgrewriteaof r
+            # exec translates the CRLF line endings to LF.
+            set aof [exec cat "$server_path/appendonly.aof"]
+            foreach key $dram {
+                if {![string match "*\n$key\n*" $aof]} {
+                    fail "DRAM key $key is not in the AOF"
+                }
+            }
+            # key1000 is the last key written, so it is still in PMEM.
+            assert_equal embpm [r object encoding key1000]
+            assert {![string match "*\nkey1000\n*" $aof]}
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "Keys of both tiers are restored after the rewrite" {
+            for {set j 1} {$j <= 1000} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            r dbsize
+        } {1000}
+    }
+
+    file delete "$server_path/todis.pm"
+    set config [concat $defaults [list pmem-group-commit yes]]
+
+    start_server [list overrides $config] {
+        test "Writes replied by a group commit survive a crash" {
+            set rd [redis_deferring_client]
+            for {set j 0} {$j < 500} {incr j} {
+                $rd set key$j val$j
+            }
+            $rd incr counter
+            $rd incr counter
+            $rd append key1 more
+            $rd del key2
+            $rd mset m1 a m2 b
+            for {set j 0} {$j < 505} {incr j} {
+                $rd read
+            }
+            $rd close
+            crash_server_todis
+        }
+    }
+
+    start_server [list overrides $config] {
+        test "The group commits are restored" {
+            for {set j 3} {$j < 500} {incr j} {
+                if {[r get key$j] ne "val$j"} {
+                    fail "key$j is lost or has a wrong value"
+                }
+            }
+            list [r get key0] [r get key1] [r exists key2] [r get counter] \
+                [r mget m1 m2] [r dbsize]
+        } {val0 val1more 0 2 {a b} 502}
+    }
+}
@@ -41,10 +41,12 @@ set ::all_tests {
     integration/rdb
     integration/convert-zipmap-hash-on-load
     integration/logging
+    integration/todis
     unit/pubsub
     unit/slowlog
     unit/scripting
     unit/maxmemory
+    unit/todis
     unit/introspection
     unit/introspection-2
     unit/limits
@@ -0,0 +1,540 @@
+set server_path [file normalize [tmpdir server.todis]]
+set defaults [list dir $server_path pmfile "$server_path/todis.pm 64mb"]
+
+# Writes the keys k1..k$count, reads $hot keys from k$first one LRU clock
+# tick later, then writes the keys n1..n$more, pushing keys out of PMEM.
+# Returns the keys demoted to DRAM.
+proc todis_evict_after_reads {count hot more {first 1}} {
+    for {set j 1} {$j <= $count} {incr j} {
+        r set k$j v$j
+    }
+    after 1100
+    for {set j $first} {$j < $first + $hot} {incr j} {
+        r get k$j
+    }
+    for {set j 1} {$j <= $more} {incr j} {
+        r set n$j v$j
+    }
+    wait_for_condition 50 100 {
+        [status r used_pmem_memory] <= [status r max_pmem_memory]
+    } else {
+        fail "PMEM memory not evicted"
+    }
+    set dram {}
+    foreach line [r dramstatus] {
+        if {[regexp {^key: ([^,]+),} $line -> key]} {lappend dram $key}
+    }
+    return $dram
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides $defaults] {
+    test {PMEMLATENCY reports the configured latencies} {
+        r config set pm-read-latency 100
+        r config set pm-write-latency 200
+        r config set pm-write-bandwidth 1000
+        set reply [r pmemlatency 100]
+        r config set pm-read-latency 0
+        r config set pm-write-latency 0
+        r config set pm-write-bandwidth 0
+        assert_equal 14 [llength $reply]
+        assert {[dict get $reply "measured read latency:"] > 0}
+        assert {[dict get $reply "measured write latency:"] > 0}
+        list [dict get $reply "read latency (ns/line):"] \
+            [dict get $reply "write latency (ns/line):"] \
+            [dict get $reply "write bandwidth (MB/s):"]
+    } {100 200 1000}
+
+    test {PMEMLATENCY measures the emulated write bandwidth} {
+        r config set pm-write-bandwidth 100
+        set reply [r pmemlatency 100]
+        r config set pm-write-bandwidth 0
+        set bw [dict get $reply "measured write bandwidth:"]
+        assert {$bw > 0 && $bw <= 110}
+    }
+
+    test {PMEMLATENCY with wrong arguments} {
+        assert_error "*positive*" {r pmemlatency 0}
+        assert_error "*not an integer*" {r pmemlatency foo}
+        assert_error "*syntax*" {r pmemlatency 10 10}
+    }
+
+    test {PMEMTRACE records the PMEM writes} {
+        if {[catch {r pmemtrace} err]} {
+            # Only a TODIS_TRACE=yes build records the trace.
+            assert_match "*not compiled in*" $err
+        } else {
+            assert_equal OK [r pmemtrace reset]
+            r set foo bar
+            assert_match "*dict-add*" [r pmemtrace]
+            assert_equal 1 [llength [r pmemtrace 1]]
+            assert_error "*positive*" {r pmemtrace 0}
+            assert_error "*syntax*" {r pmemtrace 1 1}
+        }
+    }
+
+    test {PMEMADDPART adds a shard} {
+        set part "$server_path/part1.pm"
+        file delete $part "$server_path/part2.pm"
+        assert_error "*invalid part size*" {r pmemaddpart $part 1mb}
+        assert_error "*already in use*" \
+            {r pmemaddpart "$server_path/todis.pm" 64mb}
+        set max [status r max_pmem_memory]
+        assert_equal OK [r pmemaddpart $part 32mb]
+        assert_error "*already in use*" {r pmemaddpart $part 32mb}
+        close [open "$server_path/part2.pm" w]
+        assert_error "*file exists*" \
+            {r pmemaddpart "$server_path/part2.pm" 32mb}
+        assert {[status r max_pmem_memory] > $max}
+        r flushdb
+        for {set j 0} {$j < 100} {incr j} {
+            r set key$j val$j
+        }
+        assert_match "*pmfile $part*" [exec cat [srv 0 config_file]]
+        list [status r pmem_shards] [r get key42] [r dbsize]
+    } {2 val42 100}
+
+    test {OBJECT FREQ needs the LFU tiering} {
+        r set foo bar
+        assert_error "*LFU pmem-tiering is not selected*" {r object freq foo}
+    }
+
+    test {CONFIG SET of the PMEM options} {
+        foreach {option value} {
+            pmem-fire-evict-percent 90
+            pmem-stop-evict-percent 80
+            pmem-lfu-log-factor 5
+            pmem-lfu-decay-time 2
+            pmem-promote-per-sec 100
+            pmem-demote-per-sec 100
+            pmem-read-cache-size 1048576
+            max-pmem-memory-policy allkeys-lru
+            pmem-write-path publish
+        } {
+            r config set $option $value
+            assert_equal [list $option $value] [r config get $option]
+        }
+        assert_error "*Invalid argument*" \
+            {r config set pmem-fire-evict-percent 101}
+        assert_error "*Invalid argument*" \
+            {r config set pmem-write-path foo}
+        assert_error "*Unsupported CONFIG parameter*" \
+            {r config set pmem-tiering lfu}
+        r config set pmem-read-cache-size 1mb
+        status r pmem_read_cache_size
+    } {1048576}
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list pmem-tiering lfu pmem-lfu-log-factor 0 max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]]] {
+    test {OBJECT FREQ counts the reads} {
+        r set foo bar
+        set freq [r object freq foo]
+        for {set j 0} {$j < 10} {incr j} {
+            r get foo
+        }
+        expr {[r object freq foo] - $freq}
+    } {10}
+
+    test {INFO tiering reports the LFU tiering} {
+        for {set j 1} {$j <= 1300} {incr j} {
+            r set k$j v$j
+        }
+        assert_equal raw [r object encoding k1]
+        for {set i 0} {$i < 20} {incr i} {
+            for {set j 1} {$j <= 40} {incr j} {
+                r get k$j
+            }
+        }
+        wait_for_condition 50 100 {
+            [status r pmem_tier_promoted_keys] > 0
+        } else {
+            fail "No key promoted to PMEM"
+        }
+        assert_equal lfu [status r pmem_tiering]
+        assert {[status r pmem_tier_demoted_keys] > 0}
+        assert {[status r used_pmem_memory] <= [status r max_pmem_memory]}
+        list [r get k1] [r get k1300] [r dbsize]
+    } {v1 v1300 1301}
+}
+
+file delete "$server_path/small.pm"
+start_server [list tags {"todis"} overrides [list dir $server_path \
+    pmfile "$server_path/small.pm 8mb"]] {
+    set big [string repeat x 500000]
+
+    test {MSET filling the pool fails the command, not the server} {
+        for {set j 0} {$j < 100} {incr j} {
+            if {[catch {r set s$j $big} err]} break
+        }
+        assert_match "*setting key in PM failed*" $err
+        assert_error "*setting key in PM failed*" \
+            {r mset m0 $big m1 $big m2 $big m3 $big m4 $big}
+        assert {[r exists m0 m1 m2 m3 m4] < 5}
+        r mset a 1 b 2
+        list [r mget a b] [string length [r get s2]]
+    } {{1 2} 500000}
+}
+
+file delete "$server_path/small.pm"
+start_server [list tags {"todis"} overrides [list dir $server_path \
+    pmfile "$server_path/small.pm 8mb" pmem-group-commit yes]] {
+    test {A group commit filling the pool fails the command, not the server} {
+        set big [string repeat x 500000]
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 20} {incr j} {
+            $rd set g$j $big
+        }
+        $rd append g0 foo
+        $rd set small value
+        $rd ping
+        set ok 0
+        set failed 0
+        for {set j 0} {$j < 21} {incr j} {
+            if {[catch {$rd read} err]} {
+                assert_match "*setting key in PM failed*" $err
+                incr failed
+            } else {
+                incr ok
+            }
+        }
+        assert {$ok > 0 && $failed > 0}
+        assert_equal {OK PONG} [list [$rd read] [$rd read]]
+        $rd close
+        assert_equal [expr {$ok + 1}] [r dbsize]
+        list [r get small] [string length [r get g0]]
+    } {value 500000}
+}
+
+foreach policy {allkeys-random allkeys-sampled-lru} {
+    file delete "$server_path/todis.pm"
+    start_server [list tags {"todis"} overrides [concat $defaults \
+        [list max-pmem-memory 100kb max-pmem-memory-policy $policy]]] {
+        test "PMEM eviction with $policy" {
+            set dram [todis_evict_after_reads 600 50 300]
+            assert {[llength $dram] > 0}
+            regexp {pmem=([0-9]+)} [r info keyspace] -> pmem
+            assert_equal [r dbsize] [expr {[llength $dram] + $pmem}]
+            if {$policy eq {allkeys-sampled-lru}} {
+                # The keys read last are the most recently used.
+                for {set j 1} {$j <= 50} {incr j} {
+                    assert {[lsearch $dram k$j] < 0}
+                }
+            }
+            list [r get k1] [r get k600] [r get n300] [r dbsize]
+        } {v1 v600 v300 900}
+    }
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list pmem-tiering lfu pmem-lfu-log-factor 0 max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-sampled-lru]]] {
+    test {Sampled LRU eviction ranks by frequency with LFU tiering} {
+        for {set j 1} {$j <= 600} {incr j} {
+            r set k$j v$j
+        }
+        for {set i 0} {$i < 10} {incr i} {
+            for {set j 1} {$j <= 50} {incr j} {
+                r get k$j
+            }
+        }
+        for {set j 1} {$j <= 300} {incr j} {
+            r set n$j v$j
+        }
+        set dram {}
+        foreach line [r dramstatus] {
+            if {[regexp {^key: ([^,]+),} $line -> key]} {lappend dram $key}
+        }
+        assert {[llength $dram] > 0}
+        for {set j 1} {$j <= 50} {incr j} {
+            assert {[lsearch $dram k$j] < 0}
+        }
+        list [r get k1] [r get n300] [r dbsize]
+    } {v1 v300 900}
+}
+
+foreach volatile {no yes} {
+    file delete "$server_path/todis.pm"
+    start_server [list tags {"todis"} overrides [concat $defaults \
+        [list max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru \
+            pmem-volatile-lru $volatile]]] {
+        test "PMEM eviction in exact LRU order (pmem-volatile-lru $volatile)" {
+            set dram [todis_evict_after_reads 600 50 300]
+            assert {[llength $dram] > 0}
+            # The persistent list is ordered by the writes only, the DRAM
+            # order by the reads too: the oldest keys are demoted first.
+            set first [expr {$volatile eq {yes} ? 51 : 1}]
+            set expected {}
+            for {set j $first} {$j < $first + [llength $dram]} {incr j} {
+                lappend expected k$j
+            }
+            assert_equal $expected [lsort -dictionary $dram]
+            list [r get k1] [r get k51] [r get n300] [r dbsize]
+        } {v1 v51 v300 900}
+    }
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list max-pmem-memory 100kb max-pmem-memory-policy allkeys-clock]]] {
+    test {PMEM eviction with allkeys-clock gives a second chance} {
+        # The hand starts at the newest keys: the keys read are the first
+        # ones it examines, and are skipped for their reference bit.
+        set dram [todis_evict_after_reads 600 50 300 551]
+        assert {[llength $dram] > 0}
+        assert {[lsearch $dram k550] >= 0}
+        for {set j 551} {$j <= 600} {incr j} {
+            assert {[lsearch $dram k$j] < 0}
+        }
+        list [r get k1] [r get k600] [r get n300] [r dbsize]
+    } {v1 v600 v300 900}
+
+    test {allkeys-clock evicts the keys read once their bit is cleared} {
+        # A full turn of the clock clears every reference bit.
+        for {set j 301} {$j <= 3000} {incr j} {
+            r set n$j v$j
+        }
+        set dram {}
+        foreach line [r dramstatus] {
+            if {[regexp {^key: ([^,]+),} $line -> key]} {lappend dram $key}
+        }
+        assert {[lsearch $dram k600] >= 0}
+        list [r get k600] [r dbsize]
+    } {v600 3600}
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru \
+        pmem-fire-evict-percent 90 pmem-stop-evict-percent 50]]] {
+    test {Background PMEM eviction down to the stop watermark} {
+        # Over the fire watermark, but still under max-pmem-memory: only
+        # the cron evicts.
+        for {set j 1} {$j <= 650} {incr j} {
+            r set k$j v$j
+        }
+        wait_for_condition 50 100 {
+            [status r used_pmem_memory] <= [status r max_pmem_memory] / 2
+        } else {
+            fail "PMEM memory not evicted in the background"
+        }
+        assert {[status r pmem_evicted_keys] > 0}
+        # Under the fire watermark nothing more is evicted.
+        set evicted [status r pmem_evicted_keys]
+        after 300
+        assert_equal $evicted [status r pmem_evicted_keys]
+        list [r get k1] [r get k650] [r dbsize]
+    } {v1 v650 650}
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides $defaults] {
+    test {A PMEM record holds the key and the value in one allocation} {
+        r set foo bar
+        assert_equal embpm [r object encoding foo]
+        set record [status r used_pmem_memory]
+        assert {$record > 0 && $record < 256}
+        # A value outgrowing the record gets an allocation of its own.
+        r set foo [string repeat x 1000]
+        assert_equal raw [r object encoding foo]
+        assert {[status r used_pmem_memory] > $record + 1000}
+        r set bar baz
+        r del foo
+        assert_equal $record [status r used_pmem_memory]
+        r del bar
+        status r used_pmem_memory
+    } {0}
+}
+
+file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list max-pmem-memory 100kb max-pmem-memory-policy allkeys-lru]]] {
+    test {INFO tiering counts the hits of each tier} {
+        r config resetstat
+        set dram [todis_evict_after_reads 700 0 100]
+        assert {[llength $dram] > 0}
+        r get n100
+        r get n100
+        r get [lindex $dram 0]
+        list [status r pmem_keyspace_hits] [status r dram_keyspace_hits] \
+            [status r pmem_hit_ratio] [status r dram_hit_ratio]
+    } {2 1 0.6667 0.3333}
+
+    test {INFO tiering reports the evictions and the commit latency} {
+        assert {[status r pmem_evicted_keys] >= [llength $dram]}
+        assert {[status r pmem_commits] >= 800}
+        set p50 [status r pmem_commit_p50_ns]
+        set p99 [status r pmem_commit_p99_ns]
+        set p999 [status r pmem_commit_p999_ns]
+        assert {$p50 > 0 && $p50 <= $p99 && $p99 <= $p999}
+        assert {[status r used_pmem_memory] <= [status r max_pmem_memory]}
+        assert {[status r pmem_reconstruct_time_ms] >= 0}
+    }
+
+    test {CONFIG RESETSTAT clears the tiering counters} {
+        r config resetstat
+        list [status r pmem_keyspace_hits] [status r dram_keyspace_hits] \
+            [status r pmem_evicted_keys] [status r pmem_commits]
+    } {0 0 0 0}
+}
+
+file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list appendonly yes max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]]] {
+    if {[catch {r pmemtrace} err]} {
+        test {PMEMTRACE is not compiled in by default} {
+            assert_match "*not compiled in*" $err
+        }
+    } else {
+        test {PMEMTRACE records the evictions and the AOF feed} {
+            r pmemtrace reset
+            for {set j 1} {$j <= 800} {incr j} {
+                r set k$j v$j
+            }
+            set trace [join [r pmemtrace 100000] "\n"]
+            foreach event {evict-start evict-key victims-link aof-feed} {
+                assert_match "* $event *" $trace
+            }
+        }
+
+        test {PMEMTRACE keeps the last records of the ring} {
+            r pmemtrace reset
+            for {set j 1} {$j <= 5000} {incr j} {
+                r set k$j v$j
+            }
+            set seq {}
+            foreach line [r pmemtrace 100000] {
+                if {[regexp {^thread=0 seq=(\d+) } $line -> s]} {
+                    lappend seq $s
+                }
+            }
+            assert_equal 4096 [llength $seq]
+            assert {[lindex $seq 0] > 0}
+            assert_equal [expr {[lindex $seq 0] + 4095}] [lindex $seq end]
+        }
+
+        test {The crash report holds the trace} {
+            catch {r debug segfault}
+            wait_for_condition 50 100 {
+                [string match "*TODIS TRACE*evict-key*" \
+                    [exec cat [srv 0 stdout]]]
+            } else {
+                fail "No trace in the crash report"
+            }
+        }
+    }
+}
+
+file delete "$server_path/todis.pm" "$server_path/appendonly.aof"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list appendonly yes appendfsync everysec max-pmem-memory 100kb \
+        max-pmem-memory-policy allkeys-lru]]] {
+    test {PMEM victims are reclaimed once the AOF is fsynced} {
+        for {set j 1} {$j <= 1000} {incr j} {
+            r set key$j val$j
+        }
+        assert {[status r pmem_evicted_keys] > 200}
+        wait_for_condition 50 100 {
+            [status r pmem_victim_list_length] == 0 &&
+            [status r pmem_pending_victim_frees] == 0 &&
+            [status r pmem_reclaim_segments] == 0
+        } else {
+            fail "PMEM victims not reclaimed"
+        }
+        assert_equal [status r pmem_reclaim_epoch] \
+            [status r pmem_reclaim_durable_epoch]
+        assert_match "*,victims=0" [status r pmem_shard0]
+        assert {[status r pmem_reclaimed_victims] >=
+            [status r pmem_evicted_keys]}
+        assert {[status r used_pmem_memory] <= [status r max_pmem_memory]}
+    }
+
+    test {Reclaimed PMEM memory is reused by new keys} {
+        set used [status r used_pmem_memory]
+        for {set j 1} {$j <= 1000} {incr j} {
+            r set new$j val$j
+        }
+        wait_for_condition 50 100 {
+            [status r pmem_victim_list_length] == 0
+        } else {
+            fail "PMEM victims not reclaimed"
+        }
+        list [r get key1] [r get new1000] [r dbsize] \
+            [expr {[status r used_pmem_memory] <= [status r max_pmem_memory]}]
+    } {val1 val1000 2000 1}
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides [concat $defaults \
+    [list pmem-read-cache-size 1mb]]] {
+    test {The read cache copies a PMEM value read twice} {
+        set val [string repeat a 100]
+        r set foo $val
+        r config resetstat
+        set reply {}
+        for {set j 0} {$j < 3} {incr j} {
+            assert_equal $val [r get foo]
+            lappend reply [status r pmem_read_cache_keys]
+        }
+        lappend reply [status r pmem_read_cache_hits] \
+            [status r pmem_read_cache_misses]
+    } {0 1 1 1 2}
+
+    test {A write invalidates the cached value} {
+        r set foo [string repeat b 100]
+        assert_equal 0 [status r pmem_read_cache_keys]
+        assert_equal embpm [r object encoding foo]
+        r get foo
+        r get foo
+        assert_equal 1 [status r pmem_read_cache_keys]
+        r append foo c
+        set reply [list [status r pmem_read_cache_keys] \
+            [string range [r get foo] 99 end]]
+        r get foo
+        r del foo
+        lappend reply [status r pmem_read_cache_keys] [r get foo]
+    } {0 bc 0 {}}
+
+    test {The read cache evicts with CLOCK within its size} {
+        r config set pmem-read-cache-size 20kb
+        for {set j 0} {$j < 500} {incr j} {
+            r set key$j [string repeat x 100]
+        }
+        for {set k 0} {$k < 2} {incr k} {
+            for {set j 0} {$j < 500} {incr j} {
+                r get key$j
+            }
+        }
+        assert {[status r pmem_read_cache_evictions] > 0}
+        assert {[status r pmem_read_cache_used] <= 20480}
+        assert {[status r pmem_read_cache_keys] > 0}
+        r config set pmem-read-cache-size 0
+        list [status r pmem_read_cache_keys] [status r pmem_read_cache_used] \
+            [r get key42]
+    } [list 0 0 [string repeat x 100]]
+}
+
+file delete "$server_path/todis.pm"
+start_server [list tags {"todis"} overrides $defaults] {
+    test {Active expiry frees the expired PMEM keys} {
+        set used [status r used_pmem_memory]
+        for {set j 0} {$j < 100} {incr j} {
+            r set volatile$j val$j px 100
+        }
+        r set persistent val
+        assert {[status r used_pmem_memory] > $used}
+        # No key is accessed: only the active expire cycle frees them.
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "The PMEM keys are not expired"
+        }
+        r del persistent
+        assert_equal $used [status r used_pmem_memory]
+        r dbsize
+    } {0}
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Compares the SET throughput and the 99th percentile latency of the two
+# PMEM write paths (pmem-write-path transaction|publish) of a running TODIS
+# server. The database is flushed before every run.
+#
+# Usage: todis-write-path-bench.sh [host] [port]
+#
+# The runs can be sized with the environment variables REQUESTS (default
+# 200000), KEYSPACE (random keys, default 100000), CLIENTS (default 50),
+# DATASIZE (value size in bytes, default 64) and PIPELINE (default 1).
+
+HOST=${1:-127.0.0.1}
+PORT=${2:-6379}
+REQUESTS=${REQUESTS:-200000}
+KEYSPACE=${KEYSPACE:-100000}
+CLIENTS=${CLIENTS:-50}
+DATASIZE=${DATASIZE:-64}
+PIPELINE=${PIPELINE:-1}
+
+BINDIR=$(dirname $0)/../src
+CLI="$BINDIR/redis-cli -h $HOST -p $PORT"
+BENCHMARK="$BINDIR/redis-benchmark -h $HOST -p $PORT"
+
+ORIG_PATH=$($CLI config get pmem-write-path | tail -1)
+if [ -z "$ORIG_PATH" ]
+then
+    echo "The server at $HOST:$PORT has no pmem-write-path option." >&2
+    exit 1
+fi
+
+printf "%-12s %12s %12s\n" "write-path" "requests/s" "p99 (ms)"
+for WRITE_PATH in transaction publish
+do
+    $CLI config set pmem-write-path $WRITE_PATH > /dev/null || exit 1
+    $CLI flushall > /dev/null
+    # Random keys: the first SET of a key adds a record, the next ones
+    # publish a new value.
+    $BENCHMARK -t set -n $REQUESTS -r $KEYSPACE -c $CLIENTS \
+        -d $DATASIZE -P $PIPELINE | tr '\r' '\n' | awk -v path=$WRITE_PATH '
+        /% <=/ { pct = $1 + 0; if (p99 == "" && pct >= 99) p99 = $3 }
+        /requests per second/ { rps = $1 }
+        END { printf "%-12s %12s %12s\n", path, rps, p99 }'
+done
+$CLI config set pmem-write-path $ORIG_PATH > /dev/null